@@ -1,13 +1,16 @@
 /**
- * @brief Pruned NatNet 4.0 library, obtaining only the first rigid body data
+ * @brief Pruned NatNet 4.0 library, obtaining only the rigid body data
  */
 #include "PrunedNatNet.hpp"
+#include "seqlock.hpp"
 #include <iostream>
 #include <cinttypes>
 #include <climits>
 #include <cstring>
+#include <ctime>
 
 #include <unistd.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -16,17 +19,37 @@
 #include <cmath>
 
 #include <fstream>
+
+// pigpio is only needed by the controller, define MOTOR_USE_PIGPIO to 0 to
+// build the decoder without it
+#ifndef MOTOR_USE_PIGPIO
+#define MOTOR_USE_PIGPIO 1
+#endif
+#if MOTOR_USE_PIGPIO
 #include <pigpio.h>
+#endif
 
 
+// same clock as Get_time() in motor.cpp
 int64_t Get_time_1()
 {
-    int sec, mic;
-    gpioTime(PI_TIME_RELATIVE, &sec, &mic);
-    return sec * 1000000 + mic;
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// CLOCK_REALTIME minus the clock of Get_time_1() in us, the kernel stamps
+// datagrams with the former
+int64_t Realtime_offset()
+{
+    timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (int64_t(real.tv_sec) - int64_t(mono.tv_sec)) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
 }
 
-std::ofstream timefile("./timestamp.csv");
+// opened by Init(), so that a program only decoding does not write it
+std::ofstream timefile;
 
 #define DEBUG_PRINT_ENABLED 0
 
@@ -67,12 +90,31 @@ namespace Optitrack
     {
         /**********************************************/
         /**********************************************/
-        // buffer len >=3 should be fine
+        // the listen thread pushes, any thread reads the latest without
+        // locks. a reader only retries if it falls buffer_len frames behind
+        // while copying
         constexpr size_t buffer_len = 4;
-        // a buffer of state
-        Solid_Body_State state_buffer[buffer_len];
-        // at which position is the latest state
-        size_t state_pos = 0;
+        // the first rigid body of frames in which it is tracked
+        Motor::Seqlock_ring<Solid_Body_State, buffer_len> state_ring;
+        // whole frames
+        Motor::Seqlock_ring<Frame_State, buffer_len> frame_ring;
+
+        // a rigid body, and the push of frame_ring that brought it
+        struct Indexed_State
+        {
+            Solid_Body_State state;
+            uint64_t push = 0;
+        };
+        // every rigid body in a slot of its own, so that Get_state(ID) copies
+        // one body instead of a frame
+        Motor::Seqlock<Indexed_State> body_states[max_rigid_bodies];
+        // streaming ID to slot in body_states, open addressing. an entry is
+        // ID << 8 | (slot + 1), 0 if free. only the listen thread adds, slots
+        // are never given back
+        constexpr size_t id_index_len = 2 * max_rigid_bodies;
+        std::atomic<uint64_t> id_index[id_index_len];
+        // slots given out so far, only touched by the listen thread
+        int indexed_bodies = 0;
         /**********************************************/
         /**********************************************/
 
@@ -123,8 +165,15 @@ namespace Optitrack
             } Data; // Payload incoming from NatNet Server
         } sPacket;
 
-        // a temporary variable to store the state as we gradually unpack the packet.
-        Solid_Body_State temp_state;
+        // a temporary variable to store the frame as we gradually unpack the packet.
+        Frame_State temp_frame;
+
+        // datagrams read by one recvmmsg() at most
+        constexpr unsigned int receive_batch = 8;
+        // big enough for any frame of data
+        constexpr size_t receive_len = 20000;
+        // whether the kernel stamps the datagrams, see SO_TIMESTAMPNS
+        bool kernel_timestamps = false;
 
         /**
          * \brief Unpack packet header and print contents
@@ -146,23 +195,100 @@ namespace Optitrack
             return ptr;
         }
 
+        /**
+         * \brief whether every section of a frame starts with its size in bytes
+         * \param major - NatNet major version
+         * \param minor - NatNet minor version
+         * \return - true for NatNet 4.1 and later
+         */
+        bool HasDataSize(int major, int minor)
+        {
+            return ((major == 4) && (minor > 0)) || (major > 4);
+        }
+
+        /**
+         * \brief whether n more bytes from ptr are in the packet
+         * \param ptr - input data stream pointer, never past end
+         * \param end - end of the packet
+         * \param n - number of bytes, could be negative or huge if read
+         * from a bad packet
+         * \return - true if they are all there
+         */
+        inline bool HasBytes(const char *ptr, const char *end, int64_t n)
+        {
+            // a negative n turns huge, so one comparison does
+            return uint64_t(n) <= uint64_t(end - ptr);
+        }
+
+        /**
+         * \brief Skip a whole section by its size, NatNet 4.1 and later only
+         * \param ptr - pointer to the count of the section, the count and
+         * size have to be in the packet
+         * \param end - end of the packet
+         * \return - pointer after the section, nullptr if it or the 8 bytes
+         * after it are past end. every section is followed by the count and
+         * size of the next one or by the suffix, so they are checked here
+         * too and the next call could read them right away
+         */
+        char *SkipSection(char *ptr, char *end)
+        {
+            int nBytes = 0;
+            memcpy(&nBytes, ptr + 4, 4);
+            ptr += 8;
+            // as unsigned, so a negative size is too big
+            return HasBytes(ptr, end, int64_t(uint32_t(nBytes)) + 8) ? (ptr + nBytes) : nullptr;
+        }
+
+        /**
+         * \brief Size of a rigid body of a skeleton
+         * \param major - NatNet major version
+         * \param minor - NatNet minor version
+         * \return - bytes of the rigid body
+         */
+        int BoneBytes(int major, int minor)
+        {
+            // ID, position and orientation
+            int nBytes = 32;
+            // mean marker error
+            if (major >= 2)
+            {
+                nBytes += 4;
+            }
+            // params
+            if (((major == 2) && (minor >= 6)) || (major > 2) || (major == 0))
+            {
+                nBytes += 2;
+            }
+            return nBytes;
+        }
+
         /**
          * \brief Unpack number of bytes of data for a given data type.
          * Useful if you want to skip this type of data.
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackDataSize(char *ptr, int major, int minor, int &nBytes, bool skip = false)
+        char *UnpackDataSize(char *ptr, char *end, int major, int minor, int &nBytes, bool skip = false)
         {
             nBytes = 0;
 
             // size of all data for this data type (in bytes);
-            if (((major == 4) && (minor > 0)) || (major > 4))
+            if (HasDataSize(major, minor))
             {
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nBytes, ptr, 4);
                 ptr += 4;
+                if (!HasBytes(ptr, end, nBytes))
+                {
+                    return nullptr;
+                }
                 if (skip)
                 {
                     ptr += nBytes;
@@ -174,16 +300,27 @@ namespace Optitrack
         /**
          * \brief Unpack frame prefix data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \param frame - output frame
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackFramePrefixData(char *ptr, int major, int minor)
+        char *UnpackFramePrefixData(char *ptr, char *end, int major, int minor, Frame_State &frame)
         {
+            if (!HasBytes(ptr, end, 4))
+            {
+                return nullptr;
+            }
+
             // Next 4 Bytes is the frame number
             int frameNumber = 0;
             memcpy(&frameNumber, ptr, 4);
-            temp_state.frameNumber = frameNumber;
+            frame.frameNumber = frameNumber;
+            frame.cameraMidExposureTimestamp = 0;
+            frame.nRigidBodies = 0;
+            frame.nSkipped = 0;
             ptr += 4;
             return ptr;
         }
@@ -214,21 +351,59 @@ namespace Optitrack
         /**
          * \brief Unpack markerset data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackMarkersetData(char *ptr, int major, int minor)
+        char *UnpackMarkersetData(char *ptr, char *end, int major, int minor)
         {
             // First 4 Bytes is the number of data sets (markersets, rigidbodies, etc)
             int nMarkerSets = 0;
+            if (!HasBytes(ptr, end, 4))
+            {
+                return nullptr;
+            }
             memcpy(&nMarkerSets, ptr, 4);
             ptr += 4;
             // printf("Marker Set Count : %3.1d\n", nMarkerSets);
 
             // directly skip this!
             int nBytes = 0;
-            ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+            ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+            if (!ptr)
+            {
+                return nullptr;
+            }
+
+            // older versions have no size, walk over the names and markers
+            if (!HasDataSize(major, minor))
+            {
+                for (int i = 0; i < nMarkerSets; i++)
+                {
+                    // the name has to end in the packet
+                    const char *name_end = (const char *)memchr(ptr, 0, end - ptr);
+                    if (!name_end)
+                    {
+                        return nullptr;
+                    }
+                    ptr += name_end - ptr + 1;
+
+                    int nMarkers = 0;
+                    if (!HasBytes(ptr, end, 4))
+                    {
+                        return nullptr;
+                    }
+                    memcpy(&nMarkers, ptr, 4);
+                    ptr += 4;
+                    if (!HasBytes(ptr, end, int64_t(nMarkers) * 3 * sizeof(float)))
+                    {
+                        return nullptr;
+                    }
+                    ptr += nMarkers * 3 * sizeof(float);
+                }
+            }
 
             // // Loop through number of marker sets and get name and data
             // for (int i = 0; i < nMarkerSets; i++)
@@ -268,20 +443,40 @@ namespace Optitrack
         /**
          * \brief legacy 'other' unlabeled marker and print contents (will be deprecated)
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackLegacyOtherMarkers(char *ptr, int major, int minor)
+        char *UnpackLegacyOtherMarkers(char *ptr, char *end, int major, int minor)
         {
             // First 4 Bytes is the number of Other markers
             int nOtherMarkers = 0;
+            if (!HasBytes(ptr, end, 4))
+            {
+                return nullptr;
+            }
             memcpy(&nOtherMarkers, ptr, 4);
             ptr += 4;
 
             // directly skip this!
             int nBytes;
-            ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+            ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+            if (!ptr)
+            {
+                return nullptr;
+            }
+
+            // older versions have no size, walk over the markers
+            if (!HasDataSize(major, minor))
+            {
+                if (!HasBytes(ptr, end, int64_t(nOtherMarkers) * 3 * sizeof(float)))
+                {
+                    return nullptr;
+                }
+                ptr += nOtherMarkers * 3 * sizeof(float);
+            }
 
             // for (int j = 0; j < nOtherMarkers; j++)
             // {
@@ -303,180 +498,218 @@ namespace Optitrack
         /**
          * \brief Unpack rigid body data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \param frame - output frame
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackRigidBodyData(char *ptr, int major, int minor)
+        char *UnpackRigidBodyData(char *ptr, char *end, int major, int minor, Frame_State &frame)
         {
             // Loop through rigidbodies
             int nRigidBodies = 0;
+            if (!HasBytes(ptr, end, 4))
+            {
+                return nullptr;
+            }
             memcpy(&nRigidBodies, ptr, 4);
             ptr += 4;
+            if (nRigidBodies < 0)
+            {
+                return nullptr;
+            }
             // printf("Rigid Body Count : %3.1d\n", nRigidBodies);
 
             int nBytes = 0;
-            ptr = UnpackDataSize(ptr, major, minor, nBytes);
+            ptr = UnpackDataSize(ptr, end, major, minor, nBytes);
+            if (!ptr)
+            {
+                return nullptr;
+            }
 
-            for (int j = 0; j < nRigidBodies; j++)
+            // mean marker error and params after the markers of every body
+            int nTailBytes = 0;
+            if ((major >= 2) || (major == 0))
             {
-                // Rigid body position and orientation
-                int ID = 0;
-                memcpy(&ID, ptr, 4);
-                ptr += 4;
-                float x = 0.0f;
-                memcpy(&x, ptr, 4);
-                ptr += 4;
-                float y = 0.0f;
-                memcpy(&y, ptr, 4);
-                ptr += 4;
-                float z = 0.0f;
-                memcpy(&z, ptr, 4);
-                ptr += 4;
-                float qx = 0;
-                memcpy(&qx, ptr, 4);
-                ptr += 4;
-                float qy = 0;
-                memcpy(&qy, ptr, 4);
-                ptr += 4;
-                float qz = 0;
-                memcpy(&qz, ptr, 4);
-                ptr += 4;
-                float qw = 0;
-                memcpy(&qw, ptr, 4);
-                ptr += 4;
+                nTailBytes += 4;
+            }
+            if (((major == 2) && (minor >= 6)) || (major > 2) || (major == 0))
+            {
+                nTailBytes += 2;
+            }
 
-                // we are recording only one solid body
-                if (j == 0)
+            // from NatNet 3.0 the bodies have no markers and are all the same
+            // size, so they are checked at once and read without branches
+            if ((major >= 3) || (major == 0))
+            {
+                const int nBodyBytes = 32 + nTailBytes;
+                if (!HasBytes(ptr, end, int64_t(nRigidBodies) * nBodyBytes))
                 {
-                    temp_state.ID = ID;
-                    temp_state.x = x;
-                    temp_state.y = y;
-                    temp_state.z = z;
-                    temp_state.qx = qx;
-                    temp_state.qy = qy;
-                    temp_state.qz = qz;
-                    temp_state.qw = qw;
+                    return nullptr;
                 }
 
-                // printf("  RB: %3.1d ID : %3.1d\n", j, ID);
-                // printf("    Position    : [%3.2f, %3.2f, %3.2f]\n", x, y, z);
-                // printf("    Orientation : [%3.2f, %3.2f, %3.2f, %3.2f]\n", qx, qy, qz, qw);
+                frame.nRigidBodies = (nRigidBodies < max_rigid_bodies) ? nRigidBodies : max_rigid_bodies;
+                frame.nSkipped = nRigidBodies - frame.nRigidBodies;
+                for (int j = 0; j < frame.nRigidBodies; j++)
+                {
+                    Solid_Body_State &body = frame.rigidBodies[j];
+                    memcpy(&body.ID, ptr, 4);
+                    memcpy(&body.x, ptr + 4, 4);
+                    memcpy(&body.y, ptr + 8, 4);
+                    memcpy(&body.z, ptr + 12, 4);
+                    memcpy(&body.qx, ptr + 16, 4);
+                    memcpy(&body.qy, ptr + 20, 4);
+                    memcpy(&body.qz, ptr + 24, 4);
+                    memcpy(&body.qw, ptr + 28, 4);
+                    memcpy(&body.fError, ptr + 32, 4);
+                    short params = 0;
+                    memcpy(&params, ptr + 36, 2);
+                    body.bTrackingValid = params & 0x01; // 0x01 : rigid body was successfully tracked in this frame
+                    ptr += nBodyBytes;
+                }
+
+                // the ones beyond the table
+                return ptr + int64_t(frame.nSkipped) * nBodyBytes;
+            }
+
+            for (int j = 0; j < nRigidBodies; j++)
+            {
+                // bodies beyond the table are decoded into a scratch slot
+                // so that the packet is still walked through
+                Solid_Body_State scratch;
+                Solid_Body_State &body = (j < max_rigid_bodies) ? frame.rigidBodies[j] : scratch;
+
+                // Rigid body position and orientation
+                if (!HasBytes(ptr, end, 32))
+                {
+                    return nullptr;
+                }
+                memcpy(&body.ID, ptr, 4);
+                memcpy(&body.x, ptr + 4, 4);
+                memcpy(&body.y, ptr + 8, 4);
+                memcpy(&body.z, ptr + 12, 4);
+                memcpy(&body.qx, ptr + 16, 4);
+                memcpy(&body.qy, ptr + 20, 4);
+                memcpy(&body.qz, ptr + 24, 4);
+                memcpy(&body.qw, ptr + 28, 4);
+                ptr += 32;
+
+                // printf("  RB: %3.1d ID : %3.1d\n", j, body.ID);
+                // printf("    Position    : [%3.2f, %3.2f, %3.2f]\n", body.x, body.y, body.z);
+                // printf("    Orientation : [%3.2f, %3.2f, %3.2f, %3.2f]\n", body.qx, body.qy, body.qz, body.qw);
 
                 // Marker positions removed as redundant (since they can be derived from RB Pos/Ori plus initial offset) in NatNet 3.0 and later to optimize packet size
                 if (major < 3)
                 {
-                    // Associated marker positions
+                    // Associated marker positions, directly skip them
                     int nRigidMarkers = 0;
+                    if (!HasBytes(ptr, end, 4))
+                    {
+                        return nullptr;
+                    }
                     memcpy(&nRigidMarkers, ptr, 4);
                     ptr += 4;
-                    // printf("Marker Count: %d\n", nRigidMarkers);
-                    int nBytes = nRigidMarkers * 3 * sizeof(float);
-                    float *markerData = (float *)malloc(nBytes);
-                    memcpy(markerData, ptr, nBytes);
-                    ptr += nBytes;
 
-                    // NatNet Version 2.0 and later
+                    // positions, and IDs and sizes from NatNet Version 2.0
+                    int64_t nMarkerBytes = int64_t(nRigidMarkers) * 3 * sizeof(float);
                     if (major >= 2)
                     {
-                        // Associated marker IDs
-                        nBytes = nRigidMarkers * sizeof(int);
-                        int *markerIDs = (int *)malloc(nBytes);
-                        memcpy(markerIDs, ptr, nBytes);
-                        ptr += nBytes;
-
-                        // Associated marker sizes
-                        nBytes = nRigidMarkers * sizeof(float);
-                        float *markerSizes = (float *)malloc(nBytes);
-                        memcpy(markerSizes, ptr, nBytes);
-                        ptr += nBytes;
-
-                        for (int k = 0; k < nRigidMarkers; k++)
-                        {
-                            // printf("  Marker %d: id=%d  size=%3.1f  pos=[%3.2f, %3.2f, %3.2f]\n",
-                            //       k, markerIDs[k], markerSizes[k],
-                            //       markerData[k * 3], markerData[k * 3 + 1], markerData[k * 3 + 2]);
-                        }
-
-                        if (markerIDs)
-                            free(markerIDs);
-                        if (markerSizes)
-                            free(markerSizes);
+                        nMarkerBytes += int64_t(nRigidMarkers) * (sizeof(int) + sizeof(float));
                     }
-                    // Print marker positions for all rigid bodies
-                    else
+                    if (!HasBytes(ptr, end, nMarkerBytes))
                     {
-                        int k3;
-                        for (int k = 0; k < nRigidMarkers; k++)
-                        {
-                            k3 = k * 3;
-                            // printf("  Marker %d: pos = [%3.2f, %3.2f, %3.2f]\n",
-                            //       k, markerData[k3], markerData[k3 + 1], markerData[k3 + 2]);
-                        }
+                        return nullptr;
                     }
+                    ptr += nMarkerBytes;
+                }
 
-                    if (markerData)
-                        free(markerData);
+                if (!HasBytes(ptr, end, nTailBytes))
+                {
+                    return nullptr;
                 }
 
                 // NatNet version 2.0 and later
+                body.fError = 0.0f;
                 if ((major >= 2) || (major == 0))
                 {
                     // Mean marker error
-                    float fError = 0.0f;
-                    memcpy(&fError, ptr, 4);
+                    memcpy(&body.fError, ptr, 4);
                     ptr += 4;
-
-                    // we are recording only one solid body
-                    if (j == 0)
-                    {
-                        temp_state.fError = fError;
-                    }
-                    // printf("\tMean Marker Error: %3.2f\n", fError);
+                    // printf("\tMean Marker Error: %3.2f\n", body.fError);
                 }
 
                 // NatNet version 2.6 and later
+                body.bTrackingValid = true;
                 if (((major == 2) && (minor >= 6)) || (major > 2) || (major == 0))
                 {
                     // params
                     short params = 0;
                     memcpy(&params, ptr, 2);
                     ptr += 2;
-                    bool bTrackingValid = params & 0x01; // 0x01 : rigid body was successfully tracked in this frame
-
-                    // we are recording only one solid body
-                    if (j == 0)
-                    {
-                        temp_state.bTrackingValid = bTrackingValid;
-                    }
-                    // printf("\tTracking Valid: %s\n", (bTrackingValid) ? "True" : "False");
+                    body.bTrackingValid = params & 0x01; // 0x01 : rigid body was successfully tracked in this frame
+                    // printf("\tTracking Valid: %s\n", (body.bTrackingValid) ? "True" : "False");
                 }
 
             } // Go to next rigid body
 
+            frame.nRigidBodies = (nRigidBodies < max_rigid_bodies) ? nRigidBodies : max_rigid_bodies;
+            frame.nSkipped = nRigidBodies - frame.nRigidBodies;
+
             return ptr;
         }
 
         /**
          * \brief Unpack skeleton data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackSkeletonData(char *ptr, int major, int minor)
+        char *UnpackSkeletonData(char *ptr, char *end, int major, int minor)
         {
             // Skeletons (NatNet version 2.1 and later)
             if (((major == 2) && (minor > 0)) || (major > 2))
             {
                 int nSkeletons = 0;
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nSkeletons, ptr, 4);
                 ptr += 4;
                 // printf("Skeleton Count : %d\n", nSkeletons);
 
                 // directly skip
                 int nBytes = 0;
-                ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+                ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+                if (!ptr)
+                {
+                    return nullptr;
+                }
+
+                // older versions have no size, walk over the skeletons
+                if (!HasDataSize(major, minor))
+                {
+                    for (int j = 0; j < nSkeletons; j++)
+                    {
+                        // skeleton ID and number of bones
+                        int nBones = 0;
+                        if (!HasBytes(ptr, end, 8))
+                        {
+                            return nullptr;
+                        }
+                        memcpy(&nBones, ptr + 4, 4);
+                        ptr += 8;
+                        if (!HasBytes(ptr, end, int64_t(nBones) * BoneBytes(major, minor)))
+                        {
+                            return nullptr;
+                        }
+                        ptr += nBones * BoneBytes(major, minor);
+                    }
+                }
 
                 // // Loop through skeletons
                 // for (int j = 0; j < nSkeletons; j++)
@@ -658,23 +891,33 @@ namespace Optitrack
         /**
          * \brief Unpack Asset data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackAssetData(char *ptr, int major, int minor)
+        char *UnpackAssetData(char *ptr, char *end, int major, int minor)
         {
             // Assets ( Motive 3.1 / NatNet 4.1 and greater)
             if (((major == 4) && (minor > 0)) || (major > 4))
             {
                 int nAssets = 0;
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nAssets, ptr, 4);
                 ptr += 4;
                 // printf("Asset Count : %d\n", nAssets);
 
                 // directly skip
                 int nBytes = 0;
-                ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+                ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+                if (!ptr)
+                {
+                    return nullptr;
+                }
 
                 // for (int i = 0; i < nAssets; i++)
                 // {
@@ -731,23 +974,55 @@ namespace Optitrack
         /**
          * \brief Unpack labeled marker data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackLabeledMarkerData(char *ptr, int major, int minor)
+        char *UnpackLabeledMarkerData(char *ptr, char *end, int major, int minor)
         {
             // labeled markers (NatNet version 2.3 and later)
             // labeled markers - this includes all markers: Active, Passive, and 'unlabeled' (markers with no asset but a PointCloud ID)
             if (((major == 2) && (minor >= 3)) || (major > 2))
             {
                 int nLabeledMarkers = 0;
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nLabeledMarkers, ptr, 4);
                 ptr += 4;
                 // printf("Labeled Marker Count : %d\n", nLabeledMarkers);
 
                 int nBytes = 0;
-                ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+                ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+                if (!ptr)
+                {
+                    return nullptr;
+                }
+
+                // older versions have no size, walk over the markers
+                if (!HasDataSize(major, minor))
+                {
+                    // ID, position and size
+                    int nMarkerBytes = 20;
+                    // params
+                    if (((major == 2) && (minor >= 6)) || (major > 2) || (major == 0))
+                    {
+                        nMarkerBytes += 2;
+                    }
+                    // residual
+                    if ((major >= 3) || (major == 0))
+                    {
+                        nMarkerBytes += 4;
+                    }
+                    if (!HasBytes(ptr, end, int64_t(nLabeledMarkers) * nMarkerBytes))
+                    {
+                        return nullptr;
+                    }
+                    ptr += nLabeledMarkers * nMarkerBytes;
+                }
 
                 // // Loop through labeled markers
                 // for (int j = 0; j < nLabeledMarkers; j++)
@@ -825,22 +1100,63 @@ namespace Optitrack
         /**
          * \brief Unpack force plate data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackForcePlateData(char *ptr, int major, int minor)
+        char *UnpackForcePlateData(char *ptr, char *end, int major, int minor)
         {
             // Force Plate data (NatNet version 2.9 and later)
             if (((major == 2) && (minor >= 9)) || (major > 2))
             {
                 int nForcePlates;
                 const int kNFramesShowMax = 4;
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nForcePlates, ptr, 4);
                 ptr += 4;
 
                 int nBytes = 0;
-                ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+                ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+                if (!ptr)
+                {
+                    return nullptr;
+                }
+
+                // older versions have no size, walk over the channels
+                if (!HasDataSize(major, minor))
+                {
+                    for (int j = 0; j < nForcePlates; j++)
+                    {
+                        // ID and number of channels
+                        int nChannels = 0;
+                        if (!HasBytes(ptr, end, 8))
+                        {
+                            return nullptr;
+                        }
+                        memcpy(&nChannels, ptr + 4, 4);
+                        ptr += 8;
+                        for (int k = 0; k < nChannels; k++)
+                        {
+                            int nFrames = 0;
+                            if (!HasBytes(ptr, end, 4))
+                            {
+                                return nullptr;
+                            }
+                            memcpy(&nFrames, ptr, 4);
+                            ptr += 4;
+                            if (!HasBytes(ptr, end, int64_t(nFrames) * sizeof(float)))
+                            {
+                                return nullptr;
+                            }
+                            ptr += nFrames * sizeof(float);
+                        }
+                    }
+                }
 
                 // for (int iForcePlate = 0; iForcePlate < nForcePlates; iForcePlate++)
                 // {
@@ -889,22 +1205,63 @@ namespace Optitrack
         /**
          * \brief Unpack device data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackDeviceData(char *ptr, int major, int minor)
+        char *UnpackDeviceData(char *ptr, char *end, int major, int minor)
         {
             // Device data (NatNet version 3.0 and later)
             if (((major == 2) && (minor >= 11)) || (major > 2))
             {
                 const int kNFramesShowMax = 4;
                 int nDevices;
+                if (!HasBytes(ptr, end, 4))
+                {
+                    return nullptr;
+                }
                 memcpy(&nDevices, ptr, 4);
                 ptr += 4;
 
                 int nBytes = 0;
-                ptr = UnpackDataSize(ptr, major, minor, nBytes, true);
+                ptr = UnpackDataSize(ptr, end, major, minor, nBytes, true);
+                if (!ptr)
+                {
+                    return nullptr;
+                }
+
+                // older versions have no size, walk over the channels
+                if (!HasDataSize(major, minor))
+                {
+                    for (int j = 0; j < nDevices; j++)
+                    {
+                        // ID and number of channels
+                        int nChannels = 0;
+                        if (!HasBytes(ptr, end, 8))
+                        {
+                            return nullptr;
+                        }
+                        memcpy(&nChannels, ptr + 4, 4);
+                        ptr += 8;
+                        for (int k = 0; k < nChannels; k++)
+                        {
+                            int nFrames = 0;
+                            if (!HasBytes(ptr, end, 4))
+                            {
+                                return nullptr;
+                            }
+                            memcpy(&nFrames, ptr, 4);
+                            ptr += 4;
+                            if (!HasBytes(ptr, end, int64_t(nFrames) * sizeof(float)))
+                            {
+                                return nullptr;
+                            }
+                            ptr += nFrames * sizeof(float);
+                        }
+                    }
+                }
 
                 // for (int iDevice = 0; iDevice < nDevices; iDevice++)
                 // {
@@ -950,6 +1307,9 @@ namespace Optitrack
             return ptr;
         }
 
+        // the timecode is only formatted for printing, which costs more
+        // than decoding the whole frame
+#if DEBUG_PRINT_ENABLED
         /**
          * \brief Funtion that assigns a time code values to 5 variables passed as arguments
          * Requires an integer from the packet as the timecode and timecodeSubframe
@@ -996,16 +1356,40 @@ namespace Optitrack
 
             return bValid;
         }
+#endif
 
         /**
          * \brief Unpack suffix data and print contents
          * \param ptr - input data stream pointer
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \param frame - output frame
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackFrameSuffixData(char *ptr, int major, int minor)
+        char *UnpackFrameSuffixData(char *ptr, char *end, int major, int minor, Frame_State &frame)
         {
+            // the suffix is all fixed size, check it at once
+            int nSuffixBytes = 4 + 4 + 2 + 4;
+            if (major < 3)
+            {
+                nSuffixBytes += 4;
+            }
+            nSuffixBytes += (((major == 2) && (minor >= 7)) || (major > 2)) ? 8 : 4;
+            if ((major >= 3) || (major == 0))
+            {
+                nSuffixBytes += 24;
+            }
+            if (((major == 4) && (minor > 0)) || (major > 4) || (major == 0))
+            {
+                nSuffixBytes += 8;
+            }
+            if (!HasBytes(ptr, end, nSuffixBytes))
+            {
+                return nullptr;
+            }
+
             // software latency (removed in version 3.0)
             if (major < 3)
             {
@@ -1022,8 +1406,11 @@ namespace Optitrack
             unsigned int timecodeSub = 0;
             memcpy(&timecodeSub, ptr, 4);
             ptr += 4;
+#if DEBUG_PRINT_ENABLED
             char szTimecode[128] = "";
             TimecodeStringify(timecode, timecodeSub, szTimecode, 128);
+            printf("Timecode : %s\n", szTimecode);
+#endif
 
             // timestamp
             double timestamp = 0.0f;
@@ -1049,7 +1436,7 @@ namespace Optitrack
                 uint64_t cameraMidExposureTimestamp = 0;
                 memcpy(&cameraMidExposureTimestamp, ptr, 8);
                 ptr += 8;
-                temp_state.cameraMidExposureTimestamp = cameraMidExposureTimestamp;
+                frame.cameraMidExposureTimestamp = cameraMidExposureTimestamp;
                 // printf("Mid-exposure timestamp         : %" PRIu64 "\n", cameraMidExposureTimestamp);
 
                 uint64_t cameraDataReceivedTimestamp = 0;
@@ -1095,68 +1482,205 @@ namespace Optitrack
         }
 
         /**
-         * \brief Unpack frame description and print contents
+         * \brief Unpack frame description by walking every section
          * \param ptr - input data stream pointer
-         * \param targetPtr - pointer to maximum input memory location
+         * \param end - end of the packet
          * \param major - NatNet major version
          * \param minor - NatNet minor version
-         * \return - pointer after decoded object
+         * \param frame - output frame
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
          */
-        char *UnpackFrameData(char *inptr, int nBytes, int major, int minor)
+        char *UnpackFrameData(char *inptr, char *end, int major, int minor, Frame_State &frame)
         {
             char *ptr = inptr;
 
-            ptr = UnpackFramePrefixData(ptr, major, minor);
+            // every step returns nullptr if the packet ends before it does
+            ptr = UnpackFramePrefixData(ptr, end, major, minor, frame);
 
-            ptr = UnpackMarkersetData(ptr, major, minor);
+            ptr = ptr ? UnpackMarkersetData(ptr, end, major, minor) : nullptr;
 
-            ptr = UnpackLegacyOtherMarkers(ptr, major, minor);
+            ptr = ptr ? UnpackLegacyOtherMarkers(ptr, end, major, minor) : nullptr;
 
-            ptr = UnpackRigidBodyData(ptr, major, minor);
+            ptr = ptr ? UnpackRigidBodyData(ptr, end, major, minor, frame) : nullptr;
 
-            ptr = UnpackSkeletonData(ptr, major, minor);
+            ptr = ptr ? UnpackSkeletonData(ptr, end, major, minor) : nullptr;
 
             // Assets ( Motive 3.1 / NatNet 4.1 and greater)
             if (((major == 4) && (minor > 0)) || (major > 4))
             {
-                ptr = UnpackAssetData(ptr, major, minor);
+                ptr = ptr ? UnpackAssetData(ptr, end, major, minor) : nullptr;
+            }
+
+            ptr = ptr ? UnpackLabeledMarkerData(ptr, end, major, minor) : nullptr;
+
+            ptr = ptr ? UnpackForcePlateData(ptr, end, major, minor) : nullptr;
+
+            ptr = ptr ? UnpackDeviceData(ptr, end, major, minor) : nullptr;
+
+            ptr = ptr ? UnpackFrameSuffixData(ptr, end, major, minor, frame) : nullptr;
+
+            return ptr;
+        }
+
+        /**
+         * \brief Unpack frame description by jumping over the sections we
+         * do not use with their sizes, NatNet 4.1 and later only
+         * \param ptr - input data stream pointer
+         * \param end - end of the packet
+         * \param major - NatNet major version
+         * \param minor - NatNet minor version
+         * \param frame - output frame
+         * \return - pointer after decoded object, nullptr if the packet is
+         * malformed
+         */
+        char *UnpackFrameDataFast(char *inptr, char *end, int major, int minor, Frame_State &frame)
+        {
+            char *ptr = inptr;
+
+            // the frame number and the count and size of the marker sets
+            if (!HasBytes(ptr, end, 4 + 8))
+            {
+                return nullptr;
             }
+            ptr = UnpackFramePrefixData(ptr, end, major, minor, frame);
+
+            // marker sets and legacy other markers
+            ptr = SkipSection(ptr, end);
+            ptr = ptr ? SkipSection(ptr, end) : nullptr;
 
-            ptr = UnpackLabeledMarkerData(ptr, major, minor);
+            // rigid bodies are read in place, then jumped over as a whole,
+            // they could not read past their own section
+            char *rigidBodies = ptr;
+            ptr = ptr ? SkipSection(ptr, end) : nullptr;
+            if (!ptr || !UnpackRigidBodyData(rigidBodies, ptr, major, minor, frame))
+            {
+                return nullptr;
+            }
 
-            ptr = UnpackForcePlateData(ptr, major, minor);
+            // skeletons, assets, labeled markers, force plates and devices
+            for (int i = 0; i < 5 && ptr; i++)
+            {
+                ptr = SkipSection(ptr, end);
+            }
 
-            ptr = UnpackDeviceData(ptr, major, minor);
+            ptr = ptr ? UnpackFrameSuffixData(ptr, end, major, minor, frame) : nullptr;
 
-            ptr = UnpackFrameSuffixData(ptr, major, minor);
+            return ptr;
+        }
 
+        /**
+         * \brief Where to start looking for an ID in id_index
+         * \param ID - streaming ID of a rigid body
+         * \return index into id_index
+         */
+        inline size_t IdHash(const int ID)
+        {
+            // an odd factor keeps consecutive IDs apart
+            return size_t(uint32_t(ID) * 2654435761U) & (id_index_len - 1);
+        }
+
+        /**
+         * \brief Look up the slot of a rigid body in body_states
+         * \param ID - streaming ID of the rigid body
+         * \return slot, -1 if the ID has none
+         */
+        int FindSlot(const int ID)
+        {
+            size_t h = IdHash(ID);
+            for (size_t i = 0; i < id_index_len; i++)
+            {
+                uint64_t entry = id_index[h].load(std::memory_order_acquire);
+                if (entry == 0)
+                {
+                    return -1;
+                }
+                if (uint32_t(entry >> 8) == uint32_t(ID))
+                {
+                    return int(entry & 0xFF) - 1;
+                }
+                h = (h + 1) & (id_index_len - 1);
+            }
+            return -1;
+        }
+
+        /**
+         * \brief Give a rigid body a slot in body_states, only called from the
+         * listen thread
+         * \param ID - streaming ID of a rigid body that has no slot yet
+         * \return slot, -1 if every slot is taken
+         */
+        int AddSlot(const int ID)
+        {
+            if (indexed_bodies >= max_rigid_bodies)
+            {
+                return -1;
+            }
+
+            // at most half full, so there is always a free entry
+            size_t h = IdHash(ID);
+            while (id_index[h].load(std::memory_order_relaxed) != 0)
+            {
+                h = (h + 1) & (id_index_len - 1);
+            }
+
+            int slot = indexed_bodies++;
+            id_index[h].store(uint64_t(uint32_t(ID)) << 8 | uint64_t(slot + 1), std::memory_order_release);
+            return slot;
+        }
+
+        /**
+         * \brief Print the frame, and store it so the getters could read it
+         * \param frame - frame decoded by Unpack()
+         */
+        void PublishFrame(const Frame_State &frame)
+        {
 #if DEBUG_PRINT_ENABLED
-            printf("Frame #: %3.1d\n", temp_state.frameNumber);
+            printf("Frame #: %3.1d\n", frame.frameNumber);
 
-            printf("ID : %3.1d\n", temp_state.ID);
-            printf("Position : [%3.2f, %3.2f, %3.2f]\n", temp_state.x, temp_state.y, temp_state.z);
-            printf("Orientation : [%3.2f, %3.2f, %3.2f, %3.2f]\n", temp_state.qx, temp_state.qy, temp_state.qz, temp_state.qw);
+            for (int i = 0; i < frame.nRigidBodies; i++)
+            {
+                const Solid_Body_State &body = frame.rigidBodies[i];
+                printf("ID : %3.1d\n", body.ID);
+                printf("Position : [%3.2f, %3.2f, %3.2f]\n", body.x, body.y, body.z);
+                printf("Orientation : [%3.2f, %3.2f, %3.2f, %3.2f]\n", body.qx, body.qy, body.qz, body.qw);
 
-            printf("\tMean Marker Error : %3.2f\n", temp_state.fError);
-            printf("\tTracking Valid : %s\n", (temp_state.bTrackingValid) ? "True" : "False");
+                printf("\tMean Marker Error : %3.2f\n", body.fError);
+                printf("\tTracking Valid : %s\n", (body.bTrackingValid) ? "True" : "False");
+            }
 
-            printf("Mid-exposure timestamp : %lu\n", temp_state.cameraMidExposureTimestamp);
+            printf("Mid-exposure timestamp : %lu\n", frame.cameraMidExposureTimestamp);
 #endif
 
-            //printf("Heading : %.2f\n", atan2f(2.0F * temp_state.qx * temp_state.qz - 2.0F * temp_state.qy * temp_state.qw, 1.0F - 2.0F * temp_state.qy * temp_state.qy - 2.0F * temp_state.qz * temp_state.qz) * (180.0F / M_PI));
+            //printf("Heading : %.2f\n", atan2f(2.0F * frame.rigidBodies[0].qx * frame.rigidBodies[0].qz - 2.0F * frame.rigidBodies[0].qy * frame.rigidBodies[0].qw, 1.0F - 2.0F * frame.rigidBodies[0].qy * frame.rigidBodies[0].qy - 2.0F * frame.rigidBodies[0].qz * frame.rigidBodies[0].qz) * (180.0F / M_PI));
             
-            timefile << temp_state.frameNumber << "," << Get_time_1() << "\n";
+            timefile << frame.frameNumber << "," << Get_time_1() << "," << frame.receiveTimestamp << "\n";
 
-            // check the validity of the data and write to a file / add to a stack
-            if (temp_state.frameNumber != -1 && temp_state.cameraMidExposureTimestamp != 0 && temp_state.bTrackingValid && temp_state.ID != -1)
+            // every body into its slot first, tagged with the push of the
+            // frame, so that a reader who sees the push sees the bodies
+            Indexed_State indexed;
+            indexed.push = frame_ring.Pushes() + 1;
+            for (int i = 0; i < frame.nRigidBodies; i++)
             {
-                // update buffer
-                size_t next_state_pos = (state_pos + 1) % buffer_len;
-                state_buffer[next_state_pos] = temp_state;
-                state_pos = next_state_pos;
+                int ID = frame.rigidBodies[i].ID;
+                int slot = FindSlot(ID);
+                slot = (slot < 0) ? AddSlot(ID) : slot;
+                if (slot >= 0)
+                {
+                    indexed.state = frame.rigidBodies[i];
+                    body_states[slot].Write(indexed);
+                }
             }
 
-            return ptr;
+            // publish the frame
+            frame_ring.Push(frame);
+
+            // the first body only counts when it is tracked
+            const Solid_Body_State &first = frame.rigidBodies[0];
+            if (frame.nRigidBodies > 0 && first.bTrackingValid && first.ID != -1)
+            {
+                state_ring.Push(first);
+            }
         }
 
         /**************************************************************/
@@ -1168,55 +1692,73 @@ namespace Optitrack
         /**
          *      Receives pointer to bytes that represent a packet of data
          *
-         *      There are lots of print statements that show what
-         *      data is being stored
+         *      Only frames of data are decoded, into frame, the rest of the
+         *      messages are ignored.
          *
-         *      Most memcpy functions will assign the data to a variable.
-         *      Use this variable at your descretion.
-         *      Variables created for storing data do not exceed the
-         *      scope of this function.
-         *
-         * \brief Unpack data stream and print contents
-         * \param ptr - input data stream pointer
-         * \return - pointer after decoded object
+         * \brief Unpack data stream
+         * \param pData - input data stream pointer
+         * \param len - bytes received
+         * \param major - NatNet major version
+         * \param minor - NatNet minor version
+         * \param frame - output frame, receiveTimestamp is kept and copied
+         * to every rigid body
+         * \return - true if a frame of data with a frame number and a
+         * mid-exposure timestamp is decoded, false for any other message
+         * and for frames that are truncated or do not add up
          */
-        char *Unpack(char *pData)
+        bool Unpack(char *pData, int len, int major, int minor, Frame_State &frame)
         {
-            // Checks for NatNet Version number. Used later in function.
-            // Packets may be different depending on NatNet version.
-            int major = gNatNetVersion[0];
-            int minor = gNatNetVersion[1];
-            bool packetProcessed = true;
             char *ptr = pData;
 
+            if (len < 4)
+            {
+                return false;
+            }
+
             int messageID = 0;
             int nBytes = 0;
             int nBytesTotal = 0;
             ptr = UnpackPacketHeader(ptr, messageID, nBytes, nBytesTotal);
 
-            switch (messageID)
+            // the message has to be all there
+            if (messageID != NAT_FRAMEOFDATA || nBytesTotal > len)
             {
-            case NAT_FRAMEOFDATA:
+                return false;
+            }
+            char *end = ptr + nBytes;
+
+            // the sections we do not use are jumped over if they come with
+            // their sizes, walked over otherwise
+            if (HasDataSize(major, minor))
+            {
+                ptr = UnpackFrameDataFast(ptr, end, major, minor, frame);
+            }
+            else
             {
-                // Extract frame data flags (last 2 bytes in packet)
-                uint16_t params;
-                char *ptrToParams = ptr + (nBytes - 6); // 4 bytes for terminating 0 + 2 bytes for params
-                memcpy(&params, ptrToParams, 2);
-                bool bIsRecording = (params & 0x01) != 0;          // 0x01 Motive is recording
-                bool bTrackedModelsChanged = (params & 0x02) != 0; // 0x02 Actively tracked model list has changed
-                bool bLiveMode = (params & 0x04) != 0;             // 0x03 Live or Edit mode
+                ptr = UnpackFrameData(ptr, end, major, minor, frame);
+            }
 
-                ptr = UnpackFrameData(ptr, nBytes, major, minor);
-                break;
+            // a frame that does not add up is dropped whole
+            if (!ptr)
+            {
+                return false;
             }
-            default:
-                break;
+
+            // check the validity of the data
+            if (frame.frameNumber == -1 || frame.cameraMidExposureTimestamp == 0)
+            {
+                return false;
             }
 
-            // return the beginning of the possible next packet
-            // assuming no additional termination
-            ptr = pData + nBytesTotal;
-            return ptr;
+            // every body carries the frame number and times of its frame
+            for (int i = 0; i < frame.nRigidBodies; i++)
+            {
+                frame.rigidBodies[i].frameNumber = frame.frameNumber;
+                frame.rigidBodies[i].cameraMidExposureTimestamp = frame.cameraMidExposureTimestamp;
+                frame.rigidBodies[i].receiveTimestamp = frame.receiveTimestamp;
+            }
+
+            return true;
         }
 
         /***********************************************/
@@ -1228,19 +1770,72 @@ namespace Optitrack
         // Data listener thread. Listens for incoming bytes from NatNet
         static void *DataListenThread(void *dummy)
         {
-            char szData[20000];
-            socklen_t addr_len = sizeof(struct sockaddr);
-            sockaddr_in TheirAddress{};
+            static char szData[receive_batch][receive_len];
+            static char control[receive_batch][CMSG_SPACE(sizeof(timespec))];
+            sockaddr_in TheirAddress[receive_batch]{};
+            iovec iov[receive_batch];
+            mmsghdr msgs[receive_batch];
+
+            for (unsigned int i = 0; i < receive_batch; i++)
+            {
+                iov[i].iov_base = szData[i];
+                iov[i].iov_len = receive_len;
+            }
 
             while (true)
             {
+                // the kernel writes these back, so set them for every batch
+                memset(msgs, 0, sizeof(msgs));
+                for (unsigned int i = 0; i < receive_batch; i++)
+                {
+                    msgs[i].msg_hdr.msg_name = &TheirAddress[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_control = control[i];
+                    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+                }
+
                 // Block until we receive a datagram from the network
-                // (from anyone including ourselves)
-                recvfrom(DataSocket, szData, sizeof(szData), 0, (sockaddr *)&TheirAddress, &addr_len);
-                // Once we have bytes recieved Unpack organizes all the data
-                // now we only care about the data frames, so Unpack will only deal
-                // with data frames and processing and storing will be done there.
-                Unpack(szData);
+                // (from anyone including ourselves), then take whatever
+                // else is queued in the same call
+                int n = recvmmsg(DataSocket, msgs, receive_batch, MSG_WAITFORONE, nullptr);
+                if (n <= 0)
+                {
+                    continue;
+                }
+
+                // the offset could be stepped by NTP, so read it per batch
+                int64_t offset = kernel_timestamps ? Realtime_offset() : 0;
+                int64_t now = Get_time_1();
+
+                for (int i = 0; i < n; i++)
+                {
+                    // Once we have bytes recieved Unpack organizes all the data
+                    // now we only care about the data frames, so Unpack will only deal
+                    // with data frames and storing will be done by PublishFrame.
+                    if (msgs[i].msg_len < 4 || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                    {
+                        continue;
+                    }
+
+                    temp_frame.receiveTimestamp = now;
+                    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+                    {
+                        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                        {
+                            timespec ts;
+                            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                            temp_frame.receiveTimestamp = int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000 - offset;
+                            break;
+                        }
+                    }
+
+                    if (Unpack(szData[i], int(msgs[i].msg_len), gNatNetVersion[0], gNatNetVersion[1], temp_frame))
+                    {
+                        PublishFrame(temp_frame);
+                    }
+                }
             }
 
             return 0;
@@ -1314,11 +1909,11 @@ namespace Optitrack
                 {
                 case NAT_MODELDEF:
                     std::cout << "[Client] Received NAT_MODELDEF packet";
-                    Unpack((char *)&PacketIn);
                     break;
                 case NAT_FRAMEOFDATA:
+                    // frames are only taken from the data socket, the rings
+                    // have a single writer
                     std::cout << "[Client] Received NAT_FRAMEOFDATA packet";
-                    Unpack((char *)&PacketIn);
                     break;
                 case NAT_SERVERINFO:
                     // Streaming app's name, e.g., Motive
@@ -1472,7 +2067,10 @@ namespace Optitrack
      */
     int Init(char *szMyIPAddress, char *szServerIPAddress)
     {
+#if MOTOR_USE_PIGPIO
         gpioInitialise();
+#endif
+        timefile.open("./timestamp.csv");
 
         int retval;
         in_addr MyAddress, MultiCastAddress;
@@ -1588,6 +2186,16 @@ namespace Optitrack
             printf("[PacketClient] ReceiveBuffer size = %d\n", optval);
         }
 #endif
+        // have the kernel stamp every datagram on arrival, without it the
+        // listen thread stamps them when it wakes up
+        value = 1;
+        kernel_timestamps = (setsockopt(DataSocket, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&value, sizeof(value)) == 0);
+#if DEBUG_PRINT_ENABLED
+        if (!kernel_timestamps)
+        {
+            printf("[PacketClient] kernel timestamps not available\n");
+        }
+#endif
 
         // startup our "Data Listener" thread
         pthread_t data_listen_thread;
@@ -1638,14 +2246,82 @@ namespace Optitrack
      */
     Solid_Body_State Get_state()
     {
-        size_t state_pos_now = state_pos;
         Solid_Body_State state;
+        state_ring.Read_latest(state);
+        return state;
+    }
 
-        do
+    /**
+     * @brief obtain the state of one rigid body in the latest frame
+     *
+     * @param ID streaming ID of the rigid body, as set in Motive
+     * @return Solid_Body_State latest state struct, ID is -1 if the body is
+     * not in the latest frame. check bTrackingValid, the pose of a body that
+     * is not tracked is not updated by Motive.
+     *
+     * @note the first max_rigid_bodies IDs seen get a slot of their own, a
+     * lookup copies one body. IDs after that are looked for in a copy of the
+     * whole frame.
+     */
+    Solid_Body_State Get_state(const int ID)
+    {
+        int slot = FindSlot(ID);
+        if (slot >= 0)
         {
-            state = state_buffer[state_pos_now];
-        } while (state_pos != state_pos_now);
+            uint64_t push = frame_ring.Pushes();
+            Indexed_State indexed;
+            body_states[slot].Read(indexed);
 
-        return state;
+            // from an older frame if the body is not in the latest one
+            return (push != 0 && indexed.push >= push) ? indexed.state : Solid_Body_State();
+        }
+
+        // more IDs came than there are slots, look through the latest frame
+        Frame_State frame;
+        frame_ring.Read_latest(frame);
+
+        for (int i = 0; i < frame.nRigidBodies; i++)
+        {
+            if (frame.rigidBodies[i].ID == ID)
+            {
+                return frame.rigidBodies[i];
+            }
+        }
+
+        return Solid_Body_State();
+    }
+
+    /**
+     * @brief obtain every rigid body of the latest frame
+     *
+     * @return Frame_State latest frame, frameNumber is -1 if none arrived yet
+     */
+    Frame_State Get_frame()
+    {
+        Frame_State frame;
+        frame_ring.Read_latest(frame);
+        return frame;
+    }
+
+    /**
+     * @brief decode one packet from Motive, without publishing it
+     *
+     * @param data packet as received, read in place
+     * @param len bytes in the packet
+     * @param major NatNet major version of the stream
+     * @param minor NatNet minor version of the stream
+     * @param frame output frame, receiveTimestamp is kept and copied to
+     * every rigid body
+     * @return true if it is a frame of data with a frame number and a
+     * mid-exposure timestamp, false for any other message and for frames
+     * that are truncated or do not add up
+     *
+     * @note this is what the listen thread runs on every packet, it is here
+     * for benchmarking and replaying recorded packets. nothing past len is
+     * read, whatever the packet says.
+     */
+    bool Decode_frame(char *data, const int len, const int major, const int minor, Frame_State &frame)
+    {
+        return Unpack(data, len, major, minor, frame);
     }
 }
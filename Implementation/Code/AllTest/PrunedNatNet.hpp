@@ -1,5 +1,20 @@
 /**
- * @brief Pruned NatNet 4.0 library, obtaining only the first rigid body data
+ * @brief Pruned NatNet 4.0 library, obtaining only the rigid body data
+ *
+ * @note every rigid body in a frame is decoded, up to max_rigid_bodies of
+ * them, into a fixed table that is published as a whole. every body is
+ * also published on its own in a slot indexed by its ID, which is what
+ * Get_state(ID) copies. Get_frame() copies the table.
+ * @note the listen thread publishes through a seqlock ring, so the getters
+ * never block it and never return parts of two frames.
+ * @note datagrams are read in batches and stamped by the kernel on arrival,
+ * which is what receiveTimestamp holds, so the latency of the listen thread
+ * does not show up in it.
+ * @note from NatNet 4.1 every section of a frame comes with its size, the
+ * sections other than the rigid bodies are jumped over with it. older
+ * streams are walked through.
+ * @note nothing past the length received is read, whatever the counts and
+ * sizes in the packet say. a frame that does not add up is dropped whole.
  */
 #ifndef _PRUNEDNATNET_HPP_
 #define _PRUNEDNATNET_HPP_
@@ -25,8 +40,28 @@ namespace Optitrack
         float fError;                // mean marker error
         bool bTrackingValid = false; // whether the solid body is captured in this frame
         uint64_t cameraMidExposureTimestamp = 0;
+        int64_t receiveTimestamp = 0; // local time in us when the kernel received the frame, see Get_time(), 0 if unknown
     } Solid_Body_State;
 
+    // rigid bodies decoded per frame, the rest are counted and skipped
+    constexpr int max_rigid_bodies = 32;
+
+    typedef struct
+    {
+        int frameNumber = -1;
+        uint64_t cameraMidExposureTimestamp = 0;
+        // local time in us when the kernel received the frame, see
+        // Get_time(), 0 if unknown
+        int64_t receiveTimestamp = 0;
+        // number of valid entries in rigidBodies
+        int nRigidBodies = 0;
+        // rigid bodies in the frame beyond max_rigid_bodies
+        int nSkipped = 0;
+        // in the order they are streamed, frameNumber and the timestamps
+        // are filled in for every one
+        Solid_Body_State rigidBodies[max_rigid_bodies];
+    } Frame_State;
+
     /**
      * @brief Send a command to Motive.
      * 
@@ -56,8 +91,51 @@ namespace Optitrack
      * @brief obtain the lastest solid body state
      *
      * @return Solid_Body_State latest state struct
+     *
+     * @note this is the first rigid body in the stream, and only frames in
+     * which it is tracked count.
      */
     Solid_Body_State Get_state();
+
+    /**
+     * @brief obtain the state of one rigid body in the latest frame
+     *
+     * @param ID streaming ID of the rigid body, as set in Motive
+     * @return Solid_Body_State latest state struct, ID is -1 if the body is
+     * not in the latest frame. check bTrackingValid, the pose of a body that
+     * is not tracked is not updated by Motive.
+     *
+     * @note the first max_rigid_bodies IDs seen get a slot of their own, a
+     * lookup copies one body. IDs after that are looked for in a copy of the
+     * whole frame.
+     */
+    Solid_Body_State Get_state(const int ID);
+
+    /**
+     * @brief obtain every rigid body of the latest frame
+     *
+     * @return Frame_State latest frame, frameNumber is -1 if none arrived yet
+     */
+    Frame_State Get_frame();
+
+    /**
+     * @brief decode one packet from Motive, without publishing it
+     *
+     * @param data packet as received, read in place
+     * @param len bytes in the packet
+     * @param major NatNet major version of the stream
+     * @param minor NatNet minor version of the stream
+     * @param frame output frame, receiveTimestamp is kept and copied to
+     * every rigid body
+     * @return true if it is a frame of data with a frame number and a
+     * mid-exposure timestamp, false for any other message and for frames
+     * that are truncated or do not add up
+     *
+     * @note this is what the listen thread runs on every packet, it is here
+     * for benchmarking and replaying recorded packets. nothing past len is
+     * read, whatever the packet says.
+     */
+    bool Decode_frame(char *data, const int len, const int major, const int minor, Frame_State &frame);
 }
 
 #endif
\ No newline at end of file
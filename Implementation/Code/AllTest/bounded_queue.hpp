@@ -0,0 +1,128 @@
+/**
+ * @file bounded_queue.hpp
+ * @brief fixed size lock-free multi-producer multi-consumer queue
+ *
+ * @note this is Dmitry Vyukov's bounded MPMC queue: every slot carries a
+ * sequence number that tells producers and consumers whether it is free or
+ * full, so a push or pop is one CAS on the shared index plus one store on
+ * the slot. nothing allocates after construction.
+ */
+#ifndef _BOUNDED_QUEUE_HPP_
+#define _BOUNDED_QUEUE_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Motor
+{
+    // size of a cache line, used to keep producer and consumer indices apart
+    constexpr size_t cache_line_len = 64;
+
+    /**
+     * @brief lock-free bounded queue
+     *
+     * @tparam T element type, should be cheap to copy
+     * @tparam N capacity, must be a power of 2
+     */
+    template <typename T, size_t N>
+    class Bounded_queue
+    {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "capacity must be a power of 2");
+
+    public:
+        Bounded_queue()
+        {
+            for (size_t i = 0; i < N; i++)
+            {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+
+        Bounded_queue(const Bounded_queue &) = delete;
+        Bounded_queue &operator=(const Bounded_queue &) = delete;
+
+        /**
+         * @brief add an element to the back of the queue
+         *
+         * @param value element to add
+         * @return true if added, false if the queue is full
+         */
+        bool Push(const T &value)
+        {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot &slot = slots[pos & (N - 1)];
+                size_t seq = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.value = value;
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * @brief take an element from the front of the queue
+         *
+         * @param value output element
+         * @return true if taken, false if the queue is empty
+         */
+        bool Pop(T &value)
+        {
+            size_t pos = head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot &slot = slots[pos & (N - 1)];
+                size_t seq = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        value = slot.value;
+                        slot.sequence.store(pos + N, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct Slot
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        Slot slots[N];
+        alignas(cache_line_len) std::atomic<size_t> head;
+        alignas(cache_line_len) std::atomic<size_t> tail;
+    };
+}
+
+#endif
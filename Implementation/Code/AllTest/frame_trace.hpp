@@ -0,0 +1,120 @@
+/**
+ * @file frame_trace.hpp
+ * @brief record every frame on the motor serial link to a binary file
+ *
+ * @note the tracer is opt-in, Trace_frame() is one relaxed atomic load when
+ * no trace is open. when it is, the frame and a timestamp are pushed onto a
+ * lock-free queue and a thread of its own writes them out, so the serial
+ * functions never wait for the disk. frames that do not fit in the queue
+ * are dropped and counted, see Get_trace_stats().
+ * @note the file is little endian: a header of "MTRACE", uint16 version,
+ * int32 baud rate and int64 start time in us, then for every record an int64
+ * timestamp in us, a uint8 Trace_type, a uint8 length and that many bytes.
+ * the timestamps are Get_time(), subtract the start time for a relative one.
+ * @note TX records are whole frames as written, RX records are whatever one
+ * read returned, so a reply may be split over several records or several
+ * replies may share one.
+ */
+#ifndef _FRAME_TRACE_HPP_
+#define _FRAME_TRACE_HPP_
+
+#include "motor.hpp"
+#include "motor_frame.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Motor
+{
+    enum Trace_type
+    {
+        TRACE_TX = 0, // frame written to the motor
+        TRACE_RX,     // bytes read from the motor
+        TRACE_TIMEOUT // the expected reply did not arrive, no data
+    };
+
+    // "MTRACE" without the terminating 0
+    constexpr char trace_magic[] = "MTRACE";
+    constexpr size_t trace_magic_len = sizeof(trace_magic) - 1;
+    constexpr uint16_t trace_version = 1;
+    // magic, version, baud rate and start time
+    constexpr size_t trace_header_len = trace_magic_len + 2 + 4 + 8;
+    // timestamp, type and length in front of the data of every record
+    constexpr size_t trace_record_header_len = 8 + 1 + 1;
+    // records the queue could hold before the writer thread catches up
+    constexpr size_t trace_queue_len = 4096;
+
+    struct Trace_record
+    {
+        // local time in us, see Get_time()
+        int64_t timestamp = 0;
+        uint8_t type = TRACE_TX;
+        uint8_t len = 0;
+        uint8_t data[max_frame_len];
+    };
+
+    struct Trace_header
+    {
+        uint16_t version = trace_version;
+        int baud = 0;
+        // local time in us when the trace was opened
+        int64_t start = 0;
+    };
+
+    // counters since Trace_open()
+    struct Trace_stats
+    {
+        // records pushed onto the queue
+        uint64_t recorded = 0;
+        // records lost because the queue was full
+        uint64_t dropped = 0;
+        // bytes written to the file, header included
+        uint64_t bytes_written = 0;
+    };
+
+    /**
+     * @brief start recording frames to a file
+     *
+     * @param path file to write, truncated if it exists
+     * @param baud baud rate of the link, stored in the header for replay
+     * @return 0 for OK and 1 for failed
+     *
+     * @note a trace already open is closed first.
+     */
+    int Trace_open(const char *path, const int baud = default_baud);
+
+    /**
+     * @brief stop recording, write out what is left and close the file
+     */
+    void Trace_close();
+
+    /**
+     * @brief record one frame, or part of one
+     *
+     * @param type direction of the frame
+     * @param data bytes of the frame, could be nullptr if len is 0
+     * @param len number of bytes, split into several records if longer than
+     * max_frame_len
+     *
+     * @note never blocks, safe to call from any thread. does nothing if no
+     * trace is open.
+     */
+    void Trace_frame(const Trace_type type, const uint8_t *data, const size_t len);
+
+    /**
+     * @brief counters of the trace open now, or of the last one
+     */
+    Trace_stats Get_trace_stats();
+
+    /**
+     * @brief read a whole trace file into memory
+     *
+     * @param path file to read
+     * @param header output header
+     * @param records output records, appended in file order
+     * @return true if the header is valid, a truncated last record is left out
+     */
+    bool Load_trace(const char *path, Trace_header &header, std::vector<Trace_record> &records);
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include "PrunedNatNet.hpp"
+#include "frame_trace.hpp"
 #include "motor.hpp"
+#include "thermal_model.hpp"
 #include <cstring>
 #include <pigpio.h>
 
@@ -86,7 +88,7 @@ int main(int argc, char *argv[])
     }
     else
     {
-        printf("Usage:\n\n\tPacketClient [ServerIP] [LocalIP]\n");
+        printf("Usage:\n\n\tPacketClient [ServerIP] [LocalIP] [motor trace file]\n");
         return 1;
     }
 
@@ -100,10 +102,22 @@ int main(int argc, char *argv[])
 
     // init GPIO and lauch motor control
     Motor::Serial_open();
-    Motor::Resume();
-    Motor::Clear_loops();
-    Motor::Set_multi_loop_position_2(0, 36000);
-    gpioDelay(2000000);
+    // record the motor traffic if asked to, see Benchmark/trace_replay.cpp
+    if (argc > 3 && Motor::Trace_open(argv[3]) != 0)
+    {
+        printf("Could not open %s, the motor traffic is not recorded.\n", argv[3]);
+    }
+    Motor::Home_result home = Motor::Home();
+    if (home == Motor::HOME_FAILED)
+    {
+        printf("Motor init failure!\n");
+        Motor::Trace_close();
+        return 1;
+    }
+    else if (home == Motor::HOME_TIMEOUT)
+    {
+        printf("Motor did not settle at home, continue anyway.\n");
+    }
 
     // setup log file
     std::fstream outputFile;
@@ -126,8 +140,10 @@ int main(int argc, char *argv[])
         gpioDelay(100);
 
         // get data and print
+        // the kernel receive time leaves out how late this loop polls
         auto state = Optitrack::Get_state();
-        int64_t delay = Get_time() - int64_t(state.cameraMidExposureTimestamp / 10);
+        int64_t arrival = state.receiveTimestamp ? state.receiveTimestamp : Get_time();
+        int64_t delay = arrival - int64_t(state.cameraMidExposureTimestamp / 10);
 
         time_delay = std::min(time_delay, delay);
     }
@@ -155,10 +171,18 @@ int main(int argc, char *argv[])
     // max acceleration is in unit of revolving radius in meters/revolving angle in radians
     // set max_acc to 0.25 or higher when target_radius is larger than 0.5m.
     float min_radius = 0.2F, max_radius = 1.5F, transition_radius = 0.5F, max_acc = 0.15F;
+    // highest motor angular velocity in rad/s
+    float max_motor_angv = min(motor_angv(max_radius), 9.0F);
+
+    // max_radius is derated so that the motor is predicted to stay under
+    // its temperature limit
+    Motor::Thermal_config thermal_config;
+    thermal_config.max_speed = max_motor_angv * 180.0F / M_PI;
+    Motor::Thermal_estimator thermal(thermal_config);
 
     outputFile << "delay, target_x, target_y, target_radius, kp_radius, kp_position, ki_radius, ki_position, kd_radius, kd_position, vel_update_const, i_radius_max, i_position_max, min_radius, max_radius, transition_radius, max_acc, time_step\n"
                << time_delay << " , " << target_x << " , " << target_y << " , " << target_radius << " , " << kp_radius << " , " << kp_position << " , " << ki_radius << " , " << ki_position << " , " << kd_radius << kd_position  << " , " << vel_update_const << " , " << i_radius_max << " , " << i_position_max << " , " << min_radius << " , " << max_radius << " , " << transition_radius << " , " << max_acc << " , " << time_step << "\nconventional pos {x,y} = exposure pos {x,-z}\n"
-               << "local time, exposure time, set motor angv, exposure pos x, y, z, qx, qy, qz, qw, x_extrapolated, y_extrapolated, angle_extrapolated, xc, yc, ix, iy, ir\n";
+               << "local time, exposure time, set motor angv, exposure pos x, y, z, qx, qy, qz, qw, x_extrapolated, y_extrapolated, angle_extrapolated, xc, yc, ix, iy, ir, motor time, motor encoder, motor velocity, motor current, motor temperature, link failures, link silence, link flags, model temperature, predicted temperature, derated max radius\n";
 
     // starting time
     int64_t start_time = Get_time();
@@ -378,13 +402,14 @@ int main(int argc, char *argv[])
             total_ar = clip(total_ar, vlim);
 
             // change the radius
-            float new_radius = min(max_radius, max(min_radius, current_radius + total_ar * current_Omega * (curr_time - last_time)*0.000001F));
+            float derated_max_radius = max(min_radius, min(max_radius, rot_radius(max_motor_angv * thermal.Derate())));
+            float new_radius = min(derated_max_radius, max(min_radius, current_radius + total_ar * current_Omega * (curr_time - last_time)*0.000001F));
 
             // set new speed
             current_motor_vel = motor_angv(new_radius);
-            if(current_motor_vel>=9.0F)
+            if(current_motor_vel>=max_motor_angv)
             {
-                current_motor_vel=9.0F;
+                current_motor_vel=max_motor_angv;
             }
 
             Motor::Set_velocity(int32_t(-current_motor_vel / M_PI * 18000.0F));
@@ -413,12 +438,19 @@ int main(int argc, char *argv[])
             last_yc=yc;
             last_radius=current_radius;
 
-            outputFile << curr_time << " , " << state.cameraMidExposureTimestamp << " , " << current_motor_vel << " , " << state.x << " , " << state.y << " , " << state.z << " , " << state.qx << " , " << state.qy << " , " << state.qz << " , " << state.qw  << " , " << x_extrapolated << " , " << y_extrapolated << " , " << angle_extrapolated << " , " << xc << " , " << yc << " , " << ix << " , " << iy << " , " << ir << "\n";
+            // feedback of the command above, no extra transaction needed
+            auto motor_state = Motor::Get_motor_state();
+            auto link_health = Motor::Get_link_health();
+            thermal.Update(motor_state);
+            auto thermal_state = thermal.Get();
+
+            outputFile << curr_time << " , " << state.cameraMidExposureTimestamp << " , " << current_motor_vel << " , " << state.x << " , " << state.y << " , " << state.z << " , " << state.qx << " , " << state.qy << " , " << state.qz << " , " << state.qw  << " , " << x_extrapolated << " , " << y_extrapolated << " , " << angle_extrapolated << " , " << xc << " , " << yc << " , " << ix << " , " << iy << " , " << ir << " , " << motor_state.timestamp << " , " << motor_state.feedback.encoder << " , " << motor_state.feedback.velocity << " , " << motor_state.feedback.torque_current << " , " << int(motor_state.feedback.temperature) << " , " << link_health.consecutive_failures << " , " << (curr_time - link_health.last_valid_frame) << " , " << int(link_health.flags) << " , " << thermal_state.temperature << " , " << thermal_state.predicted << " , " << derated_max_radius << "\n";
         }
     }
 
     Motor::Pause();
     Motor::Serial_close();
+    Motor::Trace_close();
     outputFile.close();
 
     return 0;
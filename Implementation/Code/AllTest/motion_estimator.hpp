@@ -0,0 +1,160 @@
+/**
+ * @file motion_estimator.hpp
+ * @brief estimate shaft position, velocity and acceleration from encoder
+ * readings
+ *
+ * @note the velocity in the feedback is in whole dps, far too coarse for a
+ * controller. the encoder has 0.011deg resolution, so differentiating it at
+ * a few hundred Hz gives sub-dps velocity once the quantization noise is
+ * filtered out.
+ * @note the filter is a critically damped alpha-beta-gamma tracker. every
+ * reading is stitched to the predicted position instead of the last one, so
+ * a fast spinning shaft could move up to half a turn more than predicted
+ * between two readings before a wrap is counted wrong.
+ */
+#ifndef _MOTION_ESTIMATOR_HPP_
+#define _MOTION_ESTIMATOR_HPP_
+
+#include "motor.hpp"
+#include <cmath>
+#include <cstdint>
+
+namespace Motor
+{
+    // default smoothing of Motion_estimator, from 0 (none) to 1 (frozen)
+    constexpr float default_motion_smoothing = 0.7F;
+
+    // estimated motion of a shaft at one instant
+    struct Motion_sample
+    {
+        // increases by one for every sample, 0 if nothing has arrived yet
+        uint64_t sequence = 0;
+        // local time in us of the encoder reading, see Get_time()
+        int64_t timestamp = 0;
+        // multi-turn shaft angle in deg, continuous since the first reading
+        double position = 0.0;
+        // shaft velocity in deg/s
+        float velocity = 0.0F;
+        // shaft acceleration in deg/s^2
+        float acceleration = 0.0F;
+    };
+
+    /**
+     * @brief extrapolate the shaft angle of a sample to another time
+     *
+     * @param sample estimated motion
+     * @param time local time in us, see Get_time()
+     * @return double multi-turn shaft angle in deg
+     *
+     * @note constant time. the time difference is taken in int64 so it does
+     * not lose precision however large Get_time() grows, and is clamped to
+     * max_prediction_us so that a stale sample could not run away.
+     */
+    inline double Predict_position(const Motion_sample &sample, const int64_t time)
+    {
+        int64_t dt = time - sample.timestamp;
+        dt = (dt > max_prediction_us) ? max_prediction_us : ((dt < -max_prediction_us) ? -max_prediction_us : dt);
+
+        double t = double(dt) * 1.0e-6;
+        return sample.position + t * (double(sample.velocity) + 0.5 * t * double(sample.acceleration));
+    }
+
+    /**
+     * @brief alpha-beta-gamma tracker on the stitched encoder position
+     */
+    class Motion_estimator
+    {
+    public:
+        /**
+         * @param smoothing from 0 to 1, higher is smoother but lags more
+         */
+        explicit Motion_estimator(const float smoothing = default_motion_smoothing)
+        {
+            Set_smoothing(smoothing);
+        }
+
+        /**
+         * @brief set the smoothing, keeps the current estimate
+         *
+         * @param smoothing from 0 to 1, higher is smoother but lags more
+         *
+         * @note this is the fading memory factor theta, the gains of a
+         * critically damped filter are g = 1 - theta^3,
+         * h = 1.5 (1 - theta^2)(1 - theta) and k = 0.5 (1 - theta)^3.
+         */
+        void Set_smoothing(const float smoothing)
+        {
+            double theta = (smoothing < 0.0F) ? 0.0 : ((smoothing > 0.99F) ? 0.99 : double(smoothing));
+            gain_x = 1.0 - theta * theta * theta;
+            gain_v = 1.5 * (1.0 - theta * theta) * (1.0 - theta);
+            gain_a = 0.5 * (1.0 - theta) * (1.0 - theta) * (1.0 - theta);
+        }
+
+        /**
+         * @brief forget the shaft, the next reading starts over at rest
+         */
+        void Reset()
+        {
+            started = false;
+        }
+
+        /**
+         * @brief feed one encoder reading
+         *
+         * @param timestamp local time in us of the reading
+         * @param encoder encoder value from 0 to encoder_resolution
+         * @param sample output estimate at timestamp, sequence is not touched
+         * @return true if sample is updated, false if the reading is not
+         * newer than the last one
+         */
+        bool Update(const int64_t timestamp, const uint16_t encoder, Motion_sample &sample)
+        {
+            int64_t pos = Encoder_to_Motor_position(encoder);
+
+            if (!started)
+            {
+                started = true;
+                x = double(pos);
+                v = 0.0;
+                a = 0.0;
+            }
+            else
+            {
+                if (timestamp <= last_time)
+                {
+                    return false;
+                }
+
+                // predict, in 0.01deg and s
+                double dt = double(timestamp - last_time) * 1.0e-6;
+                double xp = x + v * dt + 0.5 * a * dt * dt;
+                double vp = v + a * dt;
+
+                // the reading is closest to the prediction modulo one turn
+                double z = double(Stitch_motor_position(int64_t(std::llround(xp)), pos));
+                double r = z - xp;
+
+                x = xp + gain_x * r;
+                v = vp + gain_v * r / dt;
+                a = a + 2.0 * gain_a * r / (dt * dt);
+            }
+            last_time = timestamp;
+
+            sample.timestamp = timestamp;
+            sample.position = x * 0.01;
+            sample.velocity = float(v * 0.01);
+            sample.acceleration = float(a * 0.01);
+            return true;
+        }
+
+    private:
+        double gain_x, gain_v, gain_a;
+
+        bool started = false;
+        int64_t last_time = 0;
+        // position in 0.01deg, velocity in 0.01deg/s, acceleration in 0.01deg/s^2
+        double x = 0.0, v = 0.0, a = 0.0;
+    };
+}
+
+#endif
@@ -5,6 +5,9 @@
 #ifndef _MOTOR_HPP_
 #define _MOTOR_HPP_
 
+#include "motor_frame.hpp"
+#include "serial_transport.hpp"
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -22,12 +25,128 @@ namespace Motor
     constexpr uint16_t encoder_resolution = 32768U;
     constexpr int32_t motor_position_resolution = 36000;
 
+    // ID of the default motor on the bus
+    constexpr uint8_t Motor_ID = 0x01;
+
+    // default serial port and backend
+    constexpr char default_port[] = "/dev/ttyS0";
+    constexpr int default_baud = 115200;
+#if MOTOR_USE_PIGPIO
+    constexpr Transport_type default_transport = TRANSPORT_PIGPIO;
+#else
+    constexpr Transport_type default_transport = TRANSPORT_TERMIOS;
+#endif
+
+    // default deadline of one serial transaction in us
+    constexpr int64_t transaction_timeout_us = 5000;
+
+    // positions are not extrapolated further than this from the feedback in
+    // us, the error would grow without bound with a stale feedback
+    constexpr int64_t max_prediction_us = 100000;
+
+    // homing is done once the shaft is within this distance of the target
+    // in 0.01deg and slower than this in dps, for home_settle_count readings
+    // in a row home_poll_interval_us apart
+    constexpr int64_t home_position_tolerance = 50;
+    constexpr int16_t home_velocity_tolerance = 3;
+    constexpr int home_settle_count = 3;
+    constexpr int64_t home_poll_interval_us = 5000;
+    // default time limit of homing in us
+    constexpr int64_t home_timeout_us = 3000000;
+
+    // result of a serial transaction
+    enum Transaction_result
+    {
+        TRANSACTION_OK = 0,       // expected response received and checked
+        TRANSACTION_TIMEOUT,      // nothing valid arrived before the deadline
+        TRANSACTION_CORRUPTED,    // only corrupted frames arrived before the deadline
+        TRANSACTION_WRITE_FAILED, // could not write to serial
+        TRANSACTION_PENDING       // written, the reply is collected later
+    };
+
+    // result of homing
+    enum Home_result
+    {
+        HOME_OK = 0,  // settled at the target
+        HOME_TIMEOUT, // still moving or away from the target at the time limit
+        HOME_FAILED   // a command of the init sequence got no reply
+    };
+
+    // how commands wait for their replies
+    enum Response_mode
+    {
+        RESPONSE_WAIT = 0, // wait for the reply before returning
+        RESPONSE_DEFERRED  // return once written, collect the reply later
+    };
+
+    // counters of link quality, accumulated since Serial_open()
+    struct Link_stats
+    {
+        uint64_t transactions = 0;
+        uint64_t timeouts = 0;
+        uint64_t checksum_failures = 0;
+        uint64_t resyncs = 0;
+        uint64_t unexpected_frames = 0;
+        // commands sent without waiting for their replies
+        uint64_t deferred = 0;
+        // deferred replies that did not arrive before their deadline
+        uint64_t missing_replies = 0;
+        // replies that arrived after they were given up, thrown away
+        uint64_t stale_replies = 0;
+    };
+
+    // why transactions failed, see Link_health
+    enum Link_flag
+    {
+        LINK_TIMEOUT = 0x01,      // a reply did not arrive in time
+        LINK_CORRUPTED = 0x02,    // a reply arrived corrupted
+        LINK_WRITE_FAILED = 0x04, // a frame could not be written
+        LINK_READ_FAILED = 0x08,  // the port gave an error on reading
+        LINK_CLOSED = 0x10        // the port is not open
+    };
+
+    // health of the serial link right now
+    struct Link_health
+    {
+        // transactions failed since the last one that got its reply
+        uint32_t consecutive_failures = 0;
+        // local time in us of the last valid frame received, 0 if none since
+        // Serial_open(). Get_time() minus this is how long the link is silent
+        int64_t last_valid_frame = 0;
+        // Link_flag of the failures since the last good transaction
+        uint8_t flags = 0;
+    };
+
+    // latest feedback of one motor
+    struct Motor_state
+    {
+        // increases by one for every feedback, 0 if nothing has arrived yet
+        uint64_t sequence = 0;
+        // local time in us when the feedback arrived, see Get_time()
+        int64_t timestamp = 0;
+        // the decoded feedback
+        Feedback feedback;
+        // multi-turn shaft position in 0.01deg/LSB, unwrapped from the
+        // encoder since the first feedback, see Parse_response() in motor.cpp
+        int64_t position = 0;
+        // number of feedback gaps long enough for the shaft to turn half a
+        // turn or more at its velocity, position may have missed a wrap there
+        uint64_t suspect_wraps = 0;
+    };
+
+    // the following are for the default motor (Motor_ID) only, and could only
+    // be read by the thread sending the commands. other threads should use
+    // Get_motor_state() which is consistent.
     // when was last result obtained
     extern int64_t timestamp;
     // encoder value of last result, from 0~32767, 15 bits in total.
     extern uint16_t encoder_position;
     // motor speed in degree/s
     extern int16_t motor_velocity;
+    // torque current of last result, see Torque_current_to_A()
+    extern int16_t motor_torque_current;
+    // motor temperature of last result in degree C
+    extern int8_t motor_temperature;
 
     // enum Rotation_direction
     // {
@@ -65,6 +184,17 @@ namespace Motor
      */
     int64_t Encoder_to_Motor_position(const uint16_t encoder_pos);
 
+    /**
+     * @brief torque current in feedback to amperes
+     *
+     * @param current torque current from -2048 to 2048
+     * @return float current in A, from -33A to 33A
+     *
+     * @note MS series motors (e.g. MS5010) report output power from -1000
+     * to 1000 in this field instead, do not convert it.
+     */
+    float Torque_current_to_A(const int16_t current);
+
     /**
      * @brief A function that maintains the continuity of position
      * 
@@ -77,18 +207,97 @@ namespace Motor
     /**
      * @brief open serial for motor
      * 
+     * @param type which serial backend to use
+     * @param port path to the serial port
+     * @param baud baud rate
      * @return 0 for OK and 1 for failed
      * 
-     * @note also executes gpioInitialise()
+     * @note the pigpio backend also executes gpioInitialise()
      * @note by default it opens "/dev/ttyS0" with baud rate of 115200
      */
-    int Serial_open();
+    int Serial_open(const Transport_type type = default_transport, const char *port = default_port, const int baud = default_baud);
 
     /**
      * @brief close serial for motor
      */
     void Serial_close();
     
+    /**
+     * @brief write and read back through serial without any allocation
+     *
+     * @param input byte sequence to send, should be a complete frame
+     * @param input_len length of input byte sequence
+     * @param output buffer for the response, should hold response_len bytes
+     * @param response_len length of response byte sequence
+     * @param timeout_us give up if response is not complete after this long
+     * @return Transaction_result TRANSACTION_OK if the expected response
+     * arrived with correct header, ID, length and checksums
+     *
+     * @note the response is picked out of the byte stream by a resyncing
+     * parser, so garbage or stale frames before it will not break the link.
+     * @note could be platform specific
+     */
+    Transaction_result Serial_transaction(const uint8_t *input, const size_t input_len, uint8_t *output, const size_t response_len, const int64_t timeout_us = transaction_timeout_us);
+
+    /**
+     * @brief write a frame and return at once, the reply is collected later
+     *
+     * @param input byte sequence to send, should be a complete frame
+     * @param input_len length of input byte sequence
+     * @param response_len length of response byte sequence
+     * @param timeout_us the reply is counted as missing if not complete after
+     * this long
+     * @return Transaction_result TRANSACTION_PENDING if written
+     *
+     * @note the reply is collected by Collect_responses() or before the next
+     * frame is written, whichever comes first. a feedback reply updates the
+     * motor state just like in a blocking transaction.
+     * @note RS485 is half duplex, so the next frame could only be written
+     * after the reply is in. if the next frame comes before that, it waits
+     * for the reply or its deadline.
+     */
+    Transaction_result Serial_send(const uint8_t *input, const size_t input_len, const size_t response_len, const int64_t timeout_us = transaction_timeout_us);
+
+    /**
+     * @brief collect the reply of the last Serial_send() if it has arrived
+     *
+     * @return int number of replies collected, 0 or 1
+     *
+     * @note never waits, call it whenever convenient to get the feedback
+     * earlier.
+     */
+    int Collect_responses();
+
+    /**
+     * @brief choose whether commands wait for their replies
+     *
+     * @param mode RESPONSE_WAIT (default) or RESPONSE_DEFERRED
+     *
+     * @note in RESPONSE_DEFERRED, commands whose result is only the feedback
+     * or an echo (e.g. Set_velocity(), Pause()) go through Serial_send() and
+     * return TRANSACTION_PENDING. commands that read something (e.g.
+     * Read_pid(), Read_motor_state()) and Command_transaction() with fb
+     * always wait.
+     */
+    void Set_response_mode(const Response_mode mode);
+
+    /**
+     * @brief get link quality counters
+     *
+     * @return Link_stats counters since Serial_open()
+     */
+    Link_stats Get_link_stats();
+
+    /**
+     * @brief get the health of the link right now
+     *
+     * @return Link_health consecutive failures, last valid frame and flags
+     *
+     * @note lock-free, safe to call from any thread even in the middle of a
+     * transaction.
+     */
+    Link_health Get_link_health();
+
     /**
      * @brief write and read back through serial
      *
@@ -96,71 +305,250 @@ namespace Motor
      * @param response_len length of byte sequence, 0 means unknown
      * @return received response byte sequence
      *
-     * @note could be platform specific
+     * @note allocates, prefer the pointer version on the control path.
+     */
+    std::vector<char> Serial_transaction(const std::vector<char> &input, const size_t response_len);
+
+    /**
+     * @brief send a command frame and wait for its reply. if the reply is the
+     * regular 13 bytes feedback, parse it.
+     *
+     * @param frame complete command frame
+     * @param frame_len length of the frame
+     * @param response_len length of the reply, feedback_len for feedback
+     * @param fb if not nullptr, decoded feedback is written here
+     * @return Transaction_result result of the transaction
+     *
+     * @note the feedback also updates timestamp, encoder_position and
+     * motor_velocity.
+     * @note in RESPONSE_DEFERRED mode and without fb, it returns
+     * TRANSACTION_PENDING once written, see Serial_send().
+     */
+    Transaction_result Command_transaction(const uint8_t *frame, const size_t frame_len, const size_t response_len, Feedback *fb = nullptr);
+
+    /**
+     * @brief obtain the latest state of a motor
+     *
+     * @param id motor ID, 1~32
+     * @return Motor_state latest snapshot, compare sequence with the last
+     * one you read to tell whether a new feedback has arrived
+     *
+     * @note updated by every feedback, no matter it comes from the blocking
+     * functions or the motor bus.
+     * @note lock-free, fields always come from the same feedback.
      */
-    std::vector<char> Serial_transaction(const std::vector<char> input, const size_t response_len);
+    Motor_state Get_motor_state(const uint8_t id = Motor_ID);
+
+    /**
+     * @brief obtain the state of a motor if a newer one has arrived
+     *
+     * @param state last state read, replaced if a newer one has arrived
+     * @param id motor ID, 1~32
+     * @return true if state is replaced
+     *
+     * @note lock-free, cheap enough to call in a tight loop.
+     */
+    bool Get_new_motor_state(Motor_state &state, const uint8_t id = Motor_ID);
 
     /**
      * @brief return motor position in radians
      *
      * @param curr_time time in int64_t, probably obtained using get_time function
      * @return float motor position from 0 to 2pi
+     *
+     * @note based on the latest state of the default motor, so it is safe to
+     * call from any thread.
+     * @note extrapolates the unwrapped position with the feedback velocity in
+     * int64, for at most max_prediction_us. the feedback velocity is in whole
+     * dps, Predict_position() on the bus motion estimate is finer.
      */
     float Current_pos(int64_t curr_time);
 
     /**
      * @brief (15) completely stop the motor and wipe the motor state/memory
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Stop();
+    Transaction_result Stop(const uint8_t id = Motor_ID);
 
     /**
      * @brief (16) stop the motor but NOT wipe the motor state/memory
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Pause();
+    Transaction_result Pause(const uint8_t id = Motor_ID);
 
     /**
      * @brief (17) resume from paused state
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Resume();
+    Transaction_result Resume(const uint8_t id = Motor_ID);
 
     /**
      * @brief (13) read motor state
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note always waits for the reply, also in RESPONSE_DEFERRED, since it
+     * is the way to poll the motor. the state is in Get_motor_state().
      */
-    void Read_motor_state();
+    Transaction_result Read_motor_state(const uint8_t id = Motor_ID);
 
     /**
      * @brief (18) open loop power control
      *
      * @param power input power from -1000 to 1000
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_power(const int16_t power);
+    Transaction_result Set_power(const int16_t power, const uint8_t id = Motor_ID);
 
     /**
      * @brief (20) closed loop velocity control
      *
      * @param vel input velocity in int32_t, input unit is 0.01dps/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_velocity(const int32_t vel);
+    Transaction_result Set_velocity(const int32_t vel, const uint8_t id = Motor_ID);
     
     /**
      * @brief clear loop number
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Clear_loops();
+    Transaction_result Clear_loops(const uint8_t id = Motor_ID);
 
     /**
      * @brief (21) closed loop multi-loop position control 1
      *
      * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_multi_loop_position_1(const int64_t pos);
+    Transaction_result Set_multi_loop_position_1(const int64_t pos, const uint8_t id = Motor_ID);
 
     /**
      * @brief (22) closed loop multi-loop position control 2
      *
      * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
      * @param max_spd maximum speed in 0.01dps/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (1) read PID parameters
+     *
+     * @param pid decoded PI parameters of the three loops
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_pid(Pid_params &pid, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (2) write PID parameters to RAM, lost on power off
+     *
+     * @param pid parameters to write
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Write_pid_ram(const Pid_params &pid, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (3) write PID parameters to ROM, kept on power off
+     *
+     * @param pid parameters to write
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Write_pid_rom(const Pid_params &pid, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (9) read multi-turn angle
+     *
+     * @param angle multi-turn angle in 0.01deg/LSB, positive is clockwise
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note the motor keeps counting turns itself, so this does not drift like
+     * stitching encoder values on the host does.
+     */
+    Transaction_result Read_multi_turn_angle(int64_t &angle, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (10) read single-turn angle
+     *
+     * @param angle single-turn angle in 0.01deg/LSB, from 0 to 36000-1
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_single_turn_angle(uint32_t &angle, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (11) read temperature, voltage and error flags
+     *
+     * @param state decoded state, see Error_flag for the flags
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_error_state(Error_state &state, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (12) clear error flags
+     *
+     * @param state state after clearing
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note flags could not be cleared while the error is still there.
+     */
+    Transaction_result Clear_errors(Error_state &state, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (14) read phase currents
+     *
+     * @param currents decoded temperature and phase currents
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note MF and MG series only, a MS series motor will not reply.
+     */
+    Transaction_result Read_phase_currents(Phase_currents &currents, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief (19) closed loop torque control
+     *
+     * @param iq input torque current from -2000 to 2000, for -32A to 32A
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note MF and MG series only, use Set_power() on a MS series motor.
+     */
+    Transaction_result Set_torque(const int16_t iq, const uint8_t id = Motor_ID);
+
+    /**
+     * @brief resume, clear loops and go to a multi-loop position, then wait
+     * until the motor settles there
+     *
+     * @param pos target multi-loop position in 0.01deg/LSB, counted from the
+     * single-turn angle since the loops are cleared
+     * @param max_spd maximum speed in 0.01dps/LSB
+     * @param timeout time limit in us
+     * @param id motor ID
+     * @return Home_result HOME_OK as soon as the motor settles
+     *
+     * @note polls the multi-turn angle and the motor state every
+     * home_poll_interval_us, see home_position_tolerance for what settled is.
      */
-    void Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd);
+    Home_result Home(const int64_t pos = 0, const uint32_t max_spd = 36000, const int64_t timeout = home_timeout_us, const uint8_t id = Motor_ID);
 
     // /**
     //  * @brief (23) closed loop single-loop position control 1
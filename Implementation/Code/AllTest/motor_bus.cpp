@@ -0,0 +1,1301 @@
+/**
+ * @file motor_bus.cpp
+ * @brief asynchronous motor client, a bus thread owns the serial port
+ */
+#include "motor_bus.hpp"
+#include "bounded_queue.hpp"
+#include "motion_estimator.hpp"
+#include "seqlock.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+
+#include <semaphore.h>
+
+#define DEBUG_PRINT_ENABLED 0
+
+namespace Motor
+{
+    namespace
+    {
+        // a command waiting in the queue, or the newest setpoint of one type
+        struct Bus_command
+        {
+            uint8_t frame[max_frame_len];
+            uint8_t frame_len;
+            uint8_t response_len;
+            // order of submission on the whole bus
+            uint64_t seq;
+            // when it was submitted, for queue delay statistics
+            int64_t submit_time;
+        };
+
+        // setpoint commands, only the newest of each type is kept
+        constexpr Command_ID setpoint_commands[] = {CMD_POWER, CMD_TORQUE, CMD_VELOCITY, CMD_MULTI_LOOP_POSITION_1, CMD_MULTI_LOOP_POSITION_2};
+        constexpr size_t setpoint_count = sizeof(setpoint_commands) / sizeof(setpoint_commands[0]);
+
+        /**
+         * @brief which setpoint slot a command goes to
+         *
+         * @param cmd command byte
+         * @return int index of the slot, -1 if not a setpoint
+         */
+        int Setpoint_index(const uint8_t cmd)
+        {
+            for (size_t i = 0; i < setpoint_count; i++)
+            {
+                if (setpoint_commands[i] == cmd)
+                {
+                    return int(i);
+                }
+            }
+            return -1;
+        }
+
+        // safety commands, sent ahead of everything else and never rejected
+        constexpr Command_ID safety_commands[] = {CMD_STOP, CMD_PAUSE};
+        constexpr size_t safety_count = sizeof(safety_commands) / sizeof(safety_commands[0]);
+
+        /**
+         * @brief which safety slot a command goes to
+         *
+         * @param cmd command byte
+         * @return int index of the slot, -1 if not a safety command
+         */
+        int Safety_index(const uint8_t cmd)
+        {
+            for (size_t i = 0; i < safety_count; i++)
+            {
+                if (safety_commands[i] == cmd)
+                {
+                    return int(i);
+                }
+            }
+            return -1;
+        }
+
+        // orders commands across the queue and the setpoint slots
+        std::atomic<uint64_t> bus_seq(0);
+
+        // queue and counters of one motor
+        struct Bus_motor
+        {
+            Bounded_queue<Bus_command, bus_queue_len> queue;
+
+            // newest setpoint of every type, written by submitters
+            Seqlock<Bus_command> setpoints[setpoint_count];
+            // newest stop and pause, written by submitters
+            Seqlock<Bus_command> safety[safety_count];
+            // seq of the last stop or pause, setpoints and resumes before it
+            // are void
+            std::atomic<uint64_t> safety_seq;
+
+            // estimated motion, sample n is in motion[n % motion_history_len].
+            // not cleared on reset so that sequence numbers never repeat
+            Seqlock<Motion_sample> motion[motion_history_len];
+            std::atomic<uint64_t> motion_count;
+
+            std::atomic<uint64_t> submitted;
+            std::atomic<uint64_t> rejected;
+            std::atomic<uint64_t> completed;
+            std::atomic<uint64_t> failed;
+            std::atomic<uint64_t> polls;
+            std::atomic<uint64_t> suppressed;
+            std::atomic<int64_t> max_queue_delay;
+            std::atomic<float> update_rate;
+
+            // only touched by the bus thread
+            int64_t last_update;
+            float update_period;
+            // when the last command that brought feedback was sent
+            int64_t last_feedback_request;
+            // command taken from the queue but not sent yet
+            Bus_command next;
+            bool has_next;
+            // number of writes of every setpoint slot already handled
+            uint64_t setpoints_taken[setpoint_count];
+            // number of writes of every safety slot already handled
+            uint64_t safety_taken[safety_count];
+            // when the last setpoint was sent
+            int64_t last_setpoint;
+            Motion_estimator estimator;
+            float smoothing;
+
+            /**
+             * @brief throw away queued commands and void the setpoints, they
+             * are out of date once the link was lost
+             *
+             * @note the commands count as failed, the setpoints as suppressed.
+             * @note a stop or pause still waiting is kept, it is sent first
+             * once the link is back.
+             */
+            void Void_commands()
+            {
+                Bus_command cmd;
+                while (queue.Pop(cmd))
+                {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (has_next)
+                {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                    has_next = false;
+                }
+
+                for (size_t i = 0; i < setpoint_count; i++)
+                {
+                    uint64_t n = setpoints[i].Writes();
+                    suppressed.fetch_add(n - setpoints_taken[i], std::memory_order_relaxed);
+                    setpoints_taken[i] = n;
+                }
+                safety_seq = bus_seq.load();
+                estimator.Reset();
+            }
+
+            /**
+             * @brief throw away queued commands and clear counters
+             */
+            void Reset()
+            {
+                // setpoints and safety commands left from last time are void
+                Void_commands();
+                for (size_t i = 0; i < safety_count; i++)
+                {
+                    safety_taken[i] = safety[i].Writes();
+                }
+                last_setpoint = 0;
+                smoothing = -1.0F;
+
+                submitted = 0;
+                rejected = 0;
+                completed = 0;
+                failed = 0;
+                polls = 0;
+                suppressed = 0;
+                max_queue_delay = 0;
+                update_rate = 0.0F;
+                last_update = 0;
+                update_period = 0.0F;
+                last_feedback_request = 0;
+            }
+        };
+
+        // weight of a new sample in the smoothed update period
+        constexpr float update_period_filter = 0.05F;
+
+        // indexed by motor ID, 0 is not used
+        Bus_motor motors[max_motor_id + 1];
+
+        // bit n is set if motor n is in the schedule
+        std::atomic<uint64_t> active_motors(0);
+
+        // posted when there is something new to do, the bus thread sleeps on it.
+        // set up on the first Bus_open() and never destroyed, a setter may
+        // still post it after Bus_close()
+        sem_t bus_sem;
+        bool bus_sem_ready = false;
+
+        // Bus_submit() calls past their check of bus_running, Bus_close()
+        // waits for them so that nothing is left in a queue after it
+        std::atomic<int> bus_submitters(0);
+
+        std::thread bus_thread;
+        std::atomic<bool> bus_running(false);
+        std::atomic<bool> bus_polling(false);
+
+        // minimum time between two setpoints to the same motor in us
+        std::atomic<int64_t> setpoint_interval(0);
+
+        // the poller reads a motor once it has had no feedback for this long,
+        // 0 to poll whenever idle
+        std::atomic<int64_t> poll_interval(0);
+        // as given to Bus_set_poll_rate()
+        std::atomic<float> poll_rate(0.0F);
+
+        // baud rate of the bus
+        int bus_baud = default_baud;
+
+        // smoothing of the motion estimators
+        std::atomic<float> motion_smoothing(default_motion_smoothing);
+
+        // where to reopen the port
+        Transport_type bus_type = default_transport;
+        std::string bus_port;
+
+        // run on every motor when the link comes back
+        std::atomic<Bus_init> reconnect_init(nullptr);
+
+        // written by the bus thread only, link is filled in when read
+        Seqlock<Bus_health> bus_health;
+
+        // only touched by the bus thread
+        bool link_lost = false;
+        int64_t next_reconnect = 0;
+        int64_t reconnect_wait = 0;
+
+        /**
+         * @brief feed the latest feedback of a motor to its estimator and
+         * publish the estimate
+         *
+         * @param motor the motor
+         * @param id its ID
+         * @param sample_time when the motor read its encoder in us
+         */
+        void Update_motion(Bus_motor &motor, const uint8_t id, const int64_t sample_time)
+        {
+            float smoothing = motion_smoothing.load(std::memory_order_relaxed);
+            if (smoothing != motor.smoothing)
+            {
+                motor.smoothing = smoothing;
+                motor.estimator.Set_smoothing(smoothing);
+            }
+
+            Motor_state state = Get_motor_state(id);
+            Motion_sample sample;
+            if (!motor.estimator.Update(sample_time, state.feedback.encoder, sample))
+            {
+                return;
+            }
+
+            // only the bus thread writes, so the count is ours to bump
+            uint64_t n = motor.motion_count.load(std::memory_order_relaxed) + 1;
+            sample.sequence = n;
+            motor.motion[n % motion_history_len].Write(sample);
+            motor.motion_count.store(n, std::memory_order_release);
+        }
+
+        /**
+         * @brief send one frame, wait for the reply and update the counters
+         *
+         * @param motor the motor it is addressed to
+         * @param frame complete command frame
+         * @param frame_len length of the frame
+         * @param response_len length of the reply
+         */
+        void Execute(Bus_motor &motor, const uint8_t *frame, const size_t frame_len, const size_t response_len)
+        {
+            Feedback fb;
+            int64_t start = Get_time();
+            Transaction_result res = Command_transaction(frame, frame_len, response_len, &fb);
+            if (res != TRANSACTION_OK)
+            {
+                motor.failed.fetch_add(1, std::memory_order_relaxed);
+
+#if DEBUG_PRINT_ENABLED
+                printf("Bus command 0x%02X to motor %d failed : %d\n", frame[1], frame[2], int(res));
+#endif
+                return;
+            }
+
+            motor.completed.fetch_add(1, std::memory_order_relaxed);
+
+            // echo replies carry no feedback
+            if (fb.command == 0)
+            {
+                return;
+            }
+
+            // the encoder is read once the request is in, which does not
+            // suffer from how late we get to read the reply
+            motor.last_feedback_request = start;
+            Update_motion(motor, frame[2], start + int64_t(frame_len) * 10000000LL / bus_baud);
+
+            int64_t now = Get_time();
+            if (motor.last_update != 0)
+            {
+                float period = float(now - motor.last_update);
+                motor.update_period = (motor.update_period == 0.0F) ? period : (motor.update_period + update_period_filter * (period - motor.update_period));
+                motor.update_rate.store(1000000.0F / motor.update_period, std::memory_order_relaxed);
+            }
+            motor.last_update = now;
+        }
+
+        /**
+         * @brief find the oldest setpoint that is due, throw away the void ones
+         *
+         * @param motor the motor to look at
+         * @param cmd output setpoint
+         * @param limited whether the rate limit applies
+         * @param wake set to when a held back setpoint is due, if earlier
+         * @param writes output number of writes of the slot cmd is from
+         * @return int index of the slot, -1 if nothing is due
+         *
+         * @note the setpoint stays in its slot, see Take_setpoint().
+         */
+        int Next_setpoint(Bus_motor &motor, Bus_command &cmd, const bool limited, int64_t &wake, uint64_t &writes)
+        {
+            uint64_t safety = motor.safety_seq.load(std::memory_order_acquire);
+            int64_t due = motor.last_setpoint + setpoint_interval.load(std::memory_order_relaxed);
+            bool held = limited && motor.last_setpoint != 0 && Get_time() < due;
+            int best = -1;
+
+            for (size_t i = 0; i < setpoint_count; i++)
+            {
+                if (motor.setpoints[i].Writes() == motor.setpoints_taken[i])
+                {
+                    continue;
+                }
+
+                Bus_command temp;
+                uint64_t n = motor.setpoints[i].Read(temp);
+                if (temp.seq <= safety)
+                {
+                    // a stop or pause came after it and went ahead, sending it
+                    // now would move the motor again
+                    motor.suppressed.fetch_add(n - motor.setpoints_taken[i], std::memory_order_relaxed);
+                    motor.setpoints_taken[i] = n;
+                    continue;
+                }
+
+                if (held)
+                {
+                    wake = (wake == 0 || due < wake) ? due : wake;
+                    continue;
+                }
+
+                if (best < 0 || temp.seq < cmd.seq)
+                {
+                    best = int(i);
+                    cmd = temp;
+                    writes = n;
+                }
+            }
+
+            return best;
+        }
+
+        /**
+         * @brief find the oldest stop or pause not sent yet
+         *
+         * @param motor the motor to look at
+         * @param cmd output command
+         * @param writes output number of writes of the slot cmd is from
+         * @return int index of the slot, -1 if there is none
+         *
+         * @note a stop or pause overwritten before it was sent counts as
+         * suppressed once the newer one is sent.
+         */
+        int Next_safety(Bus_motor &motor, Bus_command &cmd, uint64_t &writes)
+        {
+            int best = -1;
+            for (size_t i = 0; i < safety_count; i++)
+            {
+                if (motor.safety[i].Writes() == motor.safety_taken[i])
+                {
+                    continue;
+                }
+
+                Bus_command temp;
+                uint64_t n = motor.safety[i].Read(temp);
+                if (best < 0 || temp.seq < cmd.seq)
+                {
+                    best = int(i);
+                    cmd = temp;
+                    writes = n;
+                }
+            }
+            return best;
+        }
+
+        /**
+         * @brief mark a setpoint from Next_setpoint() as sent
+         *
+         * @param motor the motor it is addressed to
+         * @param slot index of the slot
+         * @param writes number of writes of the slot when it was read
+         *
+         * @note every write before the one sent was overwritten unsent.
+         */
+        void Take_setpoint(Bus_motor &motor, const int slot, const uint64_t writes)
+        {
+            motor.suppressed.fetch_add(writes - motor.setpoints_taken[slot] - 1, std::memory_order_relaxed);
+            motor.setpoints_taken[slot] = writes;
+        }
+
+        /**
+         * @brief whether a motor should be polled now
+         *
+         * @param motor the motor to look at
+         * @param wake set to when the poll is due, if earlier
+         * @return true if it is due
+         */
+        bool Poll_due(const Bus_motor &motor, int64_t &wake)
+        {
+            int64_t interval = poll_interval.load(std::memory_order_relaxed);
+            if (interval == 0 || motor.last_feedback_request == 0)
+            {
+                return true;
+            }
+
+            // counted from when the request went out, so that the rate does
+            // not depend on how long the transaction takes
+            int64_t due = motor.last_feedback_request + interval;
+            if (Get_time() >= due)
+            {
+                return true;
+            }
+
+            wake = (wake == 0 || due < wake) ? due : wake;
+            return false;
+        }
+
+        /**
+         * @brief sleep until something is submitted or a time is reached
+         *
+         * @param wake local time in us, 0 to sleep until something is
+         * submitted
+         */
+        void Wait_until(const int64_t wake)
+        {
+            if (wake == 0)
+            {
+                while (sem_wait(&bus_sem) != 0 && errno == EINTR)
+                {
+                }
+                return;
+            }
+
+            // sem_timedwait() only takes the realtime clock
+            int64_t remaining = wake - Get_time();
+            timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            int64_t ns = int64_t(ts.tv_nsec) + ((remaining > 0) ? remaining : 0) * 1000;
+            ts.tv_sec += time_t(ns / 1000000000LL);
+            ts.tv_nsec = long(ns % 1000000000LL);
+            while (sem_timedwait(&bus_sem, &ts) != 0 && errno == EINTR)
+            {
+            }
+        }
+
+        /**
+         * @brief whether the link should count as lost
+         *
+         * @note a port that gives errors is gone, no need to wait for the
+         * timeout.
+         */
+        bool Link_lost()
+        {
+            Link_health health = Get_link_health();
+            return health.consecutive_failures >= link_loss_failures &&
+                   ((health.flags & (LINK_WRITE_FAILED | LINK_READ_FAILED | LINK_CLOSED)) || Get_time() - health.last_valid_frame >= link_loss_timeout_us);
+        }
+
+        /**
+         * @brief stop sending and schedule the first reconnect attempt
+         */
+        void Lose_link()
+        {
+            int64_t now = Get_time();
+            link_lost = true;
+            reconnect_wait = reconnect_interval_us;
+            next_reconnect = now + reconnect_wait;
+
+            bus_health.Update([&](Bus_health &health) {
+                health.state = LINK_LOST;
+                health.losses++;
+                health.lost_since = now;
+            });
+
+#if DEBUG_PRINT_ENABLED
+            printf("Bus link lost\n");
+#endif
+        }
+
+        /**
+         * @brief send a command and wait for its reply whatever the response
+         * mode, as Execute() does
+         *
+         * @param frame frame to send
+         * @return true if the reply came
+         */
+        template <size_t N>
+        bool Wait_transaction(const std::array<uint8_t, N> &frame)
+        {
+            Feedback fb;
+            return Command_transaction(frame.data(), N, Reply_length(frame[1]), &fb) == TRANSACTION_OK;
+        }
+
+        /**
+         * @brief reopen the port, check that every motor answers and run the
+         * init on them
+         *
+         * @param active bit n is set if motor n is in the schedule
+         *
+         * @note on failure the next attempt is scheduled with backoff.
+         */
+        void Reconnect(const uint64_t active)
+        {
+            bool ok = (Serial_open(bus_type, bus_port.c_str(), bus_baud) == 0);
+            for (uint8_t id = 1; ok && id <= max_motor_id; id++)
+            {
+                if (active & (1ULL << id))
+                {
+                    ok = Wait_transaction(Encode_read_motor_state(id));
+                }
+            }
+
+            // nothing from before the loss is sent, the init comes first
+            Bus_init init = reconnect_init.load(std::memory_order_relaxed);
+            for (uint8_t id = 1; ok && id <= max_motor_id; id++)
+            {
+                if (active & (1ULL << id))
+                {
+                    motors[id].Void_commands();
+                    ok = init ? init(id) : Wait_transaction(Encode_pause(id));
+                }
+            }
+
+            if (!ok)
+            {
+                reconnect_wait = (2 * reconnect_wait < max_reconnect_interval_us) ? (2 * reconnect_wait) : max_reconnect_interval_us;
+                next_reconnect = Get_time() + reconnect_wait;
+                bus_health.Update([](Bus_health &health) {
+                    health.failed_attempts++;
+                });
+                return;
+            }
+
+            link_lost = false;
+            bus_health.Update([](Bus_health &health) {
+                health.state = LINK_UP;
+                health.reconnects++;
+                health.lost_since = 0;
+            });
+
+#if DEBUG_PRINT_ENABLED
+            printf("Bus link back\n");
+#endif
+        }
+
+        /**
+         * @brief bus thread, serves the motors round-robin
+         */
+        void Bus_thread()
+        {
+            Bus_command setpoint;
+            while (true)
+            {
+                bool running = bus_running.load(std::memory_order_acquire);
+                bool polling = running && bus_polling.load(std::memory_order_relaxed);
+                uint64_t active = active_motors.load(std::memory_order_acquire);
+
+                if (link_lost)
+                {
+                    // nothing could be flushed into a dead link
+                    if (!running)
+                    {
+                        return;
+                    }
+
+                    if (Get_time() >= next_reconnect)
+                    {
+                        Reconnect(active);
+                    }
+                    else
+                    {
+                        Wait_until(next_reconnect);
+                    }
+                    continue;
+                }
+
+                bool busy = false;
+                // when the earliest held back setpoint or poll is due, 0 for none
+                int64_t wake = 0;
+
+                // one turn for every motor in the schedule
+                for (uint8_t id = 1; id <= max_motor_id; id++)
+                {
+                    if (!(active & (1ULL << id)))
+                    {
+                        continue;
+                    }
+
+                    Bus_motor &motor = motors[id];
+                    uint64_t writes = 0;
+
+                    // a stop or pause goes ahead of the queue and the setpoints
+                    int safe = Next_safety(motor, setpoint, writes);
+                    if (safe >= 0)
+                    {
+                        int64_t delay = Get_time() - setpoint.submit_time;
+                        if (delay > motor.max_queue_delay.load(std::memory_order_relaxed))
+                        {
+                            motor.max_queue_delay.store(delay, std::memory_order_relaxed);
+                        }
+
+                        motor.suppressed.fetch_add(writes - motor.safety_taken[safe] - 1, std::memory_order_relaxed);
+                        motor.safety_taken[safe] = writes;
+                        Execute(motor, setpoint.frame, setpoint.frame_len, setpoint.response_len);
+                        busy = true;
+                        continue;
+                    }
+
+                    if (!motor.has_next)
+                    {
+                        motor.has_next = motor.queue.Pop(motor.next);
+                    }
+                    while (motor.has_next && motor.next.frame[1] == CMD_RESUME && motor.next.seq <= motor.safety_seq.load(std::memory_order_acquire))
+                    {
+                        // a stop or pause came after it and went ahead
+                        motor.suppressed.fetch_add(1, std::memory_order_relaxed);
+                        motor.has_next = motor.queue.Pop(motor.next);
+                    }
+
+                    // the rate limit is lifted to flush everything on close
+                    int slot = Next_setpoint(motor, setpoint, running, wake, writes);
+
+                    // queued commands and setpoints go in the order submitted
+                    if (motor.has_next && (slot < 0 || motor.next.seq < setpoint.seq))
+                    {
+                        int64_t delay = Get_time() - motor.next.submit_time;
+                        if (delay > motor.max_queue_delay.load(std::memory_order_relaxed))
+                        {
+                            motor.max_queue_delay.store(delay, std::memory_order_relaxed);
+                        }
+
+                        motor.has_next = false;
+                        Execute(motor, motor.next.frame, motor.next.frame_len, motor.next.response_len);
+                        busy = true;
+                    }
+                    else if (slot >= 0)
+                    {
+                        int64_t delay = Get_time() - setpoint.submit_time;
+                        if (delay > motor.max_queue_delay.load(std::memory_order_relaxed))
+                        {
+                            motor.max_queue_delay.store(delay, std::memory_order_relaxed);
+                        }
+
+                        Take_setpoint(motor, slot, writes);
+                        motor.last_setpoint = Get_time();
+                        Execute(motor, setpoint.frame, setpoint.frame_len, setpoint.response_len);
+                        busy = true;
+                    }
+                    else if (polling && Poll_due(motor, wake))
+                    {
+                        auto frame = Encode_read_motor_state(id);
+                        motor.polls.fetch_add(1, std::memory_order_relaxed);
+                        Execute(motor, frame.data(), frame.size(), feedback_len);
+                        busy = true;
+                    }
+                }
+
+                if (busy)
+                {
+                    if (Link_lost())
+                    {
+                        Lose_link();
+                        continue;
+                    }
+
+                    // we will look at every queue again anyway
+                    while (sem_trywait(&bus_sem) == 0)
+                    {
+                    }
+                }
+                else if (!running)
+                {
+                    // woken up by Bus_close() with nothing left to send
+                    return;
+                }
+                else
+                {
+                    // until a held back setpoint or poll is due, if any
+                    Wait_until(wake);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief open serial and launch the bus thread
+     *
+     * @param type which serial backend to use
+     * @param port path to the serial port
+     * @param baud baud rate
+     * @return 0 for OK and 1 for failed
+     */
+    int Bus_open(const Transport_type type, const char *port, const int baud)
+    {
+        Bus_close();
+
+        if (Serial_open(type, port, baud) != 0)
+        {
+            return 1;
+        }
+
+        for (auto &motor : motors)
+        {
+            motor.Reset();
+        }
+        bus_type = type;
+        bus_port = port;
+        bus_baud = baud;
+        bus_health.Write(Bus_health());
+        link_lost = false;
+        active_motors = 0;
+        bus_polling = false;
+        if (!bus_sem_ready)
+        {
+            sem_init(&bus_sem, 0, 0);
+            bus_sem_ready = true;
+        }
+
+        bus_running.store(true, std::memory_order_release);
+        bus_thread = std::thread(Bus_thread);
+
+        return 0;
+    }
+
+    /**
+     * @brief send what is still in the queues, stop the bus thread and close
+     * serial
+     */
+    void Bus_close()
+    {
+        if (!bus_running.exchange(false))
+        {
+            return;
+        }
+
+        // a submitter that saw the bus open gets its command in before the
+        // last flush
+        while (bus_submitters.load() != 0)
+        {
+            std::this_thread::yield();
+        }
+
+        sem_post(&bus_sem);
+        bus_thread.join();
+
+        Serial_close();
+    }
+
+    /**
+     * @brief add a motor to the round-robin schedule
+     *
+     * @param id motor ID, 1~32
+     * @return true if added
+     *
+     * @note a motor is also added the first time a command is submitted to it.
+     */
+    bool Bus_add_motor(const uint8_t id)
+    {
+        if (!bus_running.load(std::memory_order_acquire) || id == 0 || id > max_motor_id)
+        {
+            return false;
+        }
+
+        active_motors.fetch_or(1ULL << id, std::memory_order_release);
+        sem_post(&bus_sem);
+        return true;
+    }
+
+    /**
+     * @brief poll motors that have nothing to send or not
+     *
+     * @param enable true to poll
+     */
+    void Bus_set_polling(const bool enable)
+    {
+        bus_polling.store(enable, std::memory_order_relaxed);
+        if (bus_running.load(std::memory_order_acquire))
+        {
+            sem_post(&bus_sem);
+        }
+    }
+
+    /**
+     * @brief poll every motor at a fixed rate instead of whenever idle
+     *
+     * @param rate polls per second per motor, 0 to poll whenever idle
+     *
+     * @note a motor is only polled when it has had no feedback for 1/rate,
+     * so commands that bring feedback count too. the achieved rate is
+     * limited by the baud rate, see Bus_stats::update_rate.
+     * @note polling should be enabled by Bus_set_polling().
+     */
+    void Bus_set_poll_rate(const float rate)
+    {
+        poll_rate.store((rate > 0.0F) ? rate : 0.0F, std::memory_order_relaxed);
+        poll_interval.store((rate > 0.0F) ? int64_t(1000000.0F / rate) : 0, std::memory_order_relaxed);
+        if (bus_running.load(std::memory_order_acquire))
+        {
+            sem_post(&bus_sem);
+        }
+    }
+
+    /**
+     * @brief whether motors that have nothing to send are polled, see
+     * Bus_set_polling()
+     */
+    bool Bus_get_polling()
+    {
+        return bus_polling.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief polls per second per motor, 0 for whenever idle, see
+     * Bus_set_poll_rate()
+     */
+    float Bus_get_poll_rate()
+    {
+        return poll_rate.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief set the smoothing of the motion estimators
+     *
+     * @param smoothing from 0 to 1, higher is smoother but lags more, see
+     * Motion_estimator::Set_smoothing()
+     */
+    void Bus_set_motion_smoothing(const float smoothing)
+    {
+        motion_smoothing.store(smoothing, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief get the latest estimated motion of a motor
+     *
+     * @param id motor ID, 1~32
+     * @return Motion_sample latest sample, sequence is 0 if there is none
+     *
+     * @note lock-free, safe to call from any thread.
+     */
+    Motion_sample Get_motion(const uint8_t id)
+    {
+        Motion_sample sample;
+        if (id == 0 || id > max_motor_id)
+        {
+            return sample;
+        }
+
+        const Bus_motor &motor = motors[id];
+        uint64_t n = motor.motion_count.load(std::memory_order_acquire);
+        if (n != 0)
+        {
+            motor.motion[n % motion_history_len].Read(sample);
+        }
+        return sample;
+    }
+
+    /**
+     * @brief get the estimated motion samples of a motor that came after a
+     * given one
+     *
+     * @param id motor ID, 1~32
+     * @param since sequence of the last sample already read, 0 for none
+     * @param out output samples, oldest first
+     * @param max size of out
+     * @return size_t number of samples written to out
+     *
+     * @note at most the newest motion_history_len samples are kept, older
+     * ones are lost if not read in time. compare the sequence of out[0] with
+     * since + 1 to tell.
+     * @note lock-free, safe to call from any thread.
+     */
+    size_t Get_motion_history(const uint8_t id, const uint64_t since, Motion_sample *out, const size_t max)
+    {
+        if (id == 0 || id > max_motor_id || max == 0)
+        {
+            return 0;
+        }
+
+        const Bus_motor &motor = motors[id];
+        uint64_t last = motor.motion_count.load(std::memory_order_acquire);
+        uint64_t first = since + 1;
+        if (last >= motion_history_len && first <= last - motion_history_len)
+        {
+            first = last - motion_history_len + 1;
+        }
+        if (last >= max && first <= last - max)
+        {
+            first = last - max + 1;
+        }
+
+        size_t count = 0;
+        for (uint64_t n = first; n <= last; n++)
+        {
+            // skip it if it has been overwritten while we read
+            if (motor.motion[n % motion_history_len].Read(out[count]) != 0 && out[count].sequence == n)
+            {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * @brief limit how often setpoints are sent to one motor
+     *
+     * @param rate maximum setpoints per second per motor, 0 for no limit
+     *
+     * @note only the newest setpoint is sent when the limit allows, the ones
+     * in between are counted as suppressed.
+     */
+    void Bus_set_rate_limit(const float rate)
+    {
+        setpoint_interval.store((rate > 0.0F) ? int64_t(1000000.0F / rate) : 0, std::memory_order_relaxed);
+        if (bus_running.load(std::memory_order_acquire))
+        {
+            sem_post(&bus_sem);
+        }
+    }
+
+    namespace
+    {
+        /**
+         * @brief Bus_submit() once the bus is known to be open
+         */
+        bool Submit(const uint8_t *frame, const size_t frame_len, const size_t response_len)
+        {
+            if (frame_len < header_len || frame_len > max_frame_len || response_len > max_frame_len)
+            {
+                return false;
+            }
+
+            const uint8_t id = frame[2];
+            if (id == 0 || id > max_motor_id)
+            {
+                return false;
+            }
+            Bus_motor &motor = motors[id];
+
+            Bus_command cmd;
+            memcpy(cmd.frame, frame, frame_len);
+            cmd.frame_len = uint8_t(frame_len);
+            cmd.response_len = uint8_t(response_len);
+            cmd.seq = bus_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+            cmd.submit_time = Get_time();
+
+            int safe = Safety_index(frame[1]);
+            int slot = Setpoint_index(frame[1]);
+            if (safe >= 0)
+            {
+                // has a slot of its own, so it could not be turned away
+                motor.safety[safe].Write(cmd);
+
+                // setpoints and resumes before it will not be sent
+                uint64_t last = motor.safety_seq.load(std::memory_order_relaxed);
+                while (last < cmd.seq && !motor.safety_seq.compare_exchange_weak(last, cmd.seq, std::memory_order_release, std::memory_order_relaxed))
+                {
+                }
+            }
+            else if (slot >= 0)
+            {
+                // the same setpoint is already in force or on its way
+                Bus_command last;
+                if (motor.setpoints[slot].Read(last) != 0 && last.seq > motor.safety_seq.load(std::memory_order_acquire) &&
+                    last.frame_len == cmd.frame_len && memcmp(last.frame, cmd.frame, frame_len) == 0)
+                {
+                    motor.suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+
+                motor.setpoints[slot].Write(cmd);
+            }
+            else
+            {
+                if (!motor.queue.Push(cmd))
+                {
+                    motor.rejected.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            }
+
+            motor.submitted.fetch_add(1, std::memory_order_relaxed);
+            active_motors.fetch_or(1ULL << id, std::memory_order_release);
+            sem_post(&bus_sem);
+            return true;
+        }
+    }
+
+    /**
+     * @brief put a command frame into the queue of the motor it is addressed to
+     *
+     * @param frame complete command frame, at most max_frame_len bytes
+     * @param frame_len length of the frame
+     * @param response_len length of the reply, feedback_len for feedback
+     * @return true if queued, false if the bus is not open, the ID is invalid
+     * or the queue is full. stop and pause are never turned away by a full
+     * queue.
+     *
+     * @note never blocks, safe to call from any thread.
+     * @note setpoints (power, torque, velocity and position control) are
+     * coalesced, see the notes in motor_bus.hpp.
+     */
+    bool Bus_submit(const uint8_t *frame, const size_t frame_len, const size_t response_len)
+    {
+        // seen by Bus_close() before it stops the bus thread, or we see the
+        // bus closed
+        bus_submitters.fetch_add(1);
+        bool ok = bus_running.load() && Submit(frame, frame_len, response_len);
+        bus_submitters.fetch_sub(1, std::memory_order_release);
+        return ok;
+    }
+
+    /**
+     * @brief set what is run on every motor when the link comes back
+     *
+     * @param init init function, nullptr for the default, which pauses the
+     * motor
+     *
+     * @note the motor should be left in a safe state, the control code
+     * could tell from Bus_health::reconnects and start it again.
+     * @note init runs in the response mode set by Set_response_mode(), in
+     * RESPONSE_DEFERRED echo commands like Pause() return
+     * TRANSACTION_PENDING. the default pause always waits for its reply.
+     */
+    void Bus_set_reconnect_init(const Bus_init init)
+    {
+        reconnect_init.store(init, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief get the health of the bus and the link
+     *
+     * @return Bus_health state, link health and counters since Bus_open()
+     *
+     * @note lock-free, safe to call from any thread.
+     */
+    Bus_health Get_bus_health()
+    {
+        Bus_health health;
+        bus_health.Read(health);
+        health.link = Get_link_health();
+        return health;
+    }
+
+    /**
+     * @brief get bus counters of one motor
+     *
+     * @param id motor ID, 1~32
+     * @return Bus_stats counters since Bus_open()
+     */
+    Bus_stats Get_bus_stats(const uint8_t id)
+    {
+        Bus_stats stats;
+        if (id == 0 || id > max_motor_id)
+        {
+            return stats;
+        }
+
+        const Bus_motor &motor = motors[id];
+        stats.submitted = motor.submitted.load(std::memory_order_relaxed);
+        stats.rejected = motor.rejected.load(std::memory_order_relaxed);
+        stats.completed = motor.completed.load(std::memory_order_relaxed);
+        stats.failed = motor.failed.load(std::memory_order_relaxed);
+        stats.polls = motor.polls.load(std::memory_order_relaxed);
+        stats.suppressed = motor.suppressed.load(std::memory_order_relaxed);
+        stats.max_queue_delay = motor.max_queue_delay.load(std::memory_order_relaxed);
+        stats.update_rate = motor.update_rate.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief get bus counters of all motors together
+     *
+     * @return Bus_stats counters since Bus_open(), update_rate is the sum
+     */
+    Bus_stats Get_bus_stats()
+    {
+        Bus_stats total;
+        for (uint8_t id = 1; id <= max_motor_id; id++)
+        {
+            Bus_stats stats = Get_bus_stats(id);
+            total.submitted += stats.submitted;
+            total.rejected += stats.rejected;
+            total.completed += stats.completed;
+            total.failed += stats.failed;
+            total.polls += stats.polls;
+            total.suppressed += stats.suppressed;
+            total.max_queue_delay = (stats.max_queue_delay > total.max_queue_delay) ? stats.max_queue_delay : total.max_queue_delay;
+            total.update_rate += stats.update_rate;
+        }
+        return total;
+    }
+
+    /**
+     * @brief (15) completely stop the motor and wipe the motor state/memory
+     *
+     * @return true if queued
+     */
+    bool Motor_handle::Stop() const
+    {
+        return Bus_submit(Encode_stop(id));
+    }
+
+    /**
+     * @brief (16) stop the motor but NOT wipe the motor state/memory
+     *
+     * @return true if queued
+     */
+    bool Motor_handle::Pause() const
+    {
+        return Bus_submit(Encode_pause(id));
+    }
+
+    /**
+     * @brief (17) resume from paused state
+     *
+     * @return true if queued
+     */
+    bool Motor_handle::Resume() const
+    {
+        return Bus_submit(Encode_resume(id));
+    }
+
+    /**
+     * @brief (13) read motor state
+     *
+     * @return true if queued
+     */
+    bool Motor_handle::Read_motor_state() const
+    {
+        return Bus_submit(Encode_read_motor_state(id));
+    }
+
+    /**
+     * @brief (18) open loop power control
+     *
+     * @param power input power from -1000 to 1000
+     * @return true if queued
+     */
+    bool Motor_handle::Set_power(const int16_t power) const
+    {
+        return Bus_submit(Encode_power(id, power));
+    }
+
+    /**
+     * @brief (19) closed loop torque control
+     *
+     * @param iq input torque current from -2000 to 2000, for -32A to 32A
+     * @return true if queued
+     *
+     * @note MF and MG series only
+     */
+    bool Motor_handle::Set_torque(const int16_t iq) const
+    {
+        return Bus_submit(Encode_torque(id, iq));
+    }
+
+    /**
+     * @brief (20) closed loop velocity control
+     *
+     * @param vel input velocity in int32_t, input unit is 0.01dps/LSB
+     * @return true if queued
+     */
+    bool Motor_handle::Set_velocity(const int32_t vel) const
+    {
+        return Bus_submit(Encode_velocity(id, vel));
+    }
+
+    /**
+     * @brief clear loop number
+     *
+     * @return true if queued
+     */
+    bool Motor_handle::Clear_loops() const
+    {
+        return Bus_submit(Encode_clear_loops(id));
+    }
+
+    /**
+     * @brief (21) closed loop multi-loop position control 1
+     *
+     * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+     * @return true if queued
+     */
+    bool Motor_handle::Set_multi_loop_position_1(const int64_t pos) const
+    {
+        return Bus_submit(Encode_multi_loop_position_1(id, pos));
+    }
+
+    /**
+     * @brief (22) closed loop multi-loop position control 2
+     *
+     * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+     * @param max_spd maximum speed in 0.01dps/LSB
+     * @return true if queued
+     */
+    bool Motor_handle::Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd) const
+    {
+        return Bus_submit(Encode_multi_loop_position_2(id, pos, max_spd));
+    }
+
+    /**
+     * @brief resume, clear loops and go to a multi-loop position, then
+     * wait until the motor settles there
+     *
+     * @param pos target multi-loop position in 0.01deg/LSB, counted from
+     * the single-turn angle since the loops are cleared
+     * @param max_spd maximum speed in 0.01dps/LSB
+     * @param timeout time limit in us
+     * @return Home_result HOME_OK as soon as the motor settles
+     *
+     * @note blocks the caller, not the bus. the motor state is polled
+     * every home_poll_interval_us, see home_position_tolerance.
+     * @note the multi-loop angle is not read back, the unwrapped
+     * position of the motor state is anchored to it by the first
+     * feedback after the call instead. the shaft should not cross the
+     * zero of its encoder before the loops are cleared, so do not home
+     * a motor that is still coasting.
+     */
+    Home_result Motor_handle::Home(const int64_t pos, const uint32_t max_spd, const int64_t timeout) const
+    {
+        int64_t start = Get_time();
+        uint64_t last = Get_motor_state(id).sequence;
+
+        // the read comes first, so its reply is from before the motor moves
+        if (!Read_motor_state() || !Resume() || !Clear_loops() || !Set_multi_loop_position_2(pos, max_spd))
+        {
+            return HOME_FAILED;
+        }
+
+        bool anchored = false;
+        int64_t target = 0;
+        int settled = 0;
+        int64_t next_poll = start + home_poll_interval_us;
+        while (Get_time() - start < timeout)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(home_poll_interval_us / 5));
+
+            Motor_state state = Get_motor_state(id);
+            if (state.sequence != last)
+            {
+                last = state.sequence;
+                if (!anchored)
+                {
+                    // right after clearing, the multi-loop angle is the
+                    // single-turn angle, which the unwrapped position is a
+                    // whole number of turns away from
+                    anchored = true;
+                    target = pos + state.position - Encoder_to_Motor_position(state.feedback.encoder);
+                }
+                else
+                {
+                    bool still = std::abs(state.position - target) <= home_position_tolerance && std::abs(state.feedback.velocity) <= home_velocity_tolerance;
+                    settled = still ? (settled + 1) : 0;
+                    if (settled >= home_settle_count)
+                    {
+                        return HOME_OK;
+                    }
+                }
+            }
+
+            // polls whether or not the bus does
+            if (anchored && Get_time() >= next_poll)
+            {
+                Read_motor_state();
+                next_poll += home_poll_interval_us;
+            }
+        }
+
+        return anchored ? HOME_TIMEOUT : HOME_FAILED;
+    }
+}
@@ -0,0 +1,149 @@
+/**
+ * @file frame_codec_bench.cpp
+ * @brief compare the old std::vector based command path with the fixed size
+ * frame codec in motor_frame.hpp
+ *
+ * @note only the host side work is measured: build the command, hand it to
+ * the "serial port", copy the response back and parse it. the serial port
+ * is a memcpy so that the numbers are not buried in UART time.
+ */
+#include "motor_frame.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+using std::vector;
+
+// count every heap allocation made by the benchmark
+static size_t alloc_count = 0;
+
+void *operator new(size_t size)
+{
+    alloc_count++;
+    void *p = malloc(size);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+namespace
+{
+    constexpr uint8_t Motor_ID = 0x01;
+
+    // canned reply of the motor and a fake wire to send things through
+    uint8_t reply[Motor::feedback_len];
+    uint8_t wire[Motor::max_frame_len];
+
+    // results, volatile so that the compiler will not throw the work away
+    volatile uint16_t encoder_position = 0;
+    volatile int16_t motor_velocity = 0;
+
+    /********************** old path, copied from motor.cpp **********************/
+
+    char Checksum_legacy(const vector<char> in, const size_t start, const size_t end)
+    {
+        uint8_t cs = 0;
+
+        for (size_t i = start; i <= end; i++)
+        {
+            cs += in[i];
+        }
+
+        return cs;
+    }
+
+    vector<char> Serial_transaction_legacy(const vector<char> input, const size_t response_len)
+    {
+        char temp[30];
+        memcpy(temp, input.data(), input.size());
+        memcpy(wire, temp, input.size());
+
+        vector<char> output(response_len, 0);
+        memcpy(output.data(), reply, response_len);
+
+        return output;
+    }
+
+    void Parse_response_legacy(const vector<char> response)
+    {
+        encoder_position = (((uint16_t)response[11]) << 8) + response[10];
+        motor_velocity = (((int16_t)response[9]) << 8) + response[8];
+    }
+
+    void Set_velocity_legacy(const int32_t vel)
+    {
+        vector<char> in = {0x3E, (char)0xA2, Motor_ID, 0x04, 0x00, (char)(uint8_t)(vel & 0xFF), (char)(uint8_t)((vel >> 8) & 0xFF), (char)(uint8_t)((vel >> 16) & 0xFF), (char)(uint8_t)((vel >> 24) & 0xFF), 0x00};
+        in[4] = Checksum_legacy(in, 0, 3);
+        in[9] = Checksum_legacy(in, 5, 8);
+        Parse_response_legacy(Serial_transaction_legacy(in, 13));
+    }
+
+    /******************************* codec path *******************************/
+
+    size_t Serial_transaction_codec(const uint8_t *input, const size_t input_len, uint8_t *output, const size_t response_len)
+    {
+        memcpy(wire, input, input_len);
+        memcpy(output, reply, response_len);
+        return response_len;
+    }
+
+    void Set_velocity_codec(const int32_t vel)
+    {
+        auto in = Motor::Encode_velocity(Motor_ID, vel);
+        uint8_t response[Motor::feedback_len];
+        Serial_transaction_codec(in.data(), in.size(), response, Motor::feedback_len);
+
+        Motor::Feedback fb;
+        if (Motor::Decode_feedback(response, fb))
+        {
+            encoder_position = fb.encoder;
+            motor_velocity = fb.velocity;
+        }
+    }
+
+    /**
+     * @brief run func for n times and print ns/op and allocations/op
+     */
+    template <typename F>
+    void Run(const char *name, F func, const int n)
+    {
+        size_t alloc_start = alloc_count;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++)
+        {
+            func(int32_t(i * 7 - n));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+        printf("%-10s : %8.1f ns/op, %5.2f allocations/op\n", name, ns, double(alloc_count - alloc_start) / n);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n = (argc > 1) ? atoi(argv[1]) : 10000000;
+
+    // a valid velocity feedback with the low byte of encoder >= 0x80
+    uint8_t data[7] = {0x20, 0x10, 0x00, 0xD2, 0x04, 0x9A, 0x3F};
+    auto fb = Motor::Make_frame<7>(Motor::CMD_VELOCITY, Motor_ID);
+    memcpy(fb.data() + Motor::header_len, data, 7);
+    Motor::Seal_frame(fb);
+    memcpy(reply, fb.data(), Motor::feedback_len);
+
+    printf("Set_velocity round trip, %d iterations\n", n);
+    Run("legacy", Set_velocity_legacy, n);
+    Run("codec", Set_velocity_codec, n);
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file natnet_decode_bench.cpp
+ * @brief time Decode_frame() in PrunedNatNet on packets with many markers
+ *
+ * @note the packets are made up in natnet_packet.hpp in the layout Motive
+ * streams, with as many marker sets, labeled markers, skeletons and devices as
+ * asked for around the rigid bodies. the same content is encoded as NatNet
+ * 4.0, which has to be walked through, and as NatNet 4.1, which is jumped over
+ * with the section sizes, and both must decode to the same rigid bodies.
+ * @note the same packets cut short must be turned down, and how long that
+ * takes is timed too.
+ */
+#include "PrunedNatNet.hpp"
+#include "natnet_packet.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+using std::vector;
+using Optitrack::Frame_State;
+
+namespace
+{
+    struct Options : Natnet_packet::Content
+    {
+        int repeat = 200000;
+    } opt;
+
+    /**
+     * @brief ns per call of Decode_frame() on the packets, in turn
+     */
+    double Time(vector<vector<char>> &data, const int minor, uint64_t &sum)
+    {
+        Frame_State frame;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < opt.repeat; i++)
+        {
+            vector<char> &p = data[i % data.size()];
+            sum += Optitrack::Decode_frame(p.data(), int(p.size()), 4, minor, frame);
+            sum += frame.frameNumber;
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        return elapsed / opt.repeat;
+    }
+
+    void Run(const int minor)
+    {
+        // a few different packets, so the decoding is not one branch pattern
+        constexpr int packets = 16;
+        vector<vector<char>> data;
+        for (int i = 0; i < packets; i++)
+        {
+            data.push_back(Natnet_packet::Make_packet(opt, minor, i + 1));
+        }
+
+        Frame_State frame;
+        for (int i = 0; i < packets; i++)
+        {
+            if (!Optitrack::Decode_frame(data[i].data(), int(data[i].size()), 4, minor, frame) || !Natnet_packet::Check(opt, frame, i + 1))
+            {
+                fprintf(stderr, "NatNet 4.%d packet %d decoded wrong.\n", minor, i + 1);
+                exit(1);
+            }
+        }
+
+        // the same packets cut short, in the suffix or halfway, with the
+        // length in the header cut to match so they are decoded up to the end
+        vector<vector<char>> cut;
+        for (int i = 0; i < packets; i++)
+        {
+            cut.push_back(data[i]);
+            cut[i].resize(i % 2 ? data[i].size() - 5 : data[i].size() / 2);
+            uint16_t len = uint16_t(cut[i].size() - 4);
+            memcpy(&cut[i][2], &len, 2);
+            if (Optitrack::Decode_frame(cut[i].data(), int(cut[i].size()), 4, minor, frame))
+            {
+                fprintf(stderr, "NatNet 4.%d packet %d decoded cut short.\n", minor, i + 1);
+                exit(1);
+            }
+        }
+
+        uint64_t sum = 0;
+        double ns = Time(data, minor, sum);
+        printf("4.%d,%s,%zu,%d,%.1f,%.0f,%.1f\n", minor, minor > 0 ? "skip" : "walk", data[0].size(),
+               opt.marker_sets * opt.markers + opt.labeled_markers, ns, 1.0e9 / ns, double(data[0].size()) * 1.0e3 / ns);
+        ns = Time(cut, minor, sum);
+        printf("4.%d,reject,%zu,%d,%.1f,%.0f,%.1f\n", minor, cut[0].size(),
+               opt.marker_sets * opt.markers + opt.labeled_markers, ns, 1.0e9 / ns, double(cut[0].size()) * 1.0e3 / ns);
+        fprintf(stderr, "checksum of decoded frame numbers: %llu\n", (unsigned long long)sum);
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [options]\n\n", name);
+        fprintf(stderr, "\t-r bodies   rigid bodies (default 4)\n");
+        fprintf(stderr, "\t-s sets     marker sets (default 8)\n");
+        fprintf(stderr, "\t-m markers  markers per marker set (default 20)\n");
+        fprintf(stderr, "\t-l markers  labeled markers (default 200)\n");
+        fprintf(stderr, "\t-k count    skeletons of 21 bones (default 1)\n");
+        fprintf(stderr, "\t-d count    force plates and devices each (default 2)\n");
+        fprintf(stderr, "\t-n repeat   packets to decode per version (default 200000)\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "r:s:m:l:k:d:n:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            opt.rigid_bodies = atoi(optarg);
+            break;
+        case 's':
+            opt.marker_sets = atoi(optarg);
+            break;
+        case 'm':
+            opt.markers = atoi(optarg);
+            break;
+        case 'l':
+            opt.labeled_markers = atoi(optarg);
+            break;
+        case 'k':
+            opt.skeletons = atoi(optarg);
+            break;
+        case 'd':
+            opt.devices = atoi(optarg);
+            break;
+        case 'n':
+            opt.repeat = atoi(optarg);
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.rigid_bodies < 0 || opt.rigid_bodies > Optitrack::max_rigid_bodies || opt.marker_sets < 0 || opt.markers < 0 ||
+        opt.labeled_markers < 0 || opt.skeletons < 0 || opt.devices < 0 || opt.repeat < 1)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    printf("natnet,path,packet_bytes,markers,ns_per_frame,frames_per_s,mb_per_s\n");
+    Run(0);
+    Run(1);
+    return 0;
+}
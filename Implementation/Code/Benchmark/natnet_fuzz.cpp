@@ -0,0 +1,226 @@
+/**
+ * @file natnet_fuzz.cpp
+ * @brief feed Decode_frame() in PrunedNatNet with broken packets
+ *
+ * @note LLVMFuzzerTestOneInput() is the libFuzzer entry, built as such with
+ * -DNATNET_LIBFUZZER=ON and clang. otherwise main() below drives it, on the
+ * files given, one packet per file as AFL runs it, or on frames of data from
+ * natnet_packet.hpp with bytes flipped, counts and sizes overwritten and the
+ * end cut off. build with -fsanitize=address,undefined so that a read past
+ * the packet is caught, every packet is copied to a buffer of its own size
+ * for that.
+ */
+#include "PrunedNatNet.hpp"
+#include "natnet_packet.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+using std::vector;
+using Optitrack::Frame_State;
+
+namespace
+{
+    // the versions of NatNet the decoder takes different paths for
+    constexpr int versions[][2] = {{4, 1}, {4, 0}, {3, 1}, {3, 0}, {2, 9}, {2, 5}};
+
+    uint64_t decoded = 0;
+    uint64_t rejected = 0;
+
+    /**
+     * @brief abort if a decoded frame could not have come from a packet
+     */
+    void Check(const Frame_State &frame)
+    {
+        if (frame.nRigidBodies < 0 || frame.nRigidBodies > Optitrack::max_rigid_bodies || frame.nSkipped < 0)
+        {
+            fprintf(stderr, "frame %d has %d rigid bodies and %d skipped.\n", frame.frameNumber, frame.nRigidBodies, frame.nSkipped);
+            abort();
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // Decode_frame takes up to 65535 + 4 bytes, the length field is 16 bits
+    if (size > 0x10003)
+    {
+        return 0;
+    }
+
+    for (auto &v : versions)
+    {
+        // a buffer of exactly the packet, so any read past it is out of bounds
+        char *packet = static_cast<char *>(malloc(size ? size : 1));
+        memcpy(packet, data, size);
+
+        Frame_State frame;
+        if (Optitrack::Decode_frame(packet, int(size), v[0], v[1], frame))
+        {
+            Check(frame);
+            decoded++;
+        }
+        else
+        {
+            rejected++;
+        }
+        free(packet);
+    }
+    return 0;
+}
+
+#ifndef NATNET_LIBFUZZER
+namespace
+{
+    struct Options
+    {
+        int iterations = 200000;
+        unsigned seed = 1;
+    } opt;
+
+    /**
+     * @brief break a packet the ways a network or a buggy server would
+     */
+    void Mutate(vector<char> &p, std::mt19937 &rng)
+    {
+        int edits = 1 + int(rng() % 4);
+        for (int e = 0; e < edits && p.size() >= 4; e++)
+        {
+            size_t at = rng() % (p.size() - 3);
+            switch (rng() % 5)
+            {
+            case 0:
+                // flip a bit
+                p[at] ^= char(1 << (rng() % 8));
+                break;
+            case 1:
+            {
+                // a count or size that is huge, negative or just off by a bit
+                static const int32_t values[] = {0, 1, -1, -8, 32, 33, 0x7FFFFFFF, int32_t(0x80000000), 65535, 20000};
+                int32_t v = values[rng() % (sizeof(values) / sizeof(values[0]))];
+                memcpy(&p[at], &v, 4);
+                break;
+            }
+            case 2:
+            {
+                // cut off the end, and sometimes the length in the header too
+                p.resize(at);
+                if (p.size() >= 4 && rng() % 2)
+                {
+                    uint16_t len = uint16_t(p.size() - 4);
+                    memcpy(&p[2], &len, 2);
+                }
+                break;
+            }
+            case 3:
+                // random bytes
+                p[at] = char(rng());
+                break;
+            default:
+                // drop a few bytes from the middle
+                p.erase(p.begin() + at, p.begin() + std::min(p.size(), at + 1 + rng() % 8));
+                break;
+            }
+        }
+    }
+
+    int Run_files(int argc, char *argv[])
+    {
+        for (int i = 0; i < argc; i++)
+        {
+            FILE *f = fopen(argv[i], "rb");
+            if (!f)
+            {
+                fprintf(stderr, "Cannot open %s.\n", argv[i]);
+                return 1;
+            }
+            vector<uint8_t> data;
+            uint8_t buf[4096];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            {
+                data.insert(data.end(), buf, buf + n);
+            }
+            fclose(f);
+            LLVMFuzzerTestOneInput(data.data(), data.size());
+        }
+        return 0;
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [-n iterations] [-s seed] [file ...]\n\n", name);
+        fprintf(stderr, "\t-n iterations  broken packets to make up (default 200000)\n");
+        fprintf(stderr, "\t-s seed        seed of the mutations (default 1)\n");
+        fprintf(stderr, "\tfile           decode these instead, one packet each\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:s:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            opt.iterations = atoi(optarg);
+            break;
+        case 's':
+            opt.seed = unsigned(strtoul(optarg, nullptr, 10));
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.iterations < 0)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    if (optind < argc)
+    {
+        return Run_files(argc - optind, argv + optind);
+    }
+
+    // a few layouts to start from, small and busy
+    vector<vector<char>> seeds;
+    Natnet_packet::Content content;
+    for (int minor = 0; minor <= 1; minor++)
+    {
+        seeds.push_back(Natnet_packet::Make_packet(content, minor, 1));
+        Natnet_packet::Content small;
+        small.rigid_bodies = 1;
+        small.marker_sets = small.labeled_markers = small.skeletons = small.devices = 0;
+        seeds.push_back(Natnet_packet::Make_packet(small, minor, 2));
+        Natnet_packet::Content many = small;
+        many.rigid_bodies = Optitrack::max_rigid_bodies + 4;
+        seeds.push_back(Natnet_packet::Make_packet(many, minor, 3));
+    }
+
+    std::mt19937 rng(opt.seed);
+    for (auto &s : seeds)
+    {
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    }
+    for (int i = 0; i < opt.iterations; i++)
+    {
+        vector<char> p = seeds[rng() % seeds.size()];
+        Mutate(p, rng);
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(p.data()), p.size());
+    }
+
+    printf("packets,decodes,decoded,rejected\n");
+    printf("%d,%llu,%llu,%llu\n", opt.iterations + int(seeds.size()), (unsigned long long)(decoded + rejected),
+           (unsigned long long)decoded, (unsigned long long)rejected);
+    return 0;
+}
+#endif
@@ -0,0 +1,215 @@
+/**
+ * @file natnet_packet.hpp
+ * @brief frames of data in the NatNet layout Motive streams, made up for
+ * NatNetDecodeBench and NatNetFuzz
+ *
+ * @note the same content can be encoded as NatNet 4.0, which has to be walked
+ * through, and as NatNet 4.1, whose sections come with their sizes.
+ */
+#ifndef _NATNET_PACKET_HPP_
+#define _NATNET_PACKET_HPP_
+
+#include "PrunedNatNet.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace Natnet_packet
+{
+    // NatNet message ID of a frame of data
+    constexpr uint16_t frame_of_data = 7;
+
+    struct Content
+    {
+        int rigid_bodies = 4;
+        int marker_sets = 8;
+        // markers per marker set
+        int markers = 20;
+        int labeled_markers = 200;
+        int skeletons = 1;
+        // analog devices and force plates, 1 channel of 10 samples each
+        int devices = 2;
+    };
+
+    struct Writer
+    {
+        std::vector<char> data;
+
+        template <typename T>
+        void Put(const T value)
+        {
+            const char *p = reinterpret_cast<const char *>(&value);
+            data.insert(data.end(), p, p + sizeof(T));
+        }
+
+        /**
+         * @brief start a section with its count, and its size from 4.1
+         *
+         * @return size_t where the size goes, 0 if there is none
+         */
+        size_t Begin(const int count, const bool sized)
+        {
+            Put<int32_t>(count);
+            if (!sized)
+            {
+                return 0;
+            }
+            Put<int32_t>(0);
+            return data.size();
+        }
+
+        void End(const size_t start)
+        {
+            if (start)
+            {
+                int32_t size = int32_t(data.size() - start);
+                memcpy(&data[start - 4], &size, 4);
+            }
+        }
+    };
+
+    inline void Put_body(Writer &w, const int id, const int frame, const bool params)
+    {
+        w.Put<int32_t>(id);
+        for (int k = 0; k < 7; k++)
+        {
+            w.Put<float>(float(frame + id + k));
+        }
+        w.Put<float>(0.0005F);
+        if (params)
+        {
+            w.Put<int16_t>(1);
+        }
+    }
+
+    /**
+     * @brief a frame of data in NatNet 4.minor
+     */
+    inline std::vector<char> Make_packet(const Content &c, const int minor, const int frame)
+    {
+        bool sized = (minor > 0);
+        Writer w;
+        w.Put<uint16_t>(frame_of_data);
+        w.Put<uint16_t>(0);
+
+        w.Put<int32_t>(frame);
+
+        size_t s = w.Begin(c.marker_sets, sized);
+        for (int i = 0; i < c.marker_sets; i++)
+        {
+            char name[32];
+            int n = snprintf(name, sizeof(name), "markerset_%d", i);
+            w.data.insert(w.data.end(), name, name + n + 1);
+            w.Put<int32_t>(c.markers);
+            for (int j = 0; j < c.markers * 3; j++)
+            {
+                w.Put<float>(float(j));
+            }
+        }
+        w.End(s);
+
+        // legacy other markers
+        s = w.Begin(0, sized);
+        w.End(s);
+
+        s = w.Begin(c.rigid_bodies, sized);
+        for (int i = 0; i < c.rigid_bodies; i++)
+        {
+            Put_body(w, i + 1, frame, true);
+        }
+        w.End(s);
+
+        s = w.Begin(c.skeletons, sized);
+        for (int i = 0; i < c.skeletons; i++)
+        {
+            // a skeleton of 21 bones, as Motive streams for a body
+            w.Put<int32_t>(i + 1);
+            w.Put<int32_t>(21);
+            for (int j = 0; j < 21; j++)
+            {
+                Put_body(w, j + 1, frame, true);
+            }
+        }
+        w.End(s);
+
+        // assets from 4.1 only, none here
+        if (sized)
+        {
+            s = w.Begin(0, sized);
+            w.End(s);
+        }
+
+        s = w.Begin(c.labeled_markers, sized);
+        for (int i = 0; i < c.labeled_markers; i++)
+        {
+            w.Put<int32_t>(i);
+            for (int j = 0; j < 4; j++)
+            {
+                w.Put<float>(float(j));
+            }
+            w.Put<int16_t>(0);
+            w.Put<float>(0.0F);
+        }
+        w.End(s);
+
+        // force plates then devices, same layout
+        for (int k = 0; k < 2; k++)
+        {
+            s = w.Begin(c.devices, sized);
+            for (int i = 0; i < c.devices; i++)
+            {
+                w.Put<int32_t>(i);
+                w.Put<int32_t>(1);
+                w.Put<int32_t>(10);
+                for (int j = 0; j < 10; j++)
+                {
+                    w.Put<float>(float(j));
+                }
+            }
+            w.End(s);
+        }
+
+        // suffix: timecode, timestamp, camera, receive and transmit times
+        w.Put<uint32_t>(0);
+        w.Put<uint32_t>(0);
+        w.Put<double>(frame / 240.0);
+        w.Put<uint64_t>(uint64_t(frame) * 41667 + 1);
+        w.Put<uint64_t>(0);
+        w.Put<uint64_t>(0);
+        if (sized)
+        {
+            // precision timestamp
+            w.Put<uint32_t>(0);
+            w.Put<uint32_t>(0);
+        }
+        w.Put<int16_t>(0);
+        w.Put<int32_t>(0);
+
+        uint16_t len = uint16_t(w.data.size() - 4);
+        memcpy(&w.data[2], &len, 2);
+        return w.data;
+    }
+
+    /**
+     * @brief true if the frame holds the rigid bodies Make_packet() wrote
+     */
+    inline bool Check(const Content &c, const Optitrack::Frame_State &f, const int frame)
+    {
+        if (f.frameNumber != frame || f.nRigidBodies != c.rigid_bodies || f.cameraMidExposureTimestamp != uint64_t(frame) * 41667 + 1)
+        {
+            return false;
+        }
+        for (int i = 0; i < f.nRigidBodies; i++)
+        {
+            const Optitrack::Solid_Body_State &b = f.rigidBodies[i];
+            if (b.ID != i + 1 || b.x != float(frame + i + 1) || b.qw != float(frame + i + 7) || !b.bTrackingValid)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * @file pose_ring_stress.cpp
+ * @brief hammer the pose ring of PrunedNatNet with one writer and many
+ * readers and count the torn frames
+ *
+ * @note the writer pushes Frame_State through the same Seqlock_ring as the
+ * listen thread, every field derived from one counter, as fast as it can or
+ * at a given rate. the readers copy the latest frame in a loop and check
+ * that every field came from the same push and that the pushes never go
+ * back. a torn frame fails the run.
+ */
+#include "PrunedNatNet.hpp"
+#include "seqlock.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using std::vector;
+using Optitrack::Frame_State;
+using Optitrack::Solid_Body_State;
+using Optitrack::max_rigid_bodies;
+
+namespace
+{
+    // same as the ring in PrunedNatNet.cpp
+    constexpr size_t buffer_len = 4;
+
+    struct Options
+    {
+        float seconds = 2.0F;
+        int readers = 3;
+        // pushes per second, 0 for as fast as possible
+        float rate = 0.0F;
+    } opt;
+
+    struct Reader_stats
+    {
+        uint64_t reads = 0;
+        uint64_t torn = 0;
+        uint64_t backwards = 0;
+    };
+
+    Motor::Seqlock_ring<Frame_State, buffer_len> ring;
+    std::atomic<bool> running(true);
+
+    /**
+     * @brief the frame of the k th push
+     */
+    void Fill(Frame_State &frame, const uint32_t k)
+    {
+        frame.frameNumber = int(k);
+        frame.cameraMidExposureTimestamp = uint64_t(k) * 1000;
+        frame.nRigidBodies = 1 + int(k % max_rigid_bodies);
+        frame.nSkipped = int(k % 3);
+
+        // floats hold integers exactly up to 2^24
+        float v = float(k & 0xFFFFFF);
+        for (int i = 0; i < frame.nRigidBodies; i++)
+        {
+            Solid_Body_State &body = frame.rigidBodies[i];
+            body.frameNumber = frame.frameNumber;
+            body.cameraMidExposureTimestamp = frame.cameraMidExposureTimestamp;
+            body.ID = i + 1;
+            body.x = body.y = body.z = v;
+            body.qx = body.qy = body.qz = body.qw = -v;
+            body.fError = v;
+            body.bTrackingValid = (k & 1);
+        }
+    }
+
+    /**
+     * @brief true if every field of the frame came from the same push
+     */
+    bool Consistent(const Frame_State &frame)
+    {
+        uint32_t k = uint32_t(frame.frameNumber);
+        if (frame.cameraMidExposureTimestamp != uint64_t(k) * 1000 ||
+            frame.nRigidBodies != 1 + int(k % max_rigid_bodies) || frame.nSkipped != int(k % 3))
+        {
+            return false;
+        }
+
+        float v = float(k & 0xFFFFFF);
+        for (int i = 0; i < frame.nRigidBodies; i++)
+        {
+            const Solid_Body_State &body = frame.rigidBodies[i];
+            if (body.frameNumber != frame.frameNumber || body.cameraMidExposureTimestamp != frame.cameraMidExposureTimestamp ||
+                body.ID != i + 1 || body.x != v || body.y != v || body.z != v ||
+                body.qx != -v || body.qy != -v || body.qz != -v || body.qw != -v ||
+                body.fError != v || body.bTrackingValid != bool(k & 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Read_loop(Reader_stats &stats)
+    {
+        Frame_State frame;
+        uint64_t last = 0;
+        while (running.load(std::memory_order_relaxed))
+        {
+            uint64_t n = ring.Read_latest(frame);
+            if (n == 0)
+            {
+                continue;
+            }
+            stats.reads++;
+            if (!Consistent(frame) || uint64_t(uint32_t(frame.frameNumber)) != n)
+            {
+                stats.torn++;
+            }
+            if (n < last)
+            {
+                stats.backwards++;
+            }
+            last = n;
+        }
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [-s seconds] [-r readers] [-n rate]\n\n", name);
+        fprintf(stderr, "\t-s seconds  duration (default 2)\n");
+        fprintf(stderr, "\t-r readers  reader threads (default 3)\n");
+        fprintf(stderr, "\t-n rate     pushes per second (default as fast as possible)\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "s:r:n:h")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            opt.seconds = float(atof(optarg));
+            break;
+        case 'r':
+            opt.readers = atoi(optarg);
+            break;
+        case 'n':
+            opt.rate = float(atof(optarg));
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.seconds <= 0.0F || opt.readers < 1 || opt.rate < 0.0F)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    vector<Reader_stats> stats(opt.readers);
+    vector<std::thread> readers;
+    for (int i = 0; i < opt.readers; i++)
+    {
+        readers.emplace_back(Read_loop, std::ref(stats[i]));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::microseconds(int64_t(opt.seconds * 1.0e6F));
+    auto period = std::chrono::nanoseconds(opt.rate > 0.0F ? int64_t(1.0e9F / opt.rate) : 0);
+    auto due = start;
+
+    Frame_State frame;
+    uint32_t k = 0;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        Fill(frame, ++k);
+        ring.Push(frame);
+
+        if (opt.rate > 0.0F)
+        {
+            due += period;
+            std::this_thread::sleep_until(due);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    running = false;
+    for (std::thread &t : readers)
+    {
+        t.join();
+    }
+
+    Reader_stats total;
+    for (const Reader_stats &s : stats)
+    {
+        total.reads += s.reads;
+        total.torn += s.torn;
+        total.backwards += s.backwards;
+    }
+
+    printf("readers,seconds,pushes,pushes_per_s,reads,reads_per_s,torn,backwards\n");
+    printf("%d,%.2f,%u,%.0f,%llu,%.0f,%llu,%llu\n", opt.readers, elapsed, k, k / elapsed,
+           (unsigned long long)total.reads, total.reads / elapsed, (unsigned long long)total.torn, (unsigned long long)total.backwards);
+
+    return (total.torn || total.backwards) ? 1 : 0;
+}
@@ -0,0 +1,410 @@
+/**
+ * @file position_predictor_bench.cpp
+ * @brief validate shaft angle predictors against recorded encoder data
+ *
+ * @note the recording is decimated: the predictors only see every n-th
+ * reading, as a slower control loop would, and predict the shaft angle at
+ * every reading in between. the readings they did not see are the truth.
+ * @note three predictors are compared: the mixed-unit float formula
+ * Current_pos() used to have, the int64 Current_pos() on the feedback
+ * velocity, and Predict_position() on the Motion_estimator of the bus.
+ * @note recordings are CSV with the columns "motor time", "motor encoder"
+ * and "motor velocity" in any place, so the log.csv of AllTest works too.
+ * rows repeating the same motor time are skipped.
+ */
+#include "motion_estimator.hpp"
+#include "motor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if MOTOR_USE_PIGPIO
+#include <pigpio.h>
+#endif
+
+using std::string;
+using std::vector;
+using namespace Motor;
+
+namespace
+{
+    struct Reading
+    {
+        // local time in us
+        int64_t timestamp;
+        uint16_t encoder;
+        // feedback velocity in dps
+        int16_t velocity;
+        // unwrapped shaft angle in 0.01deg, the truth
+        int64_t position;
+    };
+
+    struct Options
+    {
+        // record from this serial port instead of validating
+        const char *port = nullptr;
+        int baud = default_baud;
+        uint8_t id = Motor_ID;
+        // readings to record
+        int count = 5000;
+        // velocity to spin at while recording in dps, 0 to leave it
+        float velocity = 0.0F;
+        // predictors see one in every this many readings
+        int decimation = 4;
+        float smoothing = default_motion_smoothing;
+    } opt;
+
+    /**
+     * @brief the old Current_pos(), for comparison
+     *
+     * @note the velocity in dps is multiplied by the time in us and divided
+     * by 360 as if it were turns, and the time difference goes through float.
+     */
+    float Legacy_pos(const Reading &r, const int64_t curr_time)
+    {
+        float rounds = float(r.encoder) / 32768.0F + float((curr_time - r.timestamp) * r.velocity) / 360.0F;
+        return (rounds - std::floor(rounds)) * 2.0F * M_PI;
+    }
+
+    /**
+     * @brief Current_pos() on one reading
+     */
+    float Feedback_pos(const Reading &r, const int64_t curr_time)
+    {
+        int64_t dt = std::max(-max_prediction_us, std::min(max_prediction_us, curr_time - r.timestamp));
+        return Motor_position_to_Rad(r.position + int64_t(r.velocity) * dt / 10000);
+    }
+
+    /**
+     * @brief Predict_position() wrapped to 0~2pi like the others
+     */
+    float Estimator_pos(const Motion_sample &s, const int64_t curr_time)
+    {
+        double deg = std::fmod(Predict_position(s, curr_time), 360.0);
+        return float(((deg < 0.0) ? (deg + 360.0) : deg) * M_PI / 180.0);
+    }
+
+    /**
+     * @brief find the column of a header name, ignoring spaces around it
+     */
+    int Column(const vector<string> &header, const char *name)
+    {
+        for (size_t i = 0; i < header.size(); i++)
+        {
+            size_t b = header[i].find_first_not_of(' ');
+            size_t e = header[i].find_last_not_of(" \r");
+            if (b != string::npos && header[i].substr(b, e - b + 1) == name)
+            {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+    vector<string> Split(const string &line)
+    {
+        vector<string> fields;
+        std::stringstream ss(line);
+        string f;
+        while (std::getline(ss, f, ','))
+        {
+            fields.push_back(f);
+        }
+        return fields;
+    }
+
+    /**
+     * @brief load a recording and unwrap its encoder readings
+     *
+     * @return true if at least two readings were loaded
+     */
+    bool Load(const char *path, vector<Reading> &readings)
+    {
+        std::ifstream in(path);
+        string line;
+        int col_time = -1, col_enc = -1, col_vel = -1;
+
+        // the log of AllTest has other lines before its header
+        while (std::getline(in, line))
+        {
+            vector<string> header = Split(line);
+            col_time = Column(header, "motor time");
+            col_enc = Column(header, "motor encoder");
+            col_vel = Column(header, "motor velocity");
+            if (col_time >= 0 && col_enc >= 0 && col_vel >= 0)
+            {
+                break;
+            }
+        }
+        if (col_time < 0 || col_enc < 0 || col_vel < 0)
+        {
+            fprintf(stderr, "No motor time, motor encoder and motor velocity columns in %s.\n", path);
+            return false;
+        }
+
+        int cols = std::max(col_time, std::max(col_enc, col_vel));
+        while (std::getline(in, line))
+        {
+            vector<string> f = Split(line);
+            if (int(f.size()) <= cols)
+            {
+                continue;
+            }
+
+            Reading r;
+            r.timestamp = strtoll(f[col_time].c_str(), nullptr, 10);
+            r.encoder = uint16_t(atoi(f[col_enc].c_str()));
+            r.velocity = int16_t(atoi(f[col_vel].c_str()));
+            if (!readings.empty() && r.timestamp <= readings.back().timestamp)
+            {
+                continue;
+            }
+
+            // readings close together are unwrapped by the average velocity
+            // in between, as Parse_response() does
+            r.position = Encoder_to_Motor_position(r.encoder);
+            if (!readings.empty())
+            {
+                const Reading &last = readings.back();
+                int64_t expected = last.position + (int64_t(last.velocity) + r.velocity) * (r.timestamp - last.timestamp) / 20000;
+                r.position = Stitch_motor_position(expected, r.position);
+            }
+            readings.push_back(r);
+        }
+
+        return readings.size() >= 2;
+    }
+
+    /**
+     * @brief read the motor state back to back and print it as CSV
+     */
+    int Record()
+    {
+        if (Serial_open(default_transport, opt.port, opt.baud) != 0)
+        {
+            fprintf(stderr, "Could not open %s.\n", opt.port);
+            return 1;
+        }
+
+        if (opt.velocity != 0.0F)
+        {
+            Set_velocity(int32_t(opt.velocity * 100.0F), opt.id);
+        }
+
+        printf("motor time, motor encoder, motor velocity\n");
+        int recorded = 0;
+        while (recorded < opt.count)
+        {
+            if (Read_motor_state(opt.id) != TRANSACTION_OK)
+            {
+                continue;
+            }
+            Motor_state state = Get_motor_state(opt.id);
+            printf("%lld, %u, %d\n", (long long)state.timestamp, unsigned(state.feedback.encoder), int(state.feedback.velocity));
+            recorded++;
+        }
+
+        if (opt.velocity != 0.0F)
+        {
+            Set_velocity(0, opt.id);
+        }
+        Serial_close();
+        return 0;
+    }
+
+    struct Errors
+    {
+        vector<double> abs_deg;
+        double ns_per_call = 0.0;
+    };
+
+    /**
+     * @brief wrapped difference of two angles in rad, as abs deg
+     */
+    double Angle_error(const float predicted, const int64_t truth)
+    {
+        double d = std::remainder(double(predicted) - double(Motor_position_to_Rad(truth)), 2.0 * M_PI);
+        return std::fabs(d) * 180.0 / M_PI;
+    }
+
+    void Print_row(const char *name, Errors &e)
+    {
+        vector<double> &v = e.abs_deg;
+        std::sort(v.begin(), v.end());
+        double mean = 0.0;
+        for (double x : v)
+        {
+            mean += x;
+        }
+        mean = v.empty() ? 0.0 : (mean / v.size());
+        double p99 = v.empty() ? 0.0 : v[std::min(v.size() - 1, size_t(std::ceil(0.99 * v.size())) - 1)];
+
+        printf("%s,%d,%zu,%.4f,%.4f,%.4f,%.1f\n", name, opt.decimation, v.size(), mean, p99, v.empty() ? 0.0 : v.back(), e.ns_per_call);
+    }
+
+    /**
+     * @brief run one predictor over the decimated recording
+     *
+     * @param readings the recording
+     * @param predict called with the index of the last reading seen and the
+     * time to predict at, returns the angle in rad
+     * @param seen called with the index of every reading the predictor sees
+     */
+    template <typename P, typename S>
+    Errors Validate(const vector<Reading> &readings, P predict, S seen)
+    {
+        Errors e;
+        vector<float> predicted;
+        vector<size_t> target;
+
+        for (size_t i = 0; i < readings.size(); i++)
+        {
+            if (i % size_t(opt.decimation) == 0)
+            {
+                seen(i);
+            }
+            else
+            {
+                target.push_back(i);
+            }
+        }
+        predicted.resize(target.size());
+
+        // time the predictions alone, with the inputs of the last seen reading
+        auto t0 = std::chrono::steady_clock::now();
+        size_t last = 0;
+        size_t k = 0;
+        for (size_t i = 1; i < readings.size(); i++)
+        {
+            if (i % size_t(opt.decimation) == 0)
+            {
+                last = i;
+                continue;
+            }
+            predicted[k++] = predict(last, readings[i].timestamp);
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        e.ns_per_call = predicted.empty() ? 0.0 : (elapsed / predicted.size());
+
+        for (size_t j = 0; j < predicted.size(); j++)
+        {
+            e.abs_deg.push_back(Angle_error(predicted[j], readings[target[j]].position));
+        }
+        return e;
+    }
+
+    int Run(const char *path)
+    {
+        vector<Reading> readings;
+        if (!Load(path, readings))
+        {
+            fprintf(stderr, "Could not load %s.\n", path);
+            return 1;
+        }
+
+        printf("predictor,decimation,predictions,mean_deg,p99_deg,max_deg,ns_per_call\n");
+
+        Errors e = Validate(
+            readings, [&](size_t last, int64_t t) { return Legacy_pos(readings[last], t); }, [](size_t) {});
+        Print_row("legacy", e);
+
+        e = Validate(
+            readings, [&](size_t last, int64_t t) { return Feedback_pos(readings[last], t); }, [](size_t) {});
+        Print_row("feedback", e);
+
+        // the estimator is fed first, its samples are then what the
+        // predictions start from
+        Motion_estimator estimator(opt.smoothing);
+        vector<Motion_sample> samples(readings.size());
+        e = Validate(
+            readings, [&](size_t last, int64_t t) { return Estimator_pos(samples[last], t); },
+            [&](size_t i) { estimator.Update(readings[i].timestamp, readings[i].encoder, samples[i]); });
+        Print_row("estimator", e);
+
+        return 0;
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [-d decimation] [-s smoothing] recording.csv\n", name);
+        fprintf(stderr, "\t%s -p port [-b baud] [-i id] [-n count] [-v dps] > recording.csv\n\n", name);
+        fprintf(stderr, "\t-d n        predictors see one in every n readings (default 4)\n");
+        fprintf(stderr, "\t-s theta    smoothing of the motion estimator (default %.1f)\n", double(default_motion_smoothing));
+        fprintf(stderr, "\t-p port     record from a motor instead\n");
+        fprintf(stderr, "\t-b baud     baud rate (default %d)\n", default_baud);
+        fprintf(stderr, "\t-i id       motor ID (default %d)\n", Motor_ID);
+        fprintf(stderr, "\t-n count    readings to record (default 5000)\n");
+        fprintf(stderr, "\t-v dps      spin at this velocity while recording, stops after\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "d:s:p:b:i:n:v:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            opt.decimation = atoi(optarg);
+            break;
+        case 's':
+            opt.smoothing = float(atof(optarg));
+            break;
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'b':
+            opt.baud = atoi(optarg);
+            break;
+        case 'i':
+            opt.id = uint8_t(atoi(optarg));
+            break;
+        case 'n':
+            opt.count = atoi(optarg);
+            break;
+        case 'v':
+            opt.velocity = float(atof(optarg));
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.decimation < 2 || opt.count < 1 || opt.id == 0 || opt.id > max_motor_id)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    int ret;
+    if (opt.port)
+    {
+        ret = Record();
+    }
+    else if (optind < argc)
+    {
+        ret = Run(argv[optind]);
+    }
+    else
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+#if MOTOR_USE_PIGPIO
+    gpioTerminate();
+#endif
+
+    return ret;
+}
@@ -0,0 +1,322 @@
+/**
+ * @file serial_latency_bench.cpp
+ * @brief measure the round trip latency and the sustainable rate of every
+ * command in motor.cpp, over a sweep of baud rates and serial backends
+ *
+ * @note every command is sent back to back through the blocking functions
+ * of motor.hpp, so what is measured is what the control loop would pay:
+ * encoding, writing, the wire time of both frames, the processing time of
+ * the driver and reading the reply back.
+ * @note results are printed as CSV, one row per backend, baud rate and
+ * command, so they could be collected for trending.
+ * @note all commands keep the motor where it is: power, torque and velocity
+ * are set to 0 and positions to the current multi-turn angle. PID parameters
+ * are written back unchanged and only to RAM, writing ROM wears the flash.
+ */
+#include "motor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if MOTOR_USE_PIGPIO
+#include <pigpio.h>
+#endif
+
+using std::vector;
+using namespace Motor;
+
+namespace
+{
+    struct Options
+    {
+        // path to the serial port
+        const char *port = default_port;
+        // motor ID
+        uint8_t id = Motor_ID;
+        // transactions per command
+        int iterations = 1000;
+        // include commands of MF and MG series only
+        bool mf_commands = false;
+        // baud rates to sweep
+        vector<int> bauds = {default_baud};
+        // serial backends to sweep
+        vector<Transport_type> transports = {default_transport};
+    } opt;
+
+    // values read from the motor before every sweep, so that the writes do
+    // not change anything
+    Pid_params pid;
+    int64_t angle = 0;
+
+    // the last output of the read commands, kept out of reach of the optimizer
+    Error_state error_state;
+    Phase_currents phase_currents;
+    uint32_t single_turn_angle = 0;
+
+    struct Command_entry
+    {
+        const char *name;
+        Command_ID cmd;
+        // MF and MG series only
+        bool mf_only;
+        Transaction_result (*func)(const uint8_t id);
+    };
+
+    // in the order they are sent, stop and clear loops come last so that the
+    // motor is never holding a position whose turn count was just cleared
+    const Command_entry commands[] = {
+        {"read_pid", CMD_READ_PID, false, [](const uint8_t id) { return Read_pid(pid, id); }},
+        {"read_multi_turn_angle", CMD_READ_MULTI_TURN_ANGLE, false, [](const uint8_t id) { return Read_multi_turn_angle(angle, id); }},
+        {"read_single_turn_angle", CMD_READ_SINGLE_TURN_ANGLE, false, [](const uint8_t id) { return Read_single_turn_angle(single_turn_angle, id); }},
+        {"read_error_state", CMD_READ_ERROR_STATE, false, [](const uint8_t id) { return Read_error_state(error_state, id); }},
+        {"clear_errors", CMD_CLEAR_ERRORS, false, [](const uint8_t id) { return Clear_errors(error_state, id); }},
+        {"read_motor_state", CMD_READ_MOTOR_STATE, false, [](const uint8_t id) { return Read_motor_state(id); }},
+        {"read_phase_currents", CMD_READ_PHASE_CURRENTS, true, [](const uint8_t id) { return Read_phase_currents(phase_currents, id); }},
+        {"write_pid_ram", CMD_WRITE_PID_RAM, false, [](const uint8_t id) { return Write_pid_ram(pid, id); }},
+        {"power", CMD_POWER, false, [](const uint8_t id) { return Set_power(0, id); }},
+        {"torque", CMD_TORQUE, true, [](const uint8_t id) { return Set_torque(0, id); }},
+        {"velocity", CMD_VELOCITY, false, [](const uint8_t id) { return Set_velocity(0, id); }},
+        {"multi_loop_position_1", CMD_MULTI_LOOP_POSITION_1, false, [](const uint8_t id) { return Set_multi_loop_position_1(angle, id); }},
+        {"multi_loop_position_2", CMD_MULTI_LOOP_POSITION_2, false, [](const uint8_t id) { return Set_multi_loop_position_2(angle, 3600, id); }},
+        {"pause", CMD_PAUSE, false, [](const uint8_t id) { return Pause(id); }},
+        {"resume", CMD_RESUME, false, [](const uint8_t id) { return Resume(id); }},
+        {"stop", CMD_STOP, false, [](const uint8_t id) { return Stop(id); }},
+        {"clear_loops", CMD_CLEAR_LOOPS, false, [](const uint8_t id) { return Clear_loops(id); }}};
+
+    const char *Transport_name(const Transport_type type)
+    {
+        return (type == TRANSPORT_PIGPIO) ? "pigpio" : "termios";
+    }
+
+    /**
+     * @brief value below which a fraction q of the sorted samples are
+     */
+    double Percentile(const vector<double> &sorted, const double q)
+    {
+        if (sorted.empty())
+        {
+            return 0.0;
+        }
+        size_t i = size_t(std::ceil(q * sorted.size()));
+        return sorted[(i > 0) ? (i - 1) : 0];
+    }
+
+    /**
+     * @brief send one command back to back and print a CSV row
+     *
+     * @param type serial backend in use
+     * @param baud baud rate in use
+     * @param entry the command
+     * @param latency buffer for the samples, reused between commands
+     */
+    void Run(const Transport_type type, const int baud, const Command_entry &entry, vector<double> &latency)
+    {
+        int results[TRANSACTION_PENDING + 1] = {};
+        latency.clear();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            Transaction_result r = entry.func(opt.id);
+            auto t1 = std::chrono::steady_clock::now();
+
+            results[r]++;
+            if (r == TRANSACTION_OK)
+            {
+                latency.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+            }
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double mean = 0.0;
+        for (double l : latency)
+        {
+            mean += l;
+        }
+        mean = latency.empty() ? 0.0 : (mean / latency.size());
+        std::sort(latency.begin(), latency.end());
+
+        // both frames on the wire, 10 bits per byte
+        double wire_us = 10.0e6 * (Frame_length(Command_info(entry.cmd).request_len) + Reply_length(entry.cmd)) / baud;
+
+        printf("%s,%d,%s,0x%02X,%d,%d,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               Transport_name(type), baud, entry.name, unsigned(entry.cmd), opt.iterations,
+               results[TRANSACTION_OK], results[TRANSACTION_TIMEOUT], results[TRANSACTION_CORRUPTED], results[TRANSACTION_WRITE_FAILED],
+               wire_us, mean, Percentile(latency, 0.5), Percentile(latency, 0.99), latency.empty() ? 0.0 : latency.back(),
+               results[TRANSACTION_OK] / elapsed);
+        fflush(stdout);
+    }
+
+    /**
+     * @brief parse a comma separated list of baud rates
+     */
+    bool Parse_bauds(const char *arg)
+    {
+        opt.bauds.clear();
+        std::string s(arg);
+        size_t pos = 0;
+        while (pos <= s.size())
+        {
+            size_t end = s.find(',', pos);
+            if (end == std::string::npos)
+            {
+                end = s.size();
+            }
+            int b = atoi(s.substr(pos, end - pos).c_str());
+            if (b <= 0)
+            {
+                return false;
+            }
+            opt.bauds.push_back(b);
+            pos = end + 1;
+        }
+        return !opt.bauds.empty();
+    }
+
+    /**
+     * @brief parse a comma separated list of backends
+     */
+    bool Parse_transports(const char *arg)
+    {
+        opt.transports.clear();
+        std::string s(arg);
+        size_t pos = 0;
+        while (pos <= s.size())
+        {
+            size_t end = s.find(',', pos);
+            if (end == std::string::npos)
+            {
+                end = s.size();
+            }
+            std::string name = s.substr(pos, end - pos);
+            if (name == "termios")
+            {
+                opt.transports.push_back(TRANSPORT_TERMIOS);
+            }
+#if MOTOR_USE_PIGPIO
+            else if (name == "pigpio")
+            {
+                opt.transports.push_back(TRANSPORT_PIGPIO);
+            }
+#endif
+            else
+            {
+                return false;
+            }
+            pos = end + 1;
+        }
+        return !opt.transports.empty();
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [options]\n\n", name);
+        fprintf(stderr, "\t-p port     serial port (default %s)\n", default_port);
+        fprintf(stderr, "\t-i id       motor ID (default %d)\n", Motor_ID);
+        fprintf(stderr, "\t-n count    transactions per command (default 1000)\n");
+        fprintf(stderr, "\t-b list     baud rates, e.g. 115200,1000000 (default %d)\n", default_baud);
+#if MOTOR_USE_PIGPIO
+        fprintf(stderr, "\t-t list     backends, termios and/or pigpio (default pigpio)\n");
+#else
+        fprintf(stderr, "\t-t list     backends, only termios in this build\n");
+#endif
+        fprintf(stderr, "\t-m          also run the MF and MG series only commands\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "p:i:n:b:t:mh")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'i':
+            opt.id = uint8_t(atoi(optarg));
+            break;
+        case 'n':
+            opt.iterations = atoi(optarg);
+            break;
+        case 'b':
+            if (!Parse_bauds(optarg))
+            {
+                Print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            if (!Parse_transports(optarg))
+            {
+                Print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            opt.mf_commands = true;
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.iterations < 1 || opt.id == 0 || opt.id > max_motor_id)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    vector<double> latency;
+    latency.reserve(size_t(opt.iterations));
+
+    printf("transport,baud,command,cmd,iterations,ok,timeouts,corrupted,write_failed,wire_us,mean_us,p50_us,p99_us,max_us,rate_hz\n");
+
+    for (Transport_type type : opt.transports)
+    {
+        for (int baud : opt.bauds)
+        {
+            if (Serial_open(type, opt.port, baud) != 0)
+            {
+                fprintf(stderr, "Could not open %s at %d with %s, skipped.\n", opt.port, baud, Transport_name(type));
+                continue;
+            }
+
+            // the motor only talks at the baud rate it is configured to, so
+            // do not expect replies at the others
+            if (Read_pid(pid, opt.id) != TRANSACTION_OK || Read_multi_turn_angle(angle, opt.id) != TRANSACTION_OK)
+            {
+                fprintf(stderr, "No reply from motor %d at %d with %s, skipped.\n", opt.id, baud, Transport_name(type));
+                Serial_close();
+                continue;
+            }
+
+            for (const Command_entry &entry : commands)
+            {
+                if (entry.mf_only && !opt.mf_commands)
+                {
+                    continue;
+                }
+                Run(type, baud, entry, latency);
+            }
+
+            Serial_close();
+        }
+    }
+
+#if MOTOR_USE_PIGPIO
+    gpioTerminate();
+#endif
+
+    return 0;
+}
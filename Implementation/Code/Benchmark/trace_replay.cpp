@@ -0,0 +1,376 @@
+/**
+ * @file trace_replay.cpp
+ * @brief decode or replay a trace of the motor serial link
+ *
+ * @note the trace is recorded by Trace_open() in frame_trace.hpp, see the
+ * mains of AllTest and ControllerTest.
+ * @note decoding runs the recorded bytes through Frame_parser and
+ * Decode_feedback() as the serial functions would, with no serial port in
+ * the way, so it doubles as a throughput benchmark of the frame codec on
+ * real traffic. the outcome of every transaction is taken from the trace:
+ * answered if its reply is parsed before the next frame is written.
+ * @note replaying writes every recorded frame to a port again through
+ * Serial_transaction(), against MotorSim or a motor, and compares the
+ * outcome with the recorded one.
+ */
+#include "frame_trace.hpp"
+#include "motor.hpp"
+#include "motor_frame.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#if MOTOR_USE_PIGPIO
+#include <pigpio.h>
+#endif
+
+using std::vector;
+using namespace Motor;
+
+namespace
+{
+    struct Options
+    {
+        // replay to this serial port instead of decoding
+        const char *port = nullptr;
+        // 0 for the baud rate in the trace
+        int baud = 0;
+        // decoding passes over the trace, for timing
+        int repeat = 100;
+        // replay with the recorded gaps instead of back to back
+        bool timed = false;
+        // print the records instead
+        bool dump = false;
+    } opt;
+
+    struct Outcome
+    {
+        uint64_t transactions = 0;
+        uint64_t replies = 0;
+        uint64_t feedback = 0;
+        uint64_t checksum_failures = 0;
+        uint64_t resyncs = 0;
+        uint64_t unexpected_frames = 0;
+        // from writing a frame to its reply in us
+        vector<double> latency;
+
+        // decoding only
+        uint64_t bytes = 0;
+        double ns_per_frame = 0.0;
+        double mb_per_s = 0.0;
+    };
+
+    const char *Type_name(const uint8_t type)
+    {
+        switch (type)
+        {
+        case TRACE_TX:
+            return "tx";
+        case TRACE_RX:
+            return "rx";
+        case TRACE_TIMEOUT:
+            return "timeout";
+        default:
+            return "?";
+        }
+    }
+
+    /**
+     * @brief true if a TX record holds a frame a reply could be expected for
+     */
+    bool Is_request(const Trace_record &r)
+    {
+        return r.type == TRACE_TX && r.len >= header_len && r.data[0] == frame_head;
+    }
+
+    /**
+     * @brief value below which a fraction q of the sorted samples are
+     */
+    double Percentile(const vector<double> &sorted, const double q)
+    {
+        if (sorted.empty())
+        {
+            return 0.0;
+        }
+        size_t i = size_t(std::ceil(q * sorted.size()));
+        return sorted[(i > 0) ? (i - 1) : 0];
+    }
+
+    void Print_row(const char *source, Outcome &o)
+    {
+        vector<double> &v = o.latency;
+        std::sort(v.begin(), v.end());
+        double mean = 0.0;
+        for (double x : v)
+        {
+            mean += x;
+        }
+        mean = v.empty() ? 0.0 : (mean / v.size());
+
+        printf("%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%llu,%.1f,%.2f\n", source,
+               (unsigned long long)o.transactions, (unsigned long long)o.replies, (unsigned long long)(o.transactions - o.replies),
+               (unsigned long long)o.feedback, (unsigned long long)o.checksum_failures, (unsigned long long)o.resyncs,
+               (unsigned long long)o.unexpected_frames, mean, Percentile(v, 0.99), v.empty() ? 0.0 : v.back(),
+               (unsigned long long)o.bytes, o.ns_per_frame, o.mb_per_s);
+    }
+
+    void Dump(const Trace_header &header, const vector<Trace_record> &records)
+    {
+        printf("# version %u, %d baud, %zu records\n", unsigned(header.version), header.baud, records.size());
+        for (const Trace_record &r : records)
+        {
+            printf("%10lld %-7s", (long long)(r.timestamp - header.start), Type_name(r.type));
+            for (size_t i = 0; i < r.len; i++)
+            {
+                printf(" %02X", r.data[i]);
+            }
+            printf("\n");
+        }
+    }
+
+    /**
+     * @brief run the trace through the parser once
+     *
+     * @param records the trace
+     * @param o output counters, latency only if record_latency
+     * @return uint64_t sum of the decoded encoder readings, so that the
+     * decoding could not be optimized away
+     */
+    uint64_t Decode(const vector<Trace_record> &records, Outcome &o, const bool record_latency)
+    {
+        Frame_parser parser;
+        parser.Expect_any();
+        bool waiting = false;
+        int64_t sent = 0;
+        uint64_t sum = 0;
+
+        for (const Trace_record &r : records)
+        {
+            if (r.type == TRACE_TX)
+            {
+                o.bytes += r.len;
+                if (!Is_request(r))
+                {
+                    continue;
+                }
+                o.transactions++;
+                size_t reply_len = Reply_length(r.data[1]);
+                if (reply_len > 0)
+                {
+                    parser.Expect(r.data[1], r.data[2], reply_len);
+                    waiting = true;
+                }
+                else
+                {
+                    parser.Expect_any();
+                    waiting = false;
+                }
+                sent = r.timestamp;
+            }
+            else if (r.type == TRACE_RX)
+            {
+                o.bytes += r.len;
+                size_t pos = 0;
+                size_t used;
+                while (pos < r.len)
+                {
+                    Parse_result result = parser.Push(r.data + pos, r.len - pos, used);
+                    pos += used;
+                    if (result != PARSE_OK || !waiting)
+                    {
+                        continue;
+                    }
+
+                    // anything after the reply is stale until the next frame
+                    waiting = false;
+                    o.replies++;
+                    if (record_latency)
+                    {
+                        o.latency.push_back(double(r.timestamp - sent));
+                    }
+
+                    Feedback fb;
+                    if (parser.Length() == feedback_len && Decode_feedback(parser.Data(), fb))
+                    {
+                        o.feedback++;
+                        sum += fb.encoder;
+                    }
+                    parser.Expect_any();
+                }
+            }
+        }
+
+        o.checksum_failures = parser.checksum_failures;
+        o.resyncs = parser.resyncs;
+        o.unexpected_frames = parser.unexpected_frames;
+        return sum;
+    }
+
+    int Run_decode(const vector<Trace_record> &records)
+    {
+        Outcome o;
+        uint64_t sum = Decode(records, o, true);
+
+        // time the decoding alone over the repeats
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < opt.repeat; i++)
+        {
+            Outcome scratch;
+            sum += Decode(records, scratch, false);
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+        uint64_t frames = (o.transactions + o.replies) * uint64_t(opt.repeat);
+        o.ns_per_frame = frames ? (elapsed / frames) : 0.0;
+        o.mb_per_s = (elapsed > 0.0) ? (double(o.bytes) * opt.repeat * 1.0e3 / elapsed) : 0.0;
+
+        Print_row("trace", o);
+        fprintf(stderr, "checksum of decoded encoders: %llu\n", (unsigned long long)sum);
+        return 0;
+    }
+
+    int Run_replay(const Trace_header &header, const vector<Trace_record> &records)
+    {
+        Outcome recorded;
+        Decode(records, recorded, true);
+
+        int baud = opt.baud ? opt.baud : header.baud;
+        if (Serial_open(default_transport, opt.port, baud) != 0)
+        {
+            fprintf(stderr, "Could not open %s.\n", opt.port);
+            return 1;
+        }
+
+        Outcome o;
+        uint8_t reply[max_frame_len];
+        int64_t first = -1;
+        int64_t start = Get_time();
+
+        for (const Trace_record &r : records)
+        {
+            if (!Is_request(r))
+            {
+                continue;
+            }
+
+            if (opt.timed)
+            {
+                first = (first < 0) ? r.timestamp : first;
+                int64_t due = start + (r.timestamp - first);
+                int64_t now = Get_time();
+                if (due > now)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+                }
+            }
+
+            o.transactions++;
+            size_t reply_len = Reply_length(r.data[1]);
+            int64_t t0 = Get_time();
+            if (reply_len == 0)
+            {
+                Serial_send(r.data, r.len, 0);
+                continue;
+            }
+            if (Serial_transaction(r.data, r.len, reply, reply_len) == TRANSACTION_OK)
+            {
+                o.replies++;
+                o.latency.push_back(double(Get_time() - t0));
+                Feedback fb;
+                if (reply_len == feedback_len && Decode_feedback(reply, fb))
+                {
+                    o.feedback++;
+                }
+            }
+        }
+
+        Link_stats stats = Get_link_stats();
+        o.checksum_failures = stats.checksum_failures;
+        o.resyncs = stats.resyncs;
+        o.unexpected_frames = stats.unexpected_frames;
+        Serial_close();
+
+        Print_row("trace", recorded);
+        Print_row("replay", o);
+        return 0;
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [-n repeat] [-v] trace.bin\n", name);
+        fprintf(stderr, "\t%s -p port [-b baud] [-r] trace.bin\n\n", name);
+        fprintf(stderr, "\t-n repeat   decoding passes to time (default 100)\n");
+        fprintf(stderr, "\t-v          print the records instead\n");
+        fprintf(stderr, "\t-p port     replay the frames to a serial port instead\n");
+        fprintf(stderr, "\t-b baud     baud rate (default the one in the trace)\n");
+        fprintf(stderr, "\t-r          keep the recorded gaps between frames\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:vp:b:rh")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            opt.repeat = atoi(optarg);
+            break;
+        case 'v':
+            opt.dump = true;
+            break;
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'b':
+            opt.baud = atoi(optarg);
+            break;
+        case 'r':
+            opt.timed = true;
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.repeat < 1 || optind >= argc)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    Trace_header header;
+    vector<Trace_record> records;
+    if (!Load_trace(argv[optind], header, records))
+    {
+        fprintf(stderr, "Could not load %s.\n", argv[optind]);
+        return 1;
+    }
+
+    int ret;
+    if (opt.dump)
+    {
+        Dump(header, records);
+        ret = 0;
+    }
+    else
+    {
+        printf("source,transactions,replies,missing,feedback,checksum_failures,resyncs,unexpected_frames,mean_us,p99_us,max_us,bytes,ns_per_frame,mb_per_s\n");
+        ret = opt.port ? Run_replay(header, records) : Run_decode(records);
+    }
+
+#if MOTOR_USE_PIGPIO
+    gpioTerminate();
+#endif
+
+    return ret;
+}
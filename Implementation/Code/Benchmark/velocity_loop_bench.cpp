@@ -0,0 +1,296 @@
+/**
+ * @file velocity_loop_bench.cpp
+ * @brief compare the velocity loop of the motor with the one on the host
+ *
+ * @note the same square wave of target velocity is tracked twice: once by
+ * the motor on velocity control (20), once by Velocity_loop on power (18)
+ * or torque (19). the error is taken against the estimated velocity of the
+ * bus, so it is what the controller would see.
+ * @note the deadline counters of Velocity_loop are printed too, run it at a
+ * rate the baud rate could not keep up with to see it fall back.
+ */
+#include "motor.hpp"
+#include "motor_bus.hpp"
+#include "velocity_loop.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#if MOTOR_USE_PIGPIO
+#include <pigpio.h>
+#endif
+
+using std::vector;
+using namespace Motor;
+
+namespace
+{
+    struct Options
+    {
+        const char *port = default_port;
+        int baud = default_baud;
+        uint8_t id = Motor_ID;
+        // seconds per run, the target flips every second
+        float seconds = 4.0F;
+        // amplitude of the target in dps
+        float amplitude = 300.0F;
+        Loop_config loop;
+    } opt;
+
+    struct Tracking
+    {
+        // root mean square of target - estimated velocity in dps
+        double rms_error = 0.0;
+        // mean time to get 90% of the way after a flip in ms, -1 if never
+        double rise_ms = -1.0;
+        // estimated motion samples per second
+        double feedback_hz = 0.0;
+    };
+
+    /**
+     * @brief target at a time since the start of a run, flips every second
+     */
+    float Target(const int64_t t)
+    {
+        return ((t / 1000000) % 2 == 0) ? opt.amplitude : -opt.amplitude;
+    }
+
+    /**
+     * @brief track the square wave and measure how well
+     *
+     * @param host true to track with loop, false with the motor
+     */
+    Tracking Track(const bool host, Velocity_loop &loop)
+    {
+        Motor_handle motor(opt.id);
+        Tracking result;
+        Motion_sample samples[motion_history_len];
+        uint64_t since = Get_motion(opt.id).sequence;
+
+        int64_t start = Get_time();
+        int64_t duration = int64_t(opt.seconds * 1.0e6F);
+        double square_sum = 0.0;
+        size_t count = 0;
+
+        // when the last flip happened and from what, for the rise time
+        int64_t flip_time = 0;
+        float from = 0.0F;
+        bool risen = true;
+        double rise_sum = 0.0;
+        int rises = 0;
+        float last_target = 0.0F;
+
+        while (true)
+        {
+            int64_t now = Get_time();
+            if (now - start >= duration)
+            {
+                break;
+            }
+
+            float target = Target(now - start);
+            if (target != last_target)
+            {
+                flip_time = now;
+                from = last_target;
+                risen = false;
+                last_target = target;
+            }
+
+            if (host)
+            {
+                loop.Set_velocity(target);
+            }
+            else
+            {
+                motor.Set_velocity(int32_t(std::lround(target * 100.0F)));
+            }
+
+            size_t n = Get_motion_history(opt.id, since, samples, motion_history_len);
+            for (size_t i = 0; i < n; i++)
+            {
+                const Motion_sample &s = samples[i];
+                since = s.sequence;
+                if (s.timestamp < start)
+                {
+                    continue;
+                }
+
+                float t = Target(s.timestamp - start);
+                square_sum += double(t - s.velocity) * double(t - s.velocity);
+                count++;
+
+                // the first flip from rest is not a full step
+                if (!risen && s.timestamp >= flip_time && (s.velocity - from) / (last_target - from) >= 0.9F)
+                {
+                    risen = true;
+                    if (from != 0.0F)
+                    {
+                        rise_sum += double(s.timestamp - flip_time) * 1.0e-3;
+                        rises++;
+                    }
+                }
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        result.rms_error = count ? std::sqrt(square_sum / count) : 0.0;
+        result.rise_ms = rises ? (rise_sum / rises) : -1.0;
+        result.feedback_hz = double(count) / opt.seconds;
+        return result;
+    }
+
+    /**
+     * @brief bring the motor to rest on its own loop between runs
+     */
+    void Settle()
+    {
+        Motor_handle(opt.id).Set_velocity(0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    const char *Mode_name(const Loop_mode mode)
+    {
+        switch (mode)
+        {
+        case LOOP_HOST:
+            return "host";
+        case LOOP_FALLBACK:
+            return "fallback";
+        default:
+            return "stopped";
+        }
+    }
+
+    void Print_usage(const char *name)
+    {
+        fprintf(stderr, "Usage:\n\n\t%s [options]\n\n", name);
+        fprintf(stderr, "\t-p port     serial port (default %s)\n", default_port);
+        fprintf(stderr, "\t-b baud     baud rate (default %d)\n", default_baud);
+        fprintf(stderr, "\t-i id       motor ID (default %d)\n", Motor_ID);
+        fprintf(stderr, "\t-s seconds  duration of every run (default 4)\n");
+        fprintf(stderr, "\t-a dps      amplitude of the square wave (default 300)\n");
+        fprintf(stderr, "\t-r rate     ticks per second of the host loop (default 1000)\n");
+        fprintf(stderr, "\t-k kp       proportional gain, output per dps (default 1)\n");
+        fprintf(stderr, "\t-I ki       integral gain, output per dps s (default 10)\n");
+        fprintf(stderr, "\t-f ff       feedforward, output per dps (default 0)\n");
+        fprintf(stderr, "\t-m max      output limit (default 500)\n");
+        fprintf(stderr, "\t-t          drive torque instead of power, MF and MG series only\n");
+        fprintf(stderr, "\t-P prio     SCHED_FIFO priority of the loop thread (default none)\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "p:b:i:s:a:r:k:I:f:m:tP:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'b':
+            opt.baud = atoi(optarg);
+            break;
+        case 'i':
+            opt.id = uint8_t(atoi(optarg));
+            break;
+        case 's':
+            opt.seconds = float(atof(optarg));
+            break;
+        case 'a':
+            opt.amplitude = float(atof(optarg));
+            break;
+        case 'r':
+            opt.loop.rate = float(atof(optarg));
+            break;
+        case 'k':
+            opt.loop.kp = float(atof(optarg));
+            break;
+        case 'I':
+            opt.loop.ki = float(atof(optarg));
+            break;
+        case 'f':
+            opt.loop.feedforward = float(atof(optarg));
+            break;
+        case 'm':
+            opt.loop.max_output = int16_t(atoi(optarg));
+            break;
+        case 't':
+            opt.loop.output = LOOP_TORQUE;
+            break;
+        case 'P':
+            opt.loop.priority = atoi(optarg);
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.seconds <= 0.0F || opt.id == 0 || opt.id > max_motor_id)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    if (Bus_open(default_transport, opt.port, opt.baud) != 0)
+    {
+        fprintf(stderr, "Could not open %s.\n", opt.port);
+        return 1;
+    }
+
+    Motor_handle motor(opt.id);
+    Velocity_loop loop(opt.id);
+
+    // the motor loop gets feedback at the same rate as the host loop
+    Bus_set_polling(true);
+    Bus_set_poll_rate(opt.loop.rate);
+    motor.Resume();
+    Settle();
+
+    printf("loop,rate_hz,baud,seconds,ticks,late,stale,rejected,fallbacks,final_mode,max_lateness_us,feedback_hz,rms_error_dps,rise_ms\n");
+
+    Tracking t = Track(false, loop);
+    printf("motor,%.0f,%d,%.1f,0,0,0,0,0,motor,0,%.1f,%.2f,%.1f\n",
+           double(opt.loop.rate), opt.baud, double(opt.seconds), t.feedback_hz, t.rms_error, t.rise_ms);
+    fflush(stdout);
+    Settle();
+
+    if (!loop.Start(opt.loop))
+    {
+        fprintf(stderr, "Could not start the host loop.\n");
+    }
+    else
+    {
+        t = Track(true, loop);
+        Loop_mode mode = loop.Mode();
+        loop.Stop();
+        Loop_stats stats = loop.Get_stats();
+
+        printf("host,%.0f,%d,%.1f,%llu,%llu,%llu,%llu,%llu,%s,%lld,%.1f,%.2f,%.1f\n",
+               double(opt.loop.rate), opt.baud, double(opt.seconds),
+               (unsigned long long)stats.ticks, (unsigned long long)stats.late, (unsigned long long)stats.stale,
+               (unsigned long long)stats.rejected, (unsigned long long)stats.fallbacks, Mode_name(mode),
+               (long long)stats.max_lateness, t.feedback_hz, t.rms_error, t.rise_ms);
+        fflush(stdout);
+        Settle();
+    }
+
+    motor.Pause();
+    Bus_close();
+
+#if MOTOR_USE_PIGPIO
+    gpioTerminate();
+#endif
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file frame_trace.cpp
+ * @brief record every frame on the motor serial link to a binary file
+ */
+#include "frame_trace.hpp"
+#include "bounded_queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+using std::vector;
+
+namespace Motor
+{
+    namespace
+    {
+        // stdio buffer of the trace file, the writer flushes in big chunks
+        constexpr size_t trace_file_buffer_len = 1 << 16;
+        // how long the writer sleeps when the queue is empty in ms
+        constexpr int trace_idle_ms = 2;
+
+        // serializes Trace_open() and Trace_close(), not Trace_frame()
+        std::mutex trace_mutex;
+        std::atomic<bool> tracing(false);
+        std::atomic<bool> writing(false);
+        std::thread writer;
+        FILE *trace_file = nullptr;
+        char file_buffer[trace_file_buffer_len];
+
+        Bounded_queue<Trace_record, trace_queue_len> queue;
+
+        std::atomic<uint64_t> recorded(0);
+        std::atomic<uint64_t> dropped(0);
+        std::atomic<uint64_t> bytes_written(0);
+
+        /**
+         * @brief write one record to the trace file
+         */
+        void Write_record(const Trace_record &record)
+        {
+            uint8_t head[trace_record_header_len];
+            Put_le<int64_t>(head, record.timestamp);
+            head[8] = record.type;
+            head[9] = record.len;
+
+            size_t n = fwrite(head, 1, trace_record_header_len, trace_file);
+            n += fwrite(record.data, 1, record.len, trace_file);
+            bytes_written.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief writer thread, drains the queue until the trace is closed
+         */
+        void Write_trace()
+        {
+            Trace_record record;
+            while (true)
+            {
+                // read the flag first, so nothing pushed before the close is left
+                bool last = !writing.load(std::memory_order_acquire);
+                bool any = false;
+                while (queue.Pop(record))
+                {
+                    Write_record(record);
+                    any = true;
+                }
+
+                if (last)
+                {
+                    break;
+                }
+                if (!any)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(trace_idle_ms));
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief start recording frames to a file
+     *
+     * @param path file to write, truncated if it exists
+     * @param baud baud rate of the link, stored in the header for replay
+     * @return 0 for OK and 1 for failed
+     *
+     * @note a trace already open is closed first.
+     */
+    int Trace_open(const char *path, const int baud)
+    {
+        Trace_close();
+
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        trace_file = fopen(path, "wb");
+        if (!trace_file)
+        {
+            return 1;
+        }
+        setvbuf(trace_file, file_buffer, _IOFBF, trace_file_buffer_len);
+
+        // frames pushed after the last close are not part of this trace
+        Trace_record record;
+        while (queue.Pop(record))
+        {
+        }
+        recorded = 0;
+        dropped = 0;
+        bytes_written = 0;
+
+        uint8_t head[trace_header_len];
+        memcpy(head, trace_magic, trace_magic_len);
+        Put_le<uint16_t>(head + trace_magic_len, trace_version);
+        Put_le<int32_t>(head + trace_magic_len + 2, int32_t(baud));
+        Put_le<int64_t>(head + trace_magic_len + 6, Get_time());
+        if (fwrite(head, 1, trace_header_len, trace_file) != trace_header_len)
+        {
+            fclose(trace_file);
+            trace_file = nullptr;
+            return 1;
+        }
+        bytes_written = trace_header_len;
+
+        writing.store(true, std::memory_order_release);
+        writer = std::thread(Write_trace);
+        tracing.store(true, std::memory_order_release);
+        return 0;
+    }
+
+    /**
+     * @brief stop recording, write out what is left and close the file
+     */
+    void Trace_close()
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        if (!trace_file)
+        {
+            return;
+        }
+
+        tracing.store(false, std::memory_order_release);
+        writing.store(false, std::memory_order_release);
+        writer.join();
+
+        fclose(trace_file);
+        trace_file = nullptr;
+    }
+
+    /**
+     * @brief record one frame, or part of one
+     *
+     * @param type direction of the frame
+     * @param data bytes of the frame, could be nullptr if len is 0
+     * @param len number of bytes, split into several records if longer than
+     * max_frame_len
+     *
+     * @note never blocks, safe to call from any thread. does nothing if no
+     * trace is open.
+     */
+    void Trace_frame(const Trace_type type, const uint8_t *data, const size_t len)
+    {
+        if (!tracing.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+
+        Trace_record record;
+        record.timestamp = Get_time();
+        record.type = uint8_t(type);
+
+        size_t pos = 0;
+        do
+        {
+            record.len = uint8_t(std::min(len - pos, max_frame_len));
+            if (record.len > 0)
+            {
+                memcpy(record.data, data + pos, record.len);
+            }
+            pos += record.len;
+
+            if (queue.Push(record))
+            {
+                recorded.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        } while (pos < len);
+    }
+
+    /**
+     * @brief counters of the trace open now, or of the last one
+     */
+    Trace_stats Get_trace_stats()
+    {
+        Trace_stats stats;
+        stats.recorded = recorded.load(std::memory_order_relaxed);
+        stats.dropped = dropped.load(std::memory_order_relaxed);
+        stats.bytes_written = bytes_written.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief read a whole trace file into memory
+     *
+     * @param path file to read
+     * @param header output header
+     * @param records output records, appended in file order
+     * @return true if the header is valid, a truncated last record is left out
+     */
+    bool Load_trace(const char *path, Trace_header &header, vector<Trace_record> &records)
+    {
+        FILE *file = fopen(path, "rb");
+        if (!file)
+        {
+            return false;
+        }
+
+        uint8_t head[trace_header_len];
+        if (fread(head, 1, trace_header_len, file) != trace_header_len || memcmp(head, trace_magic, trace_magic_len) != 0)
+        {
+            fclose(file);
+            return false;
+        }
+        header.version = Get_le<uint16_t>(head + trace_magic_len);
+        header.baud = int(Get_le<int32_t>(head + trace_magic_len + 2));
+        header.start = Get_le<int64_t>(head + trace_magic_len + 6);
+        if (header.version != trace_version)
+        {
+            fclose(file);
+            return false;
+        }
+
+        Trace_record record;
+        while (fread(head, 1, trace_record_header_len, file) == trace_record_header_len)
+        {
+            record.timestamp = Get_le<int64_t>(head);
+            record.type = head[8];
+            record.len = head[9];
+            if (record.len > max_frame_len || fread(record.data, 1, record.len, file) != record.len)
+            {
+                break;
+            }
+            records.push_back(record);
+        }
+
+        fclose(file);
+        return true;
+    }
+}
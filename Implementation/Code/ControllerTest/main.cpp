@@ -1,4 +1,8 @@
+#include "frame_trace.hpp"
 #include "motor.hpp"
+#include "motor_bus.hpp"
+#include "thermal_model.hpp"
+#include "velocity_loop.hpp"
 #include <cstring>
 #include <pigpio.h>
 #include <iostream>
@@ -20,6 +24,27 @@
 #define MIN_DRV_SPD 15000.0F
 #define MAX_DRV_SPD 24000.0F
 
+// the max driving speed is derated so that the motor is predicted to stay
+// under this temperature in degree C, see thermal_model.hpp
+#define MOTOR_TEMP_LIMIT 70.0F
+
+// reads of the motor state per second for the thermal model. driving at a
+// constant speed repeats the same setpoint, which the bus drops, so without
+// polling no feedback would come in
+#define THERMAL_POLL_RATE 2.0F
+
+// at most this many velocity commands per second, the main loop spins much
+// faster than the joystick updates
+#define MAX_CMD_RATE 100.0F
+
+// run the velocity loop on the Pi at 1kHz on power control instead of on the
+// motor, it falls back to the motor by itself when it misses its deadlines
+#define HOST_VELOCITY_LOOP 0
+
+// record every frame to and from the motor to this file, "" for none. replay
+// it with Benchmark/TraceReplay
+#define MOTOR_TRACE_FILE ""
+
 // if joystick is inverted in Y
 #define JOYSTICK_INVERTED 1
 
@@ -57,21 +82,48 @@ int main()
     printf("------ Init begins! ------\n");
 
     // init GPIO and lauch motor control
-    float v = Motor::Serial_open();
+    float v = Motor::Bus_open();
     if (v)
     {
         printf("Serial init failed!\n");
         return v;
     }
     printf("Serial init finished!\n");
+    Motor::Bus_set_polling(true);
+    Motor::Bus_set_poll_rate(THERMAL_POLL_RATE);
+
+    if (MOTOR_TRACE_FILE[0] != '\0' && Motor::Trace_open(MOTOR_TRACE_FILE) != 0)
+    {
+        printf("Could not open %s, the motor traffic is not recorded.\n", MOTOR_TRACE_FILE);
+    }
+
+    Motor::Motor_handle motor;
+#if HOST_VELOCITY_LOOP
+    // the rate limit would cap the loop too
+    Motor::Velocity_loop velocity_loop;
+#else
+    Motor::Bus_set_rate_limit(MAX_CMD_RATE);
+#endif
+
+    // when the link comes back, home and pause like at startup
+    Motor::Bus_set_reconnect_init([](const uint8_t id) {
+        return Motor::Home(0, 36000, Motor::home_timeout_us, id) != Motor::HOME_FAILED && Motor::Pause(id) == Motor::TRANSACTION_OK;
+    });
+    Motor::Link_state link_state = Motor::LINK_UP;
+
+    Motor::Thermal_config thermal_config;
+    thermal_config.limit = MOTOR_TEMP_LIMIT;
+    thermal_config.max_speed = MAX_DRV_SPD * 0.01F;
+    Motor::Thermal_estimator thermal(thermal_config);
+    bool derating = false;
 
     int64_t t_temp = 0, t_quit = 0, t_no_response = 0;
 
-    Motor::Resume();
-    Motor::Clear_loops();
-    Motor::Set_multi_loop_position_2(0, 36000);
-    Motor::Pause();
-    gpioDelay(2000000);
+    if (motor.Home() != Motor::HOME_OK)
+    {
+        printf("Motor did not settle at home!\n");
+    }
+    motor.Pause();
 
     printf("Motor Init finished!\n");
 
@@ -172,6 +224,47 @@ joystick_init_start:
         // }
         // printf("\n");
 
+        // the bus reconnects by itself, the motor comes back paused
+        Motor::Bus_health health = Motor::Get_bus_health();
+        if (health.state != link_state)
+        {
+            link_state = health.state;
+            if (link_state == Motor::LINK_LOST)
+            {
+                printf("Motor link lost! flags 0x%02X\n", unsigned(health.link.flags));
+                if (curr_state != Rollbot_state::disengaged)
+                {
+#if HOST_VELOCITY_LOOP
+                    velocity_loop.Stop();
+#endif
+                    curr_state = Rollbot_state::disengaged;
+                    printf("Motor disengaged!\n");
+                }
+            }
+            else
+            {
+                printf("Motor link back after %llu failed attempts!\n", (unsigned long long)health.failed_attempts);
+            }
+        }
+
+        // the feedback of every command goes into the thermal model
+        thermal.Update(motor.Get_state());
+        float max_drv_spd = MAX_DRV_SPD * thermal.Derate();
+        float min_drv_spd = fminf(MIN_DRV_SPD, max_drv_spd);
+        if (derating != (thermal.Derate() < 0.99F))
+        {
+            derating = !derating;
+            const Motor::Thermal_estimate &est = thermal.Get();
+            if (derating)
+            {
+                printf("Motor at %.0fC, predicted %.0fC, derating the max speed!\n", double(est.temperature), double(est.predicted));
+            }
+            else
+            {
+                printf("Motor at %.0fC, back to full speed!\n", double(est.temperature));
+            }
+        }
+
         switch (curr_state)
         {
         case Rollbot_state::disengaged: // motor power off, safe
@@ -186,9 +279,10 @@ joystick_init_start:
                 {
                     curr_state = Rollbot_state::engaged;
 
-                    Motor::Resume();
-                    Motor::Clear_loops();
-                    Motor::Set_multi_loop_position_2(0, 36000);
+                    if (motor.Home() != Motor::HOME_OK)
+                    {
+                        printf("Motor did not settle at home!\n");
+                    }
 
                     printf("Motor engaged!\n");
                 }
@@ -205,13 +299,20 @@ joystick_init_start:
             {
                 curr_state = Rollbot_state::running;
 
+#if HOST_VELOCITY_LOOP
+                if (!velocity_loop.Start())
+                {
+                    printf("Host velocity loop failed to start!\n");
+                }
+#endif
+
                 printf("Motor running!\n");
             }
             // switch back to disengaged mode when RB and LB are pressed.
             else if (button[6] && button[7])
             {
                 curr_state = disengaged;
-                Motor::Pause();
+                motor.Pause();
 
                 printf("Motor disengaged!\n");
             }
@@ -222,13 +323,33 @@ joystick_init_start:
             if (button[6] && button[7])
             {
                 curr_state = Rollbot_state::disengaged;
-                Motor::Pause();
+#if HOST_VELOCITY_LOOP
+                // or it would start the motor again
+                velocity_loop.Stop();
+#endif
+                motor.Pause();
 
                 printf("Motor disengaged!\n");
                 break;
             }
 
-            Motor::Set_velocity(int32_t((MAX_DRV_SPD + MIN_DRV_SPD) / 2 + float(axis[int(curr_ctrl)] * ((int(curr_ctrl) <= 3) ? JOYSTICK_SIGN : 1)) / 32767.0F * (MAX_DRV_SPD - MIN_DRV_SPD) / 2));
+#if HOST_VELOCITY_LOOP
+            velocity_loop.Set_velocity(((max_drv_spd + min_drv_spd) / 2 + float(axis[int(curr_ctrl)] * ((int(curr_ctrl) <= 3) ? JOYSTICK_SIGN : 1)) / 32767.0F * (max_drv_spd - min_drv_spd) / 2) * 0.01F);
+            {
+                // the loop stays on the motor until the next run
+                static Motor::Loop_mode loop_mode = Motor::LOOP_HOST;
+                if (velocity_loop.Mode() != loop_mode)
+                {
+                    loop_mode = velocity_loop.Mode();
+                    if (loop_mode == Motor::LOOP_FALLBACK)
+                    {
+                        printf("Host velocity loop missed its deadlines, fell back to the motor!\n");
+                    }
+                }
+            }
+#else
+            motor.Set_velocity(int32_t((max_drv_spd + min_drv_spd) / 2 + float(axis[int(curr_ctrl)] * ((int(curr_ctrl) <= 3) ? JOYSTICK_SIGN : 1)) / 32767.0F * (max_drv_spd - min_drv_spd) / 2));
+#endif
             // Motor::Set_multi_loop_position_2(float(axis[int(curr_ctrl)]*((int(curr_ctrl)<=3)?JOYSTICK_SIGN:1))/32767.0F*180.0F,36000);
             // printf("Set angle to %.1f deg\n",float(axis[int(curr_ctrl)]*((int(curr_ctrl)<=3)?JOYSTICK_SIGN:1))/32767.0F*180.0F);
             break;
@@ -288,8 +409,14 @@ joystick_init_start:
     }
 
     close(joy_fd);
-    Motor::Pause();
-    Motor::Serial_close();
+#if HOST_VELOCITY_LOOP
+    velocity_loop.Stop();
+#endif
+    motor.Pause();
+    Motor::Bus_stats stats = motor.Get_stats();
+    Motor::Bus_close();
+    Motor::Trace_close();
+    printf("Motor commands: %llu sent, %llu suppressed, %llu failed\n", (unsigned long long)stats.completed, (unsigned long long)stats.suppressed, (unsigned long long)stats.failed);
     printf("------ Program stopped ------\n");
 
     return 0;
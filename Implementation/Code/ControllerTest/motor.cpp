@@ -2,20 +2,41 @@
  * @file motor.cpp
  * @brief for controlling the Km-tech motors through serial
  *
- * @warning this is NOT thread-safe!
+ * @note serial transactions are serialized by a mutex, so commands could be
+ * sent from several threads. the state of every motor is published through a
+ * seqlock, Get_motor_state() never blocks and never returns a mix of two
+ * feedbacks. the last result globals (timestamp, encoder_position, etc.) are
+ * NOT protected, threads other than the one sending commands should read
+ * Get_motor_state() instead.
+ * @note in RESPONSE_DEFERRED mode the setters return once the command is
+ * written, the reply is collected before the next command or by
+ * Collect_responses(), see Set_response_mode().
  *
  * @note includes the following commands only:
+ * command 1~3: read/write PID parameters
+ * command 9~14: read angles, errors and phase currents, clear errors
  * command 15~17: turn off/stop/run motor
- * command 13&18~26: read/control motor position/velocity (same feedback)
+ * command 13&18~22: read/control motor power/torque/velocity/position (same feedback)
  */
 #define _USE_MATH_DEFINES
 #include "motor.hpp"
+#include "frame_trace.hpp"
+#include "motor_frame.hpp"
+#include "seqlock.hpp"
+#include "serial_transport.hpp"
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <mutex>
 
 #include <unistd.h>
+
+#if MOTOR_USE_PIGPIO
 #include <pigpio.h>
+#endif
 
 #define DEBUG_PRINT_ENABLED 0
 
@@ -30,12 +51,11 @@ using std::vector;
  */
 int64_t Get_time()
 {
-    int sec, mic;
-    gpioTime(PI_TIME_RELATIVE, &sec, &mic);
-    return sec * 1000000 + mic;
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
 
-// We only have one motor, so no need to worry about a lot of things.
 namespace Motor
 {
     /**
@@ -80,6 +100,20 @@ namespace Motor
         return int64_t(floor(float(encoder_pos) / float(encoder_resolution) * float(motor_position_resolution)));
     }
 
+    /**
+     * @brief torque current in feedback to amperes
+     *
+     * @param current torque current from -2048 to 2048
+     * @return float current in A, from -33A to 33A
+     *
+     * @note MS series motors (e.g. MS5010) report output power from -1000
+     * to 1000 in this field instead, do not convert it.
+     */
+    float Torque_current_to_A(const int16_t current)
+    {
+        return float(current) * 33.0F / 2048.0F;
+    }
+
     /**
      * @brief A function that maintains the continuity of position
      *
@@ -97,14 +131,47 @@ namespace Motor
 
     namespace
     {
-        // which serial port to use
-        char port[] = "/dev/ttyS0";
+        // serial backends, only one of them is in use
+        Termios_transport termios_transport;
+#if MOTOR_USE_PIGPIO
+        Pigpio_transport pigpio_transport;
+#endif
 
-        // a handle to serial interface
-        int SerialHandler;
-    }
+        // the serial interface in use, nullptr if not opened
+        Serial_transport *transport = nullptr;
 
-    constexpr uint8_t Motor_ID = 0x01;
+        // picks responses out of the serial byte stream
+        Frame_parser parser;
+
+        // link quality counters
+        Link_stats link_stats;
+
+        // written with serial_mutex held, read from anywhere
+        Seqlock<Link_health> link_health;
+
+        // held for the whole of a transaction and while opening or closing
+        std::mutex serial_mutex;
+
+        // latest state of every motor, indexed by ID
+        Seqlock<Motor_state> motor_states[max_motor_id + 1];
+
+        // how commands wait for their replies
+        Response_mode response_mode = RESPONSE_WAIT;
+
+        // baud rate of the open port, used to tell when a reply is due
+        int serial_baud = default_baud;
+
+        // the reply of the last Serial_send() that is still on its way
+        struct Pending_reply
+        {
+            bool active = false;
+            size_t response_len = 0;
+            // when the reply should be in if the driver answers at once
+            int64_t due = 0;
+            // when the reply is given up
+            int64_t deadline = 0;
+        } pending;
+    }
 
     // when was last result obtained
     int64_t timestamp = 0;
@@ -112,44 +179,234 @@ namespace Motor
     uint16_t encoder_position = 0;
     // motor speed in degree/s
     int16_t motor_velocity = 0;
+    // torque current of last result, see Torque_current_to_A()
+    int16_t motor_torque_current = 0;
+    // motor temperature of last result in degree C
+    int8_t motor_temperature = 0;
+
+    namespace
+    {
+        /**
+         * @brief record a transaction that got its reply
+         *
+         * @param now when the reply arrived in us
+         */
+        void Link_success(const int64_t now)
+        {
+            link_health.Update([&](Link_health &health) {
+                health.consecutive_failures = 0;
+                health.last_valid_frame = now;
+                health.flags = 0;
+            });
+        }
+
+        /**
+         * @brief record a transaction that failed
+         *
+         * @param flags Link_flag of why
+         */
+        void Link_failure(const uint8_t flags)
+        {
+            link_health.Update([&](Link_health &health) {
+                health.consecutive_failures++;
+                health.flags |= flags;
+            });
+        }
+
+        /**
+         * @brief record a valid frame nobody waited for, the motor is still
+         * there even if late
+         *
+         * @param now when the frame arrived in us
+         */
+        void Link_alive(const int64_t now)
+        {
+            link_health.Update([&](Link_health &health) {
+                health.last_valid_frame = now;
+            });
+        }
+
+        /**
+         * @brief Parse the regular 13 bytes response from the motor. It will
+         * update the state of the motor that sent it, and time stamp,
+         * encoder_position, motor_velocity, motor_torque_current and
+         * motor_temperature if it is the default motor.
+         *
+         * @note the multi-turn position is unwrapped by stitching the encoder
+         * to where the shaft should be at the average of the last and the new
+         * velocity. when the shaft could have turned half a turn or more
+         * since the last feedback, that guess could be a turn off, so the gap
+         * is counted in suspect_wraps.
+         *
+         * @param response response from the motor
+         * @param fb output decoded feedback
+         * @param now when the response arrived in us
+         * @return true if the response is a valid feedback frame
+         */
+        bool Parse_response(const uint8_t *response, Feedback &fb, const int64_t now)
+        {
+            if (!Decode_feedback(response, fb) || fb.id == 0 || fb.id > max_motor_id)
+            {
+                return false;
+            }
+
+            motor_states[fb.id].Update([&](Motor_state &state) {
+                int64_t pos = Encoder_to_Motor_position(fb.encoder);
+                if (state.timestamp == 0)
+                {
+                    state.position = pos;
+                }
+                else
+                {
+                    // dps * us = 1e-4 * 0.01deg
+                    int64_t dt = now - state.timestamp;
+                    int64_t travel = (int64_t(state.feedback.velocity) + fb.velocity) * dt / 20000;
+                    int64_t max_vel = std::max(std::abs(int64_t(state.feedback.velocity)), std::abs(int64_t(fb.velocity)));
+                    if (max_vel * dt / 10000 >= motor_position_resolution / 2)
+                    {
+                        state.suspect_wraps++;
+                    }
+                    state.position = Stitch_motor_position(state.position + travel, pos);
+                }
+                state.timestamp = now;
+                state.feedback = fb;
+            });
+
+            if (fb.id == Motor_ID)
+            {
+                timestamp = now;
+
+                encoder_position = fb.encoder;
+                motor_velocity = fb.velocity;
+                motor_torque_current = fb.torque_current;
+                motor_temperature = fb.temperature;
+            }
+
+#if DEBUG_PRINT_ENABLED
+            printf("Motor %d position : %d\nMotor %d velocity : %d\nMotor %d current : %d\nMotor %d temperature : %d\n\n", fb.id, fb.encoder, fb.id, fb.velocity, fb.id, fb.torque_current, fb.id, fb.temperature);
+#endif
+            return true;
+        }
+
+        /**
+         * @brief collect the pending reply of Serial_send(), or throw away
+         * replies that came after they were given up
+         *
+         * @param wait true to wait for the pending reply until its deadline
+         * @return int number of replies collected, 0 or 1
+         *
+         * @note serial_mutex should be held.
+         */
+        int Settle_pending(const bool wait)
+        {
+            uint8_t temp[max_frame_len];
+            size_t used;
+
+            if (!pending.active)
+            {
+                // nothing should be on the line, anything complete is stale
+                parser.Expect_any();
+                int nbytes;
+                while ((nbytes = transport->Read(temp, max_frame_len, 0)) > 0)
+                {
+                    Trace_frame(TRACE_RX, temp, size_t(nbytes));
+                    size_t pos = 0;
+                    while (pos < size_t(nbytes))
+                    {
+                        if (parser.Push(temp + pos, size_t(nbytes) - pos, used) == PARSE_OK)
+                        {
+                            link_stats.stale_replies++;
+                            Link_alive(Get_time());
+                        }
+                        pos += used;
+                    }
+                }
+                return 0;
+            }
+
+            // the parser is still expecting the pending reply
+            while (true)
+            {
+                int nbytes = transport->Read(temp, max_frame_len, wait ? pending.deadline : 0);
+                if (nbytes > 0)
+                {
+                    Trace_frame(TRACE_RX, temp, size_t(nbytes));
+                    if (parser.Push(temp, size_t(nbytes), used) == PARSE_OK)
+                    {
+                        pending.active = false;
+                        int64_t now = Get_time();
+                        Link_success(now);
+                        if (pending.response_len == feedback_len)
+                        {
+                            // the reply may have waited in the buffer for a
+                            // while, it could not be newer than when it is due
+                            Feedback fb;
+                            Parse_response(parser.Data(), fb, (now < pending.due) ? now : pending.due);
+                        }
+                        return 1;
+                    }
+                }
+                else
+                {
+                    if (nbytes < 0 || Get_time() >= pending.deadline)
+                    {
+                        pending.active = false;
+                        link_stats.missing_replies++;
+                        Trace_frame(TRACE_TIMEOUT, nullptr, 0);
+                        Link_failure((nbytes < 0) ? LINK_READ_FAILED : LINK_TIMEOUT);
+                    }
+                    return 0;
+                }
+            }
+        }
+    }
 
     /**
      * @brief open serial for motor
      *
+     * @param type which serial backend to use
+     * @param port path to the serial port
+     * @param baud baud rate
      * @return 0 for OK and 1 for failed
      *
-     * @note also executes gpioInitialise()
+     * @note the pigpio backend also executes gpioInitialise()
      * @note by default it opens "/dev/ttyS0" with baud rate of 115200
      */
-    int Serial_open()
+    int Serial_open(const Transport_type type, const char *port, const int baud)
     {
-        // init GPIO
-        if (gpioInitialise() < 0)
+        Serial_close();
+
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        parser = Frame_parser();
+        link_stats = Link_stats();
+        link_health.Write(Link_health());
+        pending = Pending_reply();
+        serial_baud = baud;
+
+        switch (type)
         {
-#if DEBUG_PRINT_ENABLED
-            printf("GPIO init failed!\n");
+#if MOTOR_USE_PIGPIO
+        case TRANSPORT_PIGPIO:
+            transport = &pigpio_transport;
+            break;
 #endif
+        case TRANSPORT_TERMIOS:
+            transport = &termios_transport;
+            break;
+        default:
+            Link_failure(LINK_CLOSED);
             return 1;
         }
 
-#if DEBUG_PRINT_ENABLED
-        printf("GPIO init successful!\n");
-#endif
-
-        // open serial
-        SerialHandler = serOpen(port, 115200, 0);
-        if (SerialHandler >= 0)
+        if (transport->Open(port, baud) != 0)
         {
-#if DEBUG_PRINT_ENABLED
-            printf("Serial ttyS0 opened at baud rate of 115200.\n");
-#endif
-            return 0;
+            transport = nullptr;
+            Link_failure(LINK_CLOSED);
+            return 1;
         }
 
-#if DEBUG_PRINT_ENABLED
-        printf("Serial ttyS0 open failed!\n");
-#endif
-        return 1;
+        return 0;
     }
 
     /**
@@ -157,62 +414,277 @@ namespace Motor
      */
     void Serial_close()
     {
-        serClose(SerialHandler);
-        gpioTerminate();
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        if (transport)
+        {
+            // let the last deferred command finish
+            if (pending.active)
+            {
+                Settle_pending(true);
+            }
+            transport->Close();
+#if MOTOR_USE_PIGPIO
+            if (transport == &pigpio_transport)
+            {
+                gpioTerminate();
+            }
+#endif
+            transport = nullptr;
+            link_health.Update([](Link_health &health) {
+                health.flags |= LINK_CLOSED;
+            });
+        }
     }
 
     /**
-     * @brief write and read back through serial
+     * @brief write and read back through serial without any allocation
      *
-     * @param input byte sequence to send
-     * @param response_len length of byte sequence, 0 means unknown
-     * @return received response byte sequence
+     * @param input byte sequence to send, should be a complete frame
+     * @param input_len length of input byte sequence
+     * @param output buffer for the response, should hold response_len bytes
+     * @param response_len length of response byte sequence
+     * @param timeout_us give up if response is not complete after this long
+     * @return Transaction_result TRANSACTION_OK if the expected response
+     * arrived with correct header, ID, length and checksums
      *
+     * @note the response is picked out of the byte stream by a resyncing
+     * parser, so garbage or stale frames before it will not break the link.
      * @note could be platform specific
      */
-    vector<char> Serial_transaction(const vector<char> input, const size_t response_len)
+    Transaction_result Serial_transaction(const uint8_t *input, const size_t input_len, uint8_t *output, const size_t response_len, const int64_t timeout_us)
     {
-        // clear input serial
-        while (serDataAvailable(SerialHandler))
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        if (!transport)
         {
-            serReadByte(SerialHandler);
+            Link_failure(LINK_CLOSED);
+            return TRANSACTION_WRITE_FAILED;
         }
 
-        char temp[30];
-        memcpy(temp, input.data(), input.size());
+        link_stats.transactions++;
+
+        // the reply of the last Serial_send() has to be in before writing
+        if (pending.active)
+        {
+            Settle_pending(true);
+        }
+
+        // clear input serial
+        transport->Flush_input();
 
         // write something
-        serWrite(SerialHandler, temp, input.size());
+        if (!transport->Write(input, input_len))
+        {
+            Link_failure(LINK_WRITE_FAILED);
+            return TRANSACTION_WRITE_FAILED;
+        }
+        Trace_frame(TRACE_TX, input, input_len);
+
+        int64_t deadline = Get_time() + timeout_us;
 
         // print out sent contents
 #if DEBUG_PRINT_ENABLED
-        printf("Msg sent: %d bytes in total: ", input.size());
-        for (auto i : input)
+        printf("Msg sent: %d bytes in total: ", int(input_len));
+        for (size_t i = 0; i < input_len; i++)
         {
-            printf("%02X ", i);
+            printf("%02X ", input[i]);
         }
         printf("\n");
 #endif
 
-        // wait for feedback to arrive
-        vector<char> output(response_len, 0);
+        // the reply carries the same command and ID as the request
+        uint64_t checksum_failures = parser.checksum_failures;
+        parser.Expect(input[1], input[2], response_len);
 
-        while (serDataAvailable(SerialHandler) < response_len)
+        // wait for feedback to arrive
+        uint8_t temp[max_frame_len];
+        size_t used;
+        while (true)
         {
+            int nbytes = transport->Read(temp, max_frame_len, deadline);
+            if (nbytes > 0)
+            {
+                Trace_frame(TRACE_RX, temp, size_t(nbytes));
+                if (parser.Push(temp, size_t(nbytes), used) == PARSE_OK)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                link_stats.timeouts++;
+                Trace_frame(TRACE_TIMEOUT, nullptr, 0);
+
+#if DEBUG_PRINT_ENABLED
+                printf("Transaction timed out!\n");
+#endif
+                bool corrupted = (parser.checksum_failures != checksum_failures);
+                Link_failure(uint8_t((corrupted ? LINK_CORRUPTED : LINK_TIMEOUT) | ((nbytes < 0) ? LINK_READ_FAILED : 0)));
+                return corrupted ? TRANSACTION_CORRUPTED : TRANSACTION_TIMEOUT;
+            }
         }
 
-        auto nbytes = serRead(SerialHandler, output.data(), response_len);
+        Link_success(Get_time());
+        memcpy(output, parser.Data(), response_len);
 
         // print out received contents
 #if DEBUG_PRINT_ENABLED
-        printf("Msg received: %d bytes in total: ", response_len);
-        for (auto i : output)
+        printf("Msg received: %d bytes in total: ", int(response_len));
+        for (size_t i = 0; i < response_len; i++)
         {
-            printf("%02X ", i);
+            printf("%02X ", output[i]);
         }
         printf("\n");
 #endif
 
+        return TRANSACTION_OK;
+    }
+
+    /**
+     * @brief write a frame and return at once, the reply is collected later
+     *
+     * @param input byte sequence to send, should be a complete frame
+     * @param input_len length of input byte sequence
+     * @param response_len length of response byte sequence
+     * @param timeout_us the reply is counted as missing if not complete after
+     * this long
+     * @return Transaction_result TRANSACTION_PENDING if written
+     *
+     * @note the reply is collected by Collect_responses() or before the next
+     * frame is written, whichever comes first. a feedback reply updates the
+     * motor state just like in a blocking transaction.
+     * @note RS485 is half duplex, so the next frame could only be written
+     * after the reply is in. if the next frame comes before that, it waits
+     * for the reply or its deadline.
+     */
+    Transaction_result Serial_send(const uint8_t *input, const size_t input_len, const size_t response_len, const int64_t timeout_us)
+    {
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        if (!transport)
+        {
+            Link_failure(LINK_CLOSED);
+            return TRANSACTION_WRITE_FAILED;
+        }
+        if (response_len > max_frame_len)
+        {
+            return TRANSACTION_WRITE_FAILED;
+        }
+
+        link_stats.transactions++;
+        link_stats.deferred++;
+
+        if (pending.active)
+        {
+            Settle_pending(true);
+        }
+
+        transport->Flush_input();
+
+        if (!transport->Write(input, input_len))
+        {
+            Link_failure(LINK_WRITE_FAILED);
+            return TRANSACTION_WRITE_FAILED;
+        }
+        Trace_frame(TRACE_TX, input, input_len);
+
+        int64_t now = Get_time();
+
+        if (response_len > 0)
+        {
+            // 10 bits per byte for both frames on the wire
+            parser.Expect(input[1], input[2], response_len);
+            pending.active = true;
+            pending.response_len = response_len;
+            pending.due = now + int64_t(input_len + response_len) * 10000000LL / serial_baud;
+            pending.deadline = now + timeout_us;
+        }
+
+        return TRANSACTION_PENDING;
+    }
+
+    /**
+     * @brief collect the reply of the last Serial_send() if it has arrived
+     *
+     * @return int number of replies collected, 0 or 1
+     *
+     * @note never waits, call it whenever convenient to get the feedback
+     * earlier.
+     */
+    int Collect_responses()
+    {
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        if (!transport)
+        {
+            return 0;
+        }
+
+        return Settle_pending(false);
+    }
+
+    /**
+     * @brief choose whether commands wait for their replies
+     *
+     * @param mode RESPONSE_WAIT (default) or RESPONSE_DEFERRED
+     *
+     * @note in RESPONSE_DEFERRED, commands whose result is only the feedback
+     * or an echo (e.g. Set_velocity(), Pause()) go through Serial_send() and
+     * return TRANSACTION_PENDING. commands that read something (e.g.
+     * Read_pid(), Read_motor_state()) and Command_transaction() with fb
+     * always wait.
+     */
+    void Set_response_mode(const Response_mode mode)
+    {
+        std::lock_guard<std::mutex> lock(serial_mutex);
+        response_mode = mode;
+    }
+
+    /**
+     * @brief get link quality counters
+     *
+     * @return Link_stats counters since Serial_open()
+     */
+    Link_stats Get_link_stats()
+    {
+        std::lock_guard<std::mutex> lock(serial_mutex);
+
+        Link_stats stats = link_stats;
+        stats.checksum_failures = parser.checksum_failures;
+        stats.resyncs = parser.resyncs;
+        stats.unexpected_frames = parser.unexpected_frames;
+        return stats;
+    }
+
+    /**
+     * @brief get the health of the link right now
+     *
+     * @return Link_health consecutive failures, last valid frame and flags
+     *
+     * @note lock-free, safe to call from any thread even in the middle of a
+     * transaction.
+     */
+    Link_health Get_link_health()
+    {
+        Link_health health;
+        link_health.Read(health);
+        return health;
+    }
+
+    /**
+     * @brief write and read back through serial
+     *
+     * @param input byte sequence to send
+     * @param response_len length of byte sequence, 0 means unknown
+     * @return received response byte sequence
+     *
+     * @note allocates, prefer the pointer version on the control path.
+     */
+    vector<char> Serial_transaction(const vector<char> &input, const size_t response_len)
+    {
+        vector<char> output(response_len, 0);
+        Serial_transaction((const uint8_t *)input.data(), input.size(), (uint8_t *)output.data(), response_len);
         return output;
     }
 
@@ -221,141 +693,252 @@ namespace Motor
      *
      * @param curr_time time in int64_t, probably obtained using get_time function
      * @return float motor position from 0 to 2pi
+     *
+     * @note based on the latest state of the default motor, so it is safe to
+     * call from any thread.
+     * @note extrapolates the unwrapped position with the feedback velocity in
+     * int64, for at most max_prediction_us. the feedback velocity is in whole
+     * dps, Predict_position() on the bus motion estimate is finer.
      */
     float Current_pos(int64_t curr_time)
     {
-        float rounds = float(encoder_position) / 32768.0F + float((curr_time - timestamp) * motor_velocity) / 360.0F;
-        return (rounds - std::floor(rounds)) * 2.0F * M_PI;
+        Motor_state state = Get_motor_state();
+        int64_t dt = std::max(-max_prediction_us, std::min(max_prediction_us, curr_time - state.timestamp));
+
+        // dps * us = 1e-4 * 0.01deg
+        return Motor_position_to_Rad(state.position + int64_t(state.feedback.velocity) * dt / 10000);
     }
 
     namespace
     {
         /**
-         * @brief compute checksum of in[start] to in[end]
+         * @brief send a command frame and wait for its reply, which is either
+         * the same as the frame or the regular 13 bytes feedback, parsed by
+         * Command_transaction().
          *
-         * @param in input vector
-         * @param start starting index
-         * @param end ending index
-         * @return uint8_t checksum byte
+         * @param frame frame to send
+         * @return Transaction_result result of the transaction
          */
-        char Checksum(const vector<char> in, const size_t start, const size_t end)
+        template <size_t N>
+        Transaction_result Frame_transaction(const std::array<uint8_t, N> &frame)
         {
-            uint8_t cs = 0;
+            return Command_transaction(frame.data(), N, Reply_length(frame[1]));
+        }
 
-            for (int i = start; i <= end; i++)
+        /**
+         * @brief send a frame that reads something and decode the reply
+         *
+         * @param frame frame to send
+         * @param decode decoder of the reply
+         * @param out decoded reply
+         * @return Transaction_result result of the transaction
+         */
+        template <size_t N, typename T>
+        Transaction_result Query_transaction(const std::array<uint8_t, N> &frame, bool (*decode)(const uint8_t *, T &), T &out)
+        {
+            uint8_t response[max_frame_len];
+            Transaction_result res = Serial_transaction(frame.data(), N, response, Reply_length(frame[1]));
+            if (res == TRANSACTION_OK && !decode(response, out))
             {
-                cs += in[i];
+                return TRANSACTION_CORRUPTED;
             }
+            return res;
+        }
+    }
 
-            return cs;
+    /**
+     * @brief send a command frame and wait for its reply. if the reply is the
+     * regular 13 bytes feedback, parse it.
+     *
+     * @param frame complete command frame
+     * @param frame_len length of the frame
+     * @param response_len length of the reply, feedback_len for feedback
+     * @param fb if not nullptr, decoded feedback is written here
+     * @return Transaction_result result of the transaction
+     *
+     * @note the feedback also updates timestamp, encoder_position and
+     * motor_velocity.
+     * @note in RESPONSE_DEFERRED mode and without fb, it returns
+     * TRANSACTION_PENDING once written, see Serial_send().
+     */
+    Transaction_result Command_transaction(const uint8_t *frame, const size_t frame_len, const size_t response_len, Feedback *fb)
+    {
+        if (response_len > max_frame_len)
+        {
+            return TRANSACTION_WRITE_FAILED;
         }
 
-        /**
-         * @brief Parse the regular 13 bytes response from the motor. It will
-         * set up time stamp, encoder_position and motor_velocity.
-         *
-         * @param response response from the motor
-         */
-        void Parse_response(const vector<char> response)
+        if (!fb)
         {
-            timestamp = Get_time();
+            bool deferred;
+            {
+                std::lock_guard<std::mutex> lock(serial_mutex);
+                deferred = (response_mode == RESPONSE_DEFERRED);
+            }
+            if (deferred)
+            {
+                return Serial_send(frame, frame_len, response_len);
+            }
+        }
 
-            encoder_position = (((uint16_t)response[11]) << 8) + response[10];
-            motor_velocity = (((int16_t)response[9]) << 8) + response[8];
+        uint8_t response[max_frame_len];
+        Transaction_result res = Serial_transaction(frame, frame_len, response, response_len);
+        if (res == TRANSACTION_OK && response_len == feedback_len)
+        {
+            Feedback temp;
+            if (Parse_response(response, temp, Get_time()) && fb)
+            {
+                *fb = temp;
+            }
+        }
+        return res;
+    }
 
-#if DEBUG_PRINT_ENABLED
-            printf("Motor position : %d\nMotor velocity : %d\n\n", encoder_position, motor_velocity);
-#endif
+    /**
+     * @brief obtain the latest state of a motor
+     *
+     * @param id motor ID, 1~32
+     * @return Motor_state latest snapshot, compare sequence with the last
+     * one you read to tell whether a new feedback has arrived
+     *
+     * @note updated by every feedback, no matter it comes from the blocking
+     * functions or the motor bus.
+     * @note lock-free, fields always come from the same feedback.
+     */
+    Motor_state Get_motor_state(const uint8_t id)
+    {
+        if (id == 0 || id > max_motor_id)
+        {
+            return Motor_state();
         }
+
+        Motor_state state;
+        state.sequence = motor_states[id].Read(state);
+        return state;
+    }
+
+    /**
+     * @brief obtain the state of a motor if a newer one has arrived
+     *
+     * @param state last state read, replaced if a newer one has arrived
+     * @param id motor ID, 1~32
+     * @return true if state is replaced
+     *
+     * @note lock-free, cheap enough to call in a tight loop.
+     */
+    bool Get_new_motor_state(Motor_state &state, const uint8_t id)
+    {
+        if (id == 0 || id > max_motor_id || motor_states[id].Writes() == state.sequence)
+        {
+            return false;
+        }
+
+        Motor_state temp;
+        temp.sequence = motor_states[id].Read(temp);
+        if (temp.sequence == state.sequence)
+        {
+            return false;
+        }
+
+        state = temp;
+        return true;
     }
 
     /**
      * @brief (15) completely stop the motor and wipe the motor state/memory
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Stop()
+    Transaction_result Stop(const uint8_t id)
     {
-        vector<char> in = {0x3E, 0x80, Motor_ID, 0x00, 0x00};
-        in[4] = Checksum(in, 0, 3);
-        Serial_transaction(in, 5);
+        return Frame_transaction(Encode_stop(id));
     }
 
     /**
      * @brief (16) stop the motor but NOT wipe the motor state/memory
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Pause()
+    Transaction_result Pause(const uint8_t id)
     {
-        vector<char> in = {0x3E, 0x81, Motor_ID, 0x00, 0x00};
-        in[4] = Checksum(in, 0, 3);
-        Serial_transaction(in, 5);
+        return Frame_transaction(Encode_pause(id));
     }
 
     /**
      * @brief (17) resume from paused state
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Resume()
+    Transaction_result Resume(const uint8_t id)
     {
-        vector<char> in = {0x3E, 0x88, Motor_ID, 0x00, 0x00};
-        in[4] = Checksum(in, 0, 3);
-        Serial_transaction(in, 5);
+        return Frame_transaction(Encode_resume(id));
     }
 
     /**
      * @brief (13) read motor state
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note always waits for the reply, also in RESPONSE_DEFERRED, since it
+     * is the way to poll the motor. the state is in Get_motor_state().
      */
-    void Read_motor_state()
+    Transaction_result Read_motor_state(const uint8_t id)
     {
-        vector<char> in = {0x3E, 0x9C, Motor_ID, 0x00, 0x00};
-        in[4] = Checksum(in, 0, 3);
-        Parse_response(Serial_transaction(in, 13));
+        // with fb it waits whatever the response mode
+        Feedback fb;
+        auto frame = Encode_read_motor_state(id);
+        return Command_transaction(frame.data(), frame.size(), feedback_len, &fb);
     }
 
     /**
      * @brief (18) open loop power control
      *
      * @param power input power from -1000 to 1000
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_power(const int16_t power)
+    Transaction_result Set_power(const int16_t power, const uint8_t id)
     {
-        vector<char> in = {0x3E, 0xA0, Motor_ID, 0x02, 0x00, (uint8_t)(power & 0xFF), (uint8_t)(power >> 8), 0x00};
-        in[4] = Checksum(in, 0, 3);
-        in[7] = Checksum(in, 5, 6);
-        Parse_response(Serial_transaction(in, 13));
+        return Frame_transaction(Encode_power(id, power));
     }
 
     /**
      * @brief (20) closed loop velocity control
      *
      * @param vel input velocity in int32_t, input unit is 0.01dps/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_velocity(const int32_t vel)
+    Transaction_result Set_velocity(const int32_t vel, const uint8_t id)
     {
-        vector<char> in = {0x3E, 0xA2, Motor_ID, 0x04, 0x00, (uint8_t)(vel & 0xFF), (uint8_t)((vel >> 8) & 0xFF), (uint8_t)((vel >> 16) & 0xFF), (uint8_t)((vel >> 24) & 0xFF), 0x00};
-        in[4] = Checksum(in, 0, 3);
-        in[9] = Checksum(in, 5, 8);
-        Parse_response(Serial_transaction(in, 13));
+        return Frame_transaction(Encode_velocity(id, vel));
     }
 
     /**
      * @brief clear loop number
+     *
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Clear_loops()
+    Transaction_result Clear_loops(const uint8_t id)
     {
-        vector<char> in = {0x3E, 0x93, Motor_ID, 0x00, 0x00};
-        in[4] = Checksum(in, 0, 3);
-        Serial_transaction(in, 5);
+        return Frame_transaction(Encode_clear_loops(id));
     }
 
     /**
      * @brief (21) closed loop multi-loop position control 1
      *
      * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
      */
-    void Set_multi_loop_position_1(const int64_t pos)
+    Transaction_result Set_multi_loop_position_1(const int64_t pos, const uint8_t id)
     {
-        vector<char> in = {0x3E, 0xA3, Motor_ID, 0x08, 0x00, (uint8_t)(pos & 0xFF), (uint8_t)((pos >> 8) & 0xFF), (uint8_t)((pos >> 16) & 0xFF), (uint8_t)((pos >> 24) & 0xFF), (uint8_t)((pos >> 32) & 0xFF), (uint8_t)((pos >> 40) & 0xFF), (uint8_t)((pos >> 48) & 0xFF), (uint8_t)((pos >> 56) & 0xFF), 0x00};
-        in[4] = Checksum(in, 0, 3);
-        in[13] = Checksum(in, 5, 12);
-        Parse_response(Serial_transaction(in, 13));
+        return Frame_transaction(Encode_multi_loop_position_1(id, pos));
     }
 
     /**
@@ -363,13 +946,191 @@ namespace Motor
      *
      * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
      * @param max_spd maximum speed in 0.01dps/LSB
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd, const uint8_t id)
+    {
+        return Frame_transaction(Encode_multi_loop_position_2(id, pos, max_spd));
+    }
+
+    /**
+     * @brief (1) read PID parameters
+     *
+     * @param pid decoded PI parameters of the three loops
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_pid(Pid_params &pid, const uint8_t id)
+    {
+        return Query_transaction(Encode_read_pid(id), Decode_pid, pid);
+    }
+
+    /**
+     * @brief (2) write PID parameters to RAM, lost on power off
+     *
+     * @param pid parameters to write
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Write_pid_ram(const Pid_params &pid, const uint8_t id)
+    {
+        return Frame_transaction(Encode_write_pid_ram(id, pid));
+    }
+
+    /**
+     * @brief (3) write PID parameters to ROM, kept on power off
+     *
+     * @param pid parameters to write
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Write_pid_rom(const Pid_params &pid, const uint8_t id)
+    {
+        return Frame_transaction(Encode_write_pid_rom(id, pid));
+    }
+
+    /**
+     * @brief (9) read multi-turn angle
+     *
+     * @param angle multi-turn angle in 0.01deg/LSB, positive is clockwise
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note the motor keeps counting turns itself, so this does not drift like
+     * stitching encoder values on the host does.
+     */
+    Transaction_result Read_multi_turn_angle(int64_t &angle, const uint8_t id)
+    {
+        return Query_transaction(Encode_read_multi_turn_angle(id), Decode_multi_turn_angle, angle);
+    }
+
+    /**
+     * @brief (10) read single-turn angle
+     *
+     * @param angle single-turn angle in 0.01deg/LSB, from 0 to 36000-1
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_single_turn_angle(uint32_t &angle, const uint8_t id)
+    {
+        return Query_transaction(Encode_read_single_turn_angle(id), Decode_single_turn_angle, angle);
+    }
+
+    /**
+     * @brief (11) read temperature, voltage and error flags
+     *
+     * @param state decoded state, see Error_flag for the flags
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     */
+    Transaction_result Read_error_state(Error_state &state, const uint8_t id)
+    {
+        return Query_transaction(Encode_read_error_state(id), Decode_error_state, state);
+    }
+
+    /**
+     * @brief (12) clear error flags
+     *
+     * @param state state after clearing
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note flags could not be cleared while the error is still there.
+     */
+    Transaction_result Clear_errors(Error_state &state, const uint8_t id)
+    {
+        return Query_transaction(Encode_clear_errors(id), Decode_error_state, state);
+    }
+
+    /**
+     * @brief (14) read phase currents
+     *
+     * @param currents decoded temperature and phase currents
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note MF and MG series only, a MS series motor will not reply.
+     */
+    Transaction_result Read_phase_currents(Phase_currents &currents, const uint8_t id)
+    {
+        return Query_transaction(Encode_read_phase_currents(id), Decode_phase_currents, currents);
+    }
+
+    /**
+     * @brief (19) closed loop torque control
+     *
+     * @param iq input torque current from -2000 to 2000, for -32A to 32A
+     * @param id motor ID
+     * @return Transaction_result result of the transaction
+     *
+     * @note MF and MG series only, use Set_power() on a MS series motor.
+     */
+    Transaction_result Set_torque(const int16_t iq, const uint8_t id)
+    {
+        return Frame_transaction(Encode_torque(id, iq));
+    }
+
+    /**
+     * @brief resume, clear loops and go to a multi-loop position, then wait
+     * until the motor settles there
+     *
+     * @param pos target multi-loop position in 0.01deg/LSB, counted from the
+     * single-turn angle since the loops are cleared
+     * @param max_spd maximum speed in 0.01dps/LSB
+     * @param timeout time limit in us
+     * @param id motor ID
+     * @return Home_result HOME_OK as soon as the motor settles
+     *
+     * @note polls the multi-turn angle and the motor state every
+     * home_poll_interval_us, see home_position_tolerance for what settled is.
      */
-    void Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd)
+    Home_result Home(const int64_t pos, const uint32_t max_spd, const int64_t timeout, const uint8_t id)
     {
-        vector<char> in = {0x3E, 0xA4, Motor_ID, 0x0C, 0x00, (uint8_t)(pos & 0xFF), (uint8_t)((pos >> 8) & 0xFF), (uint8_t)((pos >> 16) & 0xFF), (uint8_t)((pos >> 24) & 0xFF), (uint8_t)((pos >> 32) & 0xFF), (uint8_t)((pos >> 40) & 0xFF), (uint8_t)((pos >> 48) & 0xFF), (uint8_t)((pos >> 56) & 0xFF), (uint8_t)(max_spd & 0xFF), (uint8_t)((max_spd >> 8) & 0xFF), (uint8_t)((max_spd >> 16) & 0xFF), (uint8_t)((max_spd >> 24) & 0xFF), 0x00};
-        in[4] = Checksum(in, 0, 3);
-        in[17] = Checksum(in, 5, 16);
-        Parse_response(Serial_transaction(in, 13));
+        int64_t start = Get_time();
+
+        // in deferred mode these come back pending, the reply of each is
+        // collected before the next command is written
+        Transaction_result res[3] = {Resume(id), Clear_loops(id), Set_multi_loop_position_2(pos, max_spd, id)};
+        for (Transaction_result r : res)
+        {
+            if (r != TRANSACTION_OK && r != TRANSACTION_PENDING)
+            {
+                return HOME_FAILED;
+            }
+        }
+
+        int settled = 0;
+        int64_t next_poll = start;
+        while (Get_time() - start < timeout)
+        {
+            int64_t wait = next_poll - Get_time();
+            if (wait > 0)
+            {
+                usleep(useconds_t(wait));
+            }
+            next_poll += home_poll_interval_us;
+
+            // both polls wait for their replies whatever the response mode,
+            // the feedback one because fb is given
+            int64_t angle = 0;
+            Feedback fb;
+            auto frame = Encode_read_motor_state(id);
+            if (Read_multi_turn_angle(angle, id) != TRANSACTION_OK || Command_transaction(frame.data(), frame.size(), feedback_len, &fb) != TRANSACTION_OK)
+            {
+                settled = 0;
+                continue;
+            }
+
+            bool still = std::abs(angle - pos) <= home_position_tolerance && std::abs(fb.velocity) <= home_velocity_tolerance;
+            settled = still ? (settled + 1) : 0;
+            if (settled >= home_settle_count)
+            {
+                return HOME_OK;
+            }
+        }
+
+        return HOME_TIMEOUT;
     }
 
     // /**
@@ -0,0 +1,429 @@
+/**
+ * @file motor_bus.hpp
+ * @brief asynchronous motor client, a bus thread owns the serial port
+ *
+ * @note callers put commands into a lock-free queue and return at once, the
+ * bus thread sends them, waits for the replies and publishes the decoded
+ * feedback as timestamped snapshots (see Get_motor_state()). so the control
+ * loop never waits for the UART.
+ * @note every motor ID has its own queue. the bus thread serves the motors
+ * round-robin, one transaction per motor per turn, so a busy motor could not
+ * starve the others. with polling enabled, a motor that has no command
+ * waiting gets a read motor state (13) on its turn instead, so all motors
+ * are refreshed as fast as the baud rate allows.
+ * @note setpoints (power, torque, velocity and position control) are
+ * coalesced instead of queued: every motor keeps only the newest setpoint of
+ * each type, a setpoint equal to the last one is dropped, and at most
+ * Bus_set_rate_limit() setpoints per second are sent. queued commands and
+ * setpoints still go out in the order submitted.
+ * @note stop and pause skip the queue: every motor keeps the newest of each in
+ * a slot of its own that the bus thread looks at first, so they go out on
+ * the next turn of the motor even when its queue is full. setpoints and
+ * resumes submitted before them are void.
+ * @note every feedback is also fed to a Motion_estimator of its motor, the
+ * estimates are kept as a time series, see Get_motion_history(). with
+ * Bus_set_poll_rate() the poller samples the encoder at a fixed rate for it.
+ * @note after link_loss_failures failed transactions in a row and
+ * link_loss_timeout_us without a valid frame, the link is lost. the bus
+ * thread then stops sending, and reopens the port in the background with
+ * backoff until every motor answers again. the commands from before are
+ * voided and the init of Bus_set_reconnect_init() runs on every motor before
+ * anything else is sent. Bus_submit() never blocks meanwhile, see
+ * Get_bus_health().
+ * @note do not call the blocking functions in motor.hpp while the bus is
+ * open, they would interleave with the bus thread.
+ */
+#ifndef _MOTOR_BUS_HPP_
+#define _MOTOR_BUS_HPP_
+
+#include "motion_estimator.hpp"
+#include "motor.hpp"
+#include "motor_frame.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace Motor
+{
+    // how many commands could wait in the queue of one motor, power of 2
+    constexpr size_t bus_queue_len = 16;
+
+    // how many estimated motion samples are kept for every motor
+    constexpr size_t motion_history_len = 128;
+
+    // failed transactions in a row, and time without a valid frame in us,
+    // before the link counts as lost
+    constexpr uint32_t link_loss_failures = 5;
+    constexpr int64_t link_loss_timeout_us = 100000;
+    // wait before the first reconnect attempt in us, doubles after every
+    // failed attempt up to max_reconnect_interval_us
+    constexpr int64_t reconnect_interval_us = 100000;
+    constexpr int64_t max_reconnect_interval_us = 2000000;
+
+    // state of the link as the bus sees it
+    enum Link_state
+    {
+        LINK_UP = 0, // commands are sent
+        LINK_LOST    // nothing is sent, the port is reopened in the background
+    };
+
+    // health of the bus, see Get_bus_health()
+    struct Bus_health
+    {
+        Link_state state = LINK_UP;
+        // of the serial port right now, reset whenever it is reopened
+        Link_health link;
+        // times the link was lost and came back since Bus_open()
+        uint64_t losses = 0;
+        uint64_t reconnects = 0;
+        // reconnect attempts that failed
+        uint64_t failed_attempts = 0;
+        // local time in us when the link was lost, 0 while up
+        int64_t lost_since = 0;
+    };
+
+    /**
+     * @brief init of one motor after the link came back
+     *
+     * @param id motor ID
+     * @return true if done, false to count the attempt as failed
+     *
+     * @note runs on the bus thread, so it should use the blocking functions
+     * in motor.hpp, not Motor_handle.
+     */
+    typedef bool (*Bus_init)(const uint8_t id);
+
+    // counters of the bus, accumulated since Bus_open()
+    struct Bus_stats
+    {
+        // commands put into the queue
+        uint64_t submitted = 0;
+        // commands dropped because the queue was full
+        uint64_t rejected = 0;
+        // transactions that got a valid reply, including polls
+        uint64_t completed = 0;
+        // transactions that timed out, got corrupted or could not be written
+        uint64_t failed = 0;
+        // read motor state sent by the poller
+        uint64_t polls = 0;
+        // commands not sent: setpoints duplicated, overwritten by a newer one
+        // or voided by stop or pause, resumes voided by stop or pause, and
+        // stops or pauses overwritten before they went out
+        uint64_t suppressed = 0;
+        // longest time a command waited in the queue in us
+        int64_t max_queue_delay = 0;
+        // achieved feedback rate in Hz, smoothed
+        float update_rate = 0.0F;
+    };
+
+    /**
+     * @brief open serial and launch the bus thread
+     *
+     * @param type which serial backend to use
+     * @param port path to the serial port
+     * @param baud baud rate
+     * @return 0 for OK and 1 for failed
+     */
+    int Bus_open(const Transport_type type = default_transport, const char *port = default_port, const int baud = default_baud);
+
+    /**
+     * @brief send what is still in the queues, stop the bus thread and close
+     * serial
+     */
+    void Bus_close();
+
+    /**
+     * @brief add a motor to the round-robin schedule
+     *
+     * @param id motor ID, 1~32
+     * @return true if added
+     *
+     * @note a motor is also added the first time a command is submitted to it.
+     */
+    bool Bus_add_motor(const uint8_t id);
+
+    /**
+     * @brief poll motors that have nothing to send or not
+     *
+     * @param enable true to poll
+     */
+    void Bus_set_polling(const bool enable);
+
+    /**
+     * @brief poll every motor at a fixed rate instead of whenever idle
+     *
+     * @param rate polls per second per motor, 0 to poll whenever idle
+     *
+     * @note a motor is only polled when it has had no feedback for 1/rate,
+     * so commands that bring feedback count too. the achieved rate is
+     * limited by the baud rate, see Bus_stats::update_rate.
+     * @note polling should be enabled by Bus_set_polling().
+     */
+    void Bus_set_poll_rate(const float rate);
+
+    /**
+     * @brief whether motors that have nothing to send are polled, see
+     * Bus_set_polling()
+     */
+    bool Bus_get_polling();
+
+    /**
+     * @brief polls per second per motor, 0 for whenever idle, see
+     * Bus_set_poll_rate()
+     */
+    float Bus_get_poll_rate();
+
+    /**
+     * @brief set the smoothing of the motion estimators
+     *
+     * @param smoothing from 0 to 1, higher is smoother but lags more, see
+     * Motion_estimator::Set_smoothing()
+     */
+    void Bus_set_motion_smoothing(const float smoothing);
+
+    /**
+     * @brief get the latest estimated motion of a motor
+     *
+     * @param id motor ID, 1~32
+     * @return Motion_sample latest sample, sequence is 0 if there is none
+     *
+     * @note lock-free, safe to call from any thread.
+     */
+    Motion_sample Get_motion(const uint8_t id = Motor_ID);
+
+    /**
+     * @brief get the estimated motion samples of a motor that came after a
+     * given one
+     *
+     * @param id motor ID, 1~32
+     * @param since sequence of the last sample already read, 0 for none
+     * @param out output samples, oldest first
+     * @param max size of out
+     * @return size_t number of samples written to out
+     *
+     * @note at most the newest motion_history_len samples are kept, older
+     * ones are lost if not read in time. compare the sequence of out[0] with
+     * since + 1 to tell.
+     * @note lock-free, safe to call from any thread.
+     */
+    size_t Get_motion_history(const uint8_t id, const uint64_t since, Motion_sample *out, const size_t max);
+
+    /**
+     * @brief limit how often setpoints are sent to one motor
+     *
+     * @param rate maximum setpoints per second per motor, 0 for no limit
+     *
+     * @note only the newest setpoint is sent when the limit allows, the ones
+     * in between are counted as suppressed.
+     */
+    void Bus_set_rate_limit(const float rate);
+
+    /**
+     * @brief put a command frame into the queue of the motor it is addressed to
+     *
+     * @param frame complete command frame, at most max_frame_len bytes
+     * @param frame_len length of the frame
+     * @param response_len length of the reply, feedback_len for feedback
+     * @return true if queued, false if the bus is not open, the ID is invalid
+     * or the queue is full. stop and pause are never turned away by a full
+     * queue.
+     *
+     * @note never blocks, safe to call from any thread.
+     * @note setpoints are coalesced, see the notes at the top.
+     */
+    bool Bus_submit(const uint8_t *frame, const size_t frame_len, const size_t response_len);
+
+    /**
+     * @brief put a command frame into the queue of the motor it is addressed to
+     *
+     * @param frame complete command frame, the reply length is looked up in
+     * the command table
+     * @return true if queued
+     */
+    template <size_t N>
+    bool Bus_submit(const std::array<uint8_t, N> &frame)
+    {
+        return Bus_submit(frame.data(), N, Reply_length(frame[1]));
+    }
+
+    /**
+     * @brief set what is run on every motor when the link comes back
+     *
+     * @param init init function, nullptr for the default, which pauses the
+     * motor
+     *
+     * @note the motor should be left in a safe state, the control code
+     * could tell from Bus_health::reconnects and start it again.
+     * @note init runs in the response mode set by Set_response_mode(), in
+     * RESPONSE_DEFERRED echo commands like Pause() return
+     * TRANSACTION_PENDING. the default pause always waits for its reply.
+     */
+    void Bus_set_reconnect_init(const Bus_init init);
+
+    /**
+     * @brief get the health of the bus and the link
+     *
+     * @return Bus_health state, link health and counters since Bus_open()
+     *
+     * @note lock-free, safe to call from any thread.
+     */
+    Bus_health Get_bus_health();
+
+    /**
+     * @brief get bus counters of one motor
+     *
+     * @param id motor ID, 1~32
+     * @return Bus_stats counters since Bus_open()
+     */
+    Bus_stats Get_bus_stats(const uint8_t id);
+
+    /**
+     * @brief get bus counters of all motors together
+     *
+     * @return Bus_stats counters since Bus_open(), update_rate is the sum
+     */
+    Bus_stats Get_bus_stats();
+
+    /**
+     * @brief a motor on the bus, all commands are queued and return at once
+     */
+    class Motor_handle
+    {
+    public:
+        /**
+         * @param id motor ID, 1~32
+         */
+        explicit Motor_handle(const uint8_t id = Motor_ID) : id(id) {}
+
+        /**
+         * @brief ID of this motor
+         */
+        uint8_t ID() const { return id; }
+
+        /**
+         * @brief latest state of this motor
+         */
+        Motor_state Get_state() const { return Get_motor_state(id); }
+
+        /**
+         * @brief bus counters of this motor
+         */
+        Bus_stats Get_stats() const { return Get_bus_stats(id); }
+
+        /**
+         * @brief latest estimated motion of this motor
+         */
+        Motion_sample Get_motion() const { return Motor::Get_motion(id); }
+
+        /**
+         * @brief multi-turn shaft angle of this motor in deg, extrapolated to
+         * time from the latest estimated motion
+         *
+         * @param time local time in us, see Get_time()
+         */
+        double Predict_position(const int64_t time) const { return Motor::Predict_position(Get_motion(), time); }
+
+        /**
+         * @brief (15) completely stop the motor and wipe the motor state/memory
+         *
+         * @return true if queued
+         */
+        bool Stop() const;
+
+        /**
+         * @brief (16) stop the motor but NOT wipe the motor state/memory
+         *
+         * @return true if queued
+         */
+        bool Pause() const;
+
+        /**
+         * @brief (17) resume from paused state
+         *
+         * @return true if queued
+         */
+        bool Resume() const;
+
+        /**
+         * @brief (13) read motor state
+         *
+         * @return true if queued
+         */
+        bool Read_motor_state() const;
+
+        /**
+         * @brief (18) open loop power control
+         *
+         * @param power input power from -1000 to 1000
+         * @return true if queued
+         */
+        bool Set_power(const int16_t power) const;
+
+        /**
+         * @brief (19) closed loop torque control
+         *
+         * @param iq input torque current from -2000 to 2000, for -32A to 32A
+         * @return true if queued
+         *
+         * @note MF and MG series only
+         */
+        bool Set_torque(const int16_t iq) const;
+
+        /**
+         * @brief (20) closed loop velocity control
+         *
+         * @param vel input velocity in int32_t, input unit is 0.01dps/LSB
+         * @return true if queued
+         */
+        bool Set_velocity(const int32_t vel) const;
+
+        /**
+         * @brief clear loop number
+         *
+         * @return true if queued
+         */
+        bool Clear_loops() const;
+
+        /**
+         * @brief (21) closed loop multi-loop position control 1
+         *
+         * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+         * @return true if queued
+         */
+        bool Set_multi_loop_position_1(const int64_t pos) const;
+
+        /**
+         * @brief (22) closed loop multi-loop position control 2
+         *
+         * @param pos input multi-loop position in int64_t, input unit is 0.01deg/LSB
+         * @param max_spd maximum speed in 0.01dps/LSB
+         * @return true if queued
+         */
+        bool Set_multi_loop_position_2(const int64_t pos, uint32_t max_spd) const;
+
+        /**
+         * @brief resume, clear loops and go to a multi-loop position, then
+         * wait until the motor settles there
+         *
+         * @param pos target multi-loop position in 0.01deg/LSB, counted from
+         * the single-turn angle since the loops are cleared
+         * @param max_spd maximum speed in 0.01dps/LSB
+         * @param timeout time limit in us
+         * @return Home_result HOME_OK as soon as the motor settles
+         *
+         * @note blocks the caller, not the bus. the motor state is polled
+         * every home_poll_interval_us, see home_position_tolerance.
+         * @note the multi-loop angle is not read back, the unwrapped
+         * position of the motor state is anchored to it by the first
+         * feedback after the call instead. the shaft should not cross the
+         * zero of its encoder before the loops are cleared, so do not home
+         * a motor that is still coasting.
+         */
+        Home_result Home(const int64_t pos = 0, const uint32_t max_spd = 36000, const int64_t timeout = home_timeout_us) const;
+
+    private:
+        uint8_t id;
+    };
+}
+
+#endif
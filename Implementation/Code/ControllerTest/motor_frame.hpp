@@ -0,0 +1,879 @@
+/**
+ * @file motor_frame.hpp
+ * @brief fixed size frame codec for the Km-tech RS485 protocol
+ *
+ * @note a frame is a 5 bytes header {0x3E, command, ID, data length, header
+ * checksum}, followed by the data bytes and a data checksum if there is any
+ * data. every frame here is a std::array whose size is known at compile
+ * time, so encoding and decoding never touch the heap.
+ */
+#ifndef _MOTOR_FRAME_HPP_
+#define _MOTOR_FRAME_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace Motor
+{
+    // first byte of every frame
+    constexpr uint8_t frame_head = 0x3E;
+    // length of frame header
+    constexpr size_t header_len = 5;
+    // length of the regular feedback frame (command 13 & 18~26)
+    constexpr size_t feedback_len = 13;
+    // length of the longest frame we will ever send or receive
+    constexpr size_t max_frame_len = 30;
+    // motor IDs on the bus are 1~32
+    constexpr uint8_t max_motor_id = 32;
+
+    // how the motor replies to a command
+    enum Reply_type : uint8_t
+    {
+        REPLY_NONE = 0,          // unknown command, the motor stays silent
+        REPLY_ECHO,              // the reply is the same as the request
+        REPLY_FEEDBACK,          // regular 13 bytes feedback, see Feedback
+        REPLY_PID,               // PI parameters, see Pid_params
+        REPLY_MULTI_TURN_ANGLE,  // int64_t angle in 0.01deg/LSB
+        REPLY_SINGLE_TURN_ANGLE, // uint32_t angle in 0.01deg/LSB
+        REPLY_ERROR_STATE,       // temperature, voltage and error flags, see Error_state
+        REPLY_PHASE_CURRENTS     // temperature and phase currents, see Phase_currents
+    };
+
+    /**
+     * @brief table of every supported command, each line is
+     * X(name, command byte, request data length, reply data length, reply type)
+     *
+     * @note the command IDs, lengths and the checks on every encoder and
+     * decoder below are all generated from this table, add new commands here.
+     * the numbers in brackets refer to the sections of the protocol document.
+     */
+#define MOTOR_COMMAND_TABLE(X)                                   \
+    X(READ_PID, 0x30, 0, 6, REPLY_PID)                           \
+    X(WRITE_PID_RAM, 0x31, 6, 6, REPLY_ECHO)                     \
+    X(WRITE_PID_ROM, 0x32, 6, 6, REPLY_ECHO)                     \
+    X(STOP, 0x80, 0, 0, REPLY_ECHO)                              \
+    X(PAUSE, 0x81, 0, 0, REPLY_ECHO)                             \
+    X(RESUME, 0x88, 0, 0, REPLY_ECHO)                            \
+    X(READ_MULTI_TURN_ANGLE, 0x92, 0, 8, REPLY_MULTI_TURN_ANGLE) \
+    X(CLEAR_LOOPS, 0x93, 0, 0, REPLY_ECHO)                       \
+    X(READ_SINGLE_TURN_ANGLE, 0x94, 0, 4, REPLY_SINGLE_TURN_ANGLE) \
+    X(READ_ERROR_STATE, 0x9A, 0, 7, REPLY_ERROR_STATE)           \
+    X(CLEAR_ERRORS, 0x9B, 0, 7, REPLY_ERROR_STATE)               \
+    X(READ_MOTOR_STATE, 0x9C, 0, 7, REPLY_FEEDBACK)              \
+    X(READ_PHASE_CURRENTS, 0x9D, 0, 7, REPLY_PHASE_CURRENTS)     \
+    X(POWER, 0xA0, 2, 7, REPLY_FEEDBACK)                         \
+    X(TORQUE, 0xA1, 2, 7, REPLY_FEEDBACK)                        \
+    X(VELOCITY, 0xA2, 4, 7, REPLY_FEEDBACK)                      \
+    X(MULTI_LOOP_POSITION_1, 0xA3, 8, 7, REPLY_FEEDBACK)         \
+    X(MULTI_LOOP_POSITION_2, 0xA4, 12, 7, REPLY_FEEDBACK)
+
+#define MOTOR_COMMAND_ENUM(name, cmd, request_len, reply_len, reply) CMD_##name = cmd,
+    enum Command_ID : uint8_t
+    {
+        MOTOR_COMMAND_TABLE(MOTOR_COMMAND_ENUM)
+    };
+#undef MOTOR_COMMAND_ENUM
+
+    // one line of the command table
+    struct Command_descriptor
+    {
+        uint8_t command;
+        // data length of the request
+        uint8_t request_len;
+        // data length of the reply
+        uint8_t reply_len;
+        Reply_type reply;
+    };
+
+#define MOTOR_COMMAND_DESCRIPTOR(name, cmd, request_len, reply_len, reply) {cmd, request_len, reply_len, reply},
+    constexpr Command_descriptor command_table[] = {MOTOR_COMMAND_TABLE(MOTOR_COMMAND_DESCRIPTOR)};
+#undef MOTOR_COMMAND_DESCRIPTOR
+
+    constexpr size_t command_count = sizeof(command_table) / sizeof(command_table[0]);
+
+    /**
+     * @brief look up a command in the command table
+     *
+     * @param cmd command byte
+     * @return Command_descriptor its line in the table, reply is REPLY_NONE if
+     * the command is not in the table
+     */
+    constexpr Command_descriptor Command_info(const uint8_t cmd, const size_t i = 0)
+    {
+        return (i >= command_count) ? Command_descriptor{cmd, 0, 0, REPLY_NONE}
+                                    : ((command_table[i].command == cmd) ? command_table[i] : Command_info(cmd, i + 1));
+    }
+
+    /**
+     * @brief length of a frame carrying data_len bytes of data
+     *
+     * @param data_len length of data
+     * @return size_t length of the whole frame
+     */
+    constexpr size_t Frame_length(const size_t data_len)
+    {
+        return header_len + ((data_len == 0) ? 0 : (data_len + 1));
+    }
+
+    /**
+     * @brief a frame that carries data_len bytes of data
+     */
+    template <size_t data_len>
+    using Frame = std::array<uint8_t, Frame_length(data_len)>;
+
+    /**
+     * @brief length of the whole reply frame to a command
+     *
+     * @param cmd command byte
+     * @return size_t length of the reply, 0 if the command is unknown
+     */
+    constexpr size_t Reply_length(const uint8_t cmd)
+    {
+        return (Command_info(cmd).reply == REPLY_NONE) ? 0 : Frame_length(Command_info(cmd).reply_len);
+    }
+
+    /**
+     * @brief compute checksum of len bytes starting from in
+     *
+     * @param in pointer to the first byte
+     * @param len number of bytes
+     * @return uint8_t checksum byte
+     */
+    constexpr uint8_t Checksum(const uint8_t *in, const size_t len)
+    {
+        return (len == 0) ? 0 : uint8_t(in[0] + Checksum(in + 1, len - 1));
+    }
+
+    /**
+     * @brief checksum of the frame header
+     *
+     * @param cmd command byte
+     * @param id motor ID
+     * @param data_len length of data
+     * @return uint8_t header checksum byte
+     */
+    constexpr uint8_t Header_checksum(const uint8_t cmd, const uint8_t id, const uint8_t data_len)
+    {
+        return uint8_t(frame_head + cmd + id + data_len);
+    }
+
+    /**
+     * @brief write val to out in little endian
+     *
+     * @param out output pointer, should have at least sizeof(T) bytes
+     * @param val value to write
+     */
+    template <typename T>
+    inline void Put_le(uint8_t *out, const T val)
+    {
+        for (size_t i = 0; i < sizeof(T); i++)
+        {
+            out[i] = uint8_t((uint64_t(val) >> (8 * i)) & 0xFF);
+        }
+    }
+
+    /**
+     * @brief read a little endian T from in
+     *
+     * @param in input pointer, should have at least sizeof(T) bytes
+     * @return T value
+     */
+    template <typename T>
+    inline T Get_le(const uint8_t *in)
+    {
+        uint64_t val = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+        {
+            val |= uint64_t(in[i]) << (8 * i);
+        }
+        return T(val);
+    }
+
+    /**
+     * @brief build a frame with header filled and data area zeroed
+     *
+     * @param cmd command byte
+     * @param id motor ID
+     * @return Frame<data_len> frame, call Seal_frame() after filling data
+     */
+    template <size_t data_len>
+    inline Frame<data_len> Make_frame(const uint8_t cmd, const uint8_t id)
+    {
+        Frame<data_len> frame{};
+        frame[0] = frame_head;
+        frame[1] = cmd;
+        frame[2] = id;
+        frame[3] = uint8_t(data_len);
+        frame[4] = Header_checksum(cmd, id, uint8_t(data_len));
+        return frame;
+    }
+
+    /**
+     * @brief fill in data checksum after data has been written
+     *
+     * @param frame frame to seal
+     */
+    template <size_t N>
+    inline void Seal_frame(std::array<uint8_t, N> &frame)
+    {
+        if (N > header_len)
+        {
+            frame[N - 1] = Checksum(frame.data() + header_len, N - header_len - 1);
+        }
+    }
+
+    /**
+     * @brief total size of a list of types
+     */
+    template <typename... Args>
+    struct Payload_size;
+
+    template <>
+    struct Payload_size<>
+    {
+        static constexpr size_t value = 0;
+    };
+
+    template <typename T, typename... Rest>
+    struct Payload_size<T, Rest...>
+    {
+        static constexpr size_t value = sizeof(T) + Payload_size<Rest...>::value;
+    };
+
+    /**
+     * @brief write values one after another in little endian
+     */
+    inline void Put_all(uint8_t *)
+    {
+    }
+
+    template <typename T, typename... Rest>
+    inline void Put_all(uint8_t *out, const T val, const Rest... rest)
+    {
+        Put_le(out, val);
+        Put_all(out + sizeof(T), rest...);
+    }
+
+    /**
+     * @brief encode a command, data is the arguments in order, each in little
+     * endian. the data length is checked against the command table at
+     * compile time.
+     *
+     * @tparam cmd command in the command table
+     * @param id motor ID
+     * @param args data fields
+     * @return Frame<> complete frame
+     */
+    template <Command_ID cmd, typename... Args>
+    inline Frame<Command_info(cmd).request_len> Encode_command(const uint8_t id, const Args... args)
+    {
+        static_assert(Command_info(cmd).reply != REPLY_NONE, "command is not in the command table");
+        static_assert(Payload_size<Args...>::value == Command_info(cmd).request_len, "data does not match the command table");
+
+        auto frame = Make_frame<Command_info(cmd).request_len>(cmd, id);
+        Put_all(frame.data() + header_len, args...);
+        Seal_frame(frame);
+        return frame;
+    }
+
+    /**
+     * @brief (1) read PID parameters frame
+     */
+    inline Frame<0> Encode_read_pid(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_PID>(id);
+    }
+
+    /**
+     * @brief (15) stop frame
+     */
+    inline Frame<0> Encode_stop(const uint8_t id)
+    {
+        return Encode_command<CMD_STOP>(id);
+    }
+
+    /**
+     * @brief (16) pause frame
+     */
+    inline Frame<0> Encode_pause(const uint8_t id)
+    {
+        return Encode_command<CMD_PAUSE>(id);
+    }
+
+    /**
+     * @brief (17) resume frame
+     */
+    inline Frame<0> Encode_resume(const uint8_t id)
+    {
+        return Encode_command<CMD_RESUME>(id);
+    }
+
+    /**
+     * @brief (9) read multi-turn angle frame
+     */
+    inline Frame<0> Encode_read_multi_turn_angle(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_MULTI_TURN_ANGLE>(id);
+    }
+
+    /**
+     * @brief clear loop number frame
+     */
+    inline Frame<0> Encode_clear_loops(const uint8_t id)
+    {
+        return Encode_command<CMD_CLEAR_LOOPS>(id);
+    }
+
+    /**
+     * @brief (10) read single-turn angle frame
+     */
+    inline Frame<0> Encode_read_single_turn_angle(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_SINGLE_TURN_ANGLE>(id);
+    }
+
+    /**
+     * @brief (11) read motor state 1 and error flags frame
+     */
+    inline Frame<0> Encode_read_error_state(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_ERROR_STATE>(id);
+    }
+
+    /**
+     * @brief (12) clear error flags frame
+     */
+    inline Frame<0> Encode_clear_errors(const uint8_t id)
+    {
+        return Encode_command<CMD_CLEAR_ERRORS>(id);
+    }
+
+    /**
+     * @brief (13) read motor state frame
+     */
+    inline Frame<0> Encode_read_motor_state(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_MOTOR_STATE>(id);
+    }
+
+    /**
+     * @brief (14) read motor state 3 (phase currents) frame
+     *
+     * @note MF and MG series only
+     */
+    inline Frame<0> Encode_read_phase_currents(const uint8_t id)
+    {
+        return Encode_command<CMD_READ_PHASE_CURRENTS>(id);
+    }
+
+    /**
+     * @brief (18) open loop power control frame
+     *
+     * @param power input power from -1000 to 1000
+     */
+    inline Frame<2> Encode_power(const uint8_t id, const int16_t power)
+    {
+        return Encode_command<CMD_POWER>(id, power);
+    }
+
+    /**
+     * @brief (19) closed loop torque control frame
+     *
+     * @param iq input torque current from -2000 to 2000, for -32A to 32A
+     *
+     * @note MF and MG series only
+     */
+    inline Frame<2> Encode_torque(const uint8_t id, const int16_t iq)
+    {
+        return Encode_command<CMD_TORQUE>(id, iq);
+    }
+
+    /**
+     * @brief (20) closed loop velocity control frame
+     *
+     * @param vel input velocity, unit is 0.01dps/LSB
+     */
+    inline Frame<4> Encode_velocity(const uint8_t id, const int32_t vel)
+    {
+        return Encode_command<CMD_VELOCITY>(id, vel);
+    }
+
+    /**
+     * @brief (21) closed loop multi-loop position control 1 frame
+     *
+     * @param pos input multi-loop position, unit is 0.01deg/LSB
+     */
+    inline Frame<8> Encode_multi_loop_position_1(const uint8_t id, const int64_t pos)
+    {
+        return Encode_command<CMD_MULTI_LOOP_POSITION_1>(id, pos);
+    }
+
+    /**
+     * @brief (22) closed loop multi-loop position control 2 frame
+     *
+     * @param pos input multi-loop position, unit is 0.01deg/LSB
+     * @param max_spd maximum speed in 0.01dps/LSB
+     */
+    inline Frame<12> Encode_multi_loop_position_2(const uint8_t id, const int64_t pos, const uint32_t max_spd)
+    {
+        return Encode_command<CMD_MULTI_LOOP_POSITION_2>(id, pos, max_spd);
+    }
+
+    enum Parse_result
+    {
+        PARSE_INCOMPLETE = 0, // need more bytes
+        PARSE_OK              // a complete and valid frame is ready
+    };
+
+    /**
+     * @brief a streaming parser that picks the expected frame out of a byte
+     * stream. it syncs on the 0x3E frame head, checks command, ID, data length
+     * and both checksums, and resyncs on anything that does not fit.
+     *
+     * @note counters are never reset by Expect(), they accumulate over the
+     * lifetime of the parser so that link quality can be monitored.
+     */
+    class Frame_parser
+    {
+    public:
+        // header checksum or data checksum mismatches
+        uint64_t checksum_failures = 0;
+        // times that we lost sync and have to hunt for the next frame head
+        uint64_t resyncs = 0;
+        // well formed frames that are not the one we are waiting for
+        uint64_t unexpected_frames = 0;
+
+        /**
+         * @brief reset the parser and wait for a new frame
+         *
+         * @param cmd expected command byte
+         * @param id expected motor ID
+         * @param frame_len expected length of the whole frame
+         */
+        void Expect(const uint8_t cmd, const uint8_t id, const size_t frame_len)
+        {
+            exp_cmd = cmd;
+            exp_id = id;
+            exp_len = (frame_len > max_frame_len) ? max_frame_len : frame_len;
+            exp_data_len = uint8_t((exp_len > header_len) ? (exp_len - header_len - 1) : 0);
+            any_frame = false;
+            len = 0;
+            skip = 0;
+            hunting = false;
+        }
+
+        /**
+         * @brief reset the parser and accept any well formed frame, whatever
+         * its command, ID or length is
+         *
+         * @note frames longer than max_frame_len are treated as garbage
+         */
+        void Expect_any()
+        {
+            Expect(0, 0, header_len);
+            any_frame = true;
+        }
+
+        /**
+         * @brief feed one byte into the parser
+         *
+         * @param byte incoming byte
+         * @return Parse_result PARSE_OK when the expected frame is complete,
+         * the frame could then be obtained by Data().
+         */
+        Parse_result Push(const uint8_t byte)
+        {
+            if (skip > 0)
+            {
+                skip--;
+                return PARSE_INCOMPLETE;
+            }
+
+            if (len >= exp_len)
+            {
+                // the last frame has already been handed out
+                Drop(len);
+            }
+
+            buf[len++] = byte;
+            return Scan();
+        }
+
+        /**
+         * @brief feed n bytes into the parser, stop at the first complete frame
+         *
+         * @param in input bytes
+         * @param n number of bytes
+         * @param used number of bytes consumed
+         * @return Parse_result PARSE_OK when the expected frame is complete
+         */
+        Parse_result Push(const uint8_t *in, const size_t n, size_t &used)
+        {
+            for (used = 0; used < n;)
+            {
+                if (Push(in[used++]) == PARSE_OK)
+                {
+                    return PARSE_OK;
+                }
+            }
+            return PARSE_INCOMPLETE;
+        }
+
+        /**
+         * @brief the last complete frame, valid only after PARSE_OK
+         */
+        const uint8_t *Data() const
+        {
+            return buf;
+        }
+
+        /**
+         * @brief length of the last complete frame, valid only after PARSE_OK
+         */
+        size_t Length() const
+        {
+            return exp_len;
+        }
+
+    private:
+        uint8_t buf[max_frame_len];
+        size_t len = 0;
+        // bytes to throw away for skipping an unexpected frame
+        size_t skip = 0;
+        bool hunting = false;
+        bool any_frame = false;
+
+        uint8_t exp_cmd = 0;
+        uint8_t exp_id = 0;
+        uint8_t exp_data_len = 0;
+        size_t exp_len = header_len;
+
+        /**
+         * @brief drop first n bytes in the buffer
+         */
+        void Drop(const size_t n)
+        {
+            memmove(buf, buf + n, len - n);
+            len -= n;
+        }
+
+        /**
+         * @brief lose sync, drop the first byte and hunt for next frame head
+         */
+        void Resync()
+        {
+            if (!hunting)
+            {
+                resyncs++;
+                hunting = true;
+            }
+            Drop(1);
+        }
+
+        /**
+         * @brief check whatever is in the buffer
+         */
+        Parse_result Scan()
+        {
+            while (len > 0)
+            {
+                if (buf[0] != frame_head)
+                {
+                    Resync();
+                    continue;
+                }
+
+                if (len < header_len)
+                {
+                    return PARSE_INCOMPLETE;
+                }
+
+                if (buf[4] != Checksum(buf, 4))
+                {
+                    checksum_failures++;
+                    Resync();
+                    continue;
+                }
+
+                if (any_frame)
+                {
+                    if (Frame_length(buf[3]) > max_frame_len)
+                    {
+                        Resync();
+                        continue;
+                    }
+                    exp_cmd = buf[1];
+                    exp_id = buf[2];
+                    exp_data_len = buf[3];
+                    exp_len = Frame_length(buf[3]);
+                }
+
+                hunting = false;
+
+                if (buf[1] != exp_cmd || buf[2] != exp_id || buf[3] != exp_data_len)
+                {
+                    // a valid header of some other frame, skip the whole thing
+                    unexpected_frames++;
+                    size_t other_len = Frame_length(buf[3]);
+                    if (other_len <= len)
+                    {
+                        Drop(other_len);
+                    }
+                    else
+                    {
+                        skip = other_len - len;
+                        len = 0;
+                    }
+                    continue;
+                }
+
+                if (len < exp_len)
+                {
+                    return PARSE_INCOMPLETE;
+                }
+
+                if (exp_len > header_len && buf[exp_len - 1] != Checksum(buf + header_len, exp_len - header_len - 1))
+                {
+                    checksum_failures++;
+                    Resync();
+                    continue;
+                }
+
+                return PARSE_OK;
+            }
+
+            return PARSE_INCOMPLETE;
+        }
+    };
+
+    /**
+     * @brief decoded regular 13 bytes feedback frame
+     */
+    struct Feedback
+    {
+        // which command this frame is replying to
+        uint8_t command = 0;
+        // which motor sent it
+        uint8_t id = 0;
+        // motor temperature in degree C
+        int8_t temperature = 0;
+        // torque current (MF/MG, -2048~2048 for -33A~33A) or output power (MS, -1000~1000)
+        int16_t torque_current = 0;
+        // motor speed in degree/s
+        int16_t velocity = 0;
+        // encoder value, from 0~32767, 15 bits in total.
+        uint16_t encoder = 0;
+    };
+
+    /**
+     * @brief check that a reply frame is complete and intact, and has the
+     * data length the command table says it should
+     *
+     * @param in pointer to the frame, should have at least Reply_length(in[1]) bytes
+     * @param reply expected reply type
+     * @return true if head, length, reply type and both checksums are OK
+     */
+    inline bool Check_reply(const uint8_t *in, const Reply_type reply)
+    {
+        const Command_descriptor info = Command_info(in[1]);
+        if (in[0] != frame_head || info.reply != reply || in[3] != info.reply_len || in[4] != Checksum(in, 4))
+        {
+            return false;
+        }
+
+        return (info.reply_len == 0) || (in[header_len + info.reply_len] == Checksum(in + header_len, info.reply_len));
+    }
+
+    /**
+     * @brief decode a regular 13 bytes feedback frame
+     *
+     * @param in pointer to the frame, should have at least feedback_len bytes
+     * @param fb decoded feedback
+     * @return true if header and both checksums are OK
+     */
+    inline bool Decode_feedback(const uint8_t *in, Feedback &fb)
+    {
+        if (!Check_reply(in, REPLY_FEEDBACK))
+        {
+            return false;
+        }
+
+        fb.command = in[1];
+        fb.id = in[2];
+        fb.temperature = int8_t(in[5]);
+        fb.torque_current = Get_le<int16_t>(in + 6);
+        fb.velocity = Get_le<int16_t>(in + 8);
+        fb.encoder = Get_le<uint16_t>(in + 10);
+        return true;
+    }
+
+    /**
+     * @brief PI parameters of the three control loops
+     */
+    struct Pid_params
+    {
+        uint8_t angle_kp = 0;
+        uint8_t angle_ki = 0;
+        uint8_t speed_kp = 0;
+        uint8_t speed_ki = 0;
+        uint8_t iq_kp = 0;
+        uint8_t iq_ki = 0;
+    };
+
+    /**
+     * @brief (2) write PID parameters to RAM frame, lost on power off
+     *
+     * @param pid parameters to write
+     */
+    inline Frame<6> Encode_write_pid_ram(const uint8_t id, const Pid_params &pid)
+    {
+        return Encode_command<CMD_WRITE_PID_RAM>(id, pid.angle_kp, pid.angle_ki, pid.speed_kp, pid.speed_ki, pid.iq_kp, pid.iq_ki);
+    }
+
+    /**
+     * @brief (3) write PID parameters to ROM frame, kept on power off
+     *
+     * @param pid parameters to write
+     */
+    inline Frame<6> Encode_write_pid_rom(const uint8_t id, const Pid_params &pid)
+    {
+        return Encode_command<CMD_WRITE_PID_ROM>(id, pid.angle_kp, pid.angle_ki, pid.speed_kp, pid.speed_ki, pid.iq_kp, pid.iq_ki);
+    }
+
+    /**
+     * @brief decode the reply to (1) read PID parameters
+     *
+     * @param in pointer to the frame
+     * @param pid decoded parameters
+     * @return true if the frame is OK
+     */
+    inline bool Decode_pid(const uint8_t *in, Pid_params &pid)
+    {
+        if (!Check_reply(in, REPLY_PID))
+        {
+            return false;
+        }
+
+        pid.angle_kp = in[5];
+        pid.angle_ki = in[6];
+        pid.speed_kp = in[7];
+        pid.speed_ki = in[8];
+        pid.iq_kp = in[9];
+        pid.iq_ki = in[10];
+        return true;
+    }
+
+    /**
+     * @brief decode the reply to (9) read multi-turn angle
+     *
+     * @param in pointer to the frame
+     * @param angle decoded angle in 0.01deg/LSB, positive is clockwise
+     * @return true if the frame is OK
+     */
+    inline bool Decode_multi_turn_angle(const uint8_t *in, int64_t &angle)
+    {
+        if (!Check_reply(in, REPLY_MULTI_TURN_ANGLE))
+        {
+            return false;
+        }
+
+        angle = Get_le<int64_t>(in + header_len);
+        return true;
+    }
+
+    /**
+     * @brief decode the reply to (10) read single-turn angle
+     *
+     * @param in pointer to the frame
+     * @param angle decoded angle in 0.01deg/LSB, from 0 to 36000-1
+     * @return true if the frame is OK
+     */
+    inline bool Decode_single_turn_angle(const uint8_t *in, uint32_t &angle)
+    {
+        if (!Check_reply(in, REPLY_SINGLE_TURN_ANGLE))
+        {
+            return false;
+        }
+
+        angle = Get_le<uint32_t>(in + header_len);
+        return true;
+    }
+
+    // bits of Error_state::error
+    enum Error_flag : uint8_t
+    {
+        ERROR_LOW_VOLTAGE = 0x01,
+        ERROR_OVER_TEMPERATURE = 0x08
+    };
+
+    /**
+     * @brief decoded reply to (11) read motor state 1 and (12) clear errors
+     */
+    struct Error_state
+    {
+        // motor temperature in degree C
+        int8_t temperature = 0;
+        // supply voltage in 0.1V/LSB
+        uint16_t voltage = 0;
+        // error flags, see Error_flag
+        uint8_t error = 0;
+    };
+
+    /**
+     * @brief decode the reply to (11) read motor state 1 or (12) clear errors
+     *
+     * @param in pointer to the frame
+     * @param state decoded state
+     * @return true if the frame is OK
+     */
+    inline bool Decode_error_state(const uint8_t *in, Error_state &state)
+    {
+        if (!Check_reply(in, REPLY_ERROR_STATE))
+        {
+            return false;
+        }
+
+        state.temperature = int8_t(in[5]);
+        state.voltage = Get_le<uint16_t>(in + 7);
+        state.error = in[11];
+        return true;
+    }
+
+    /**
+     * @brief decoded reply to (14) read motor state 3
+     */
+    struct Phase_currents
+    {
+        // motor temperature in degree C
+        int8_t temperature = 0;
+        // phase currents in 1A/64LSB
+        int16_t a = 0;
+        int16_t b = 0;
+        int16_t c = 0;
+    };
+
+    /**
+     * @brief decode the reply to (14) read motor state 3
+     *
+     * @param in pointer to the frame
+     * @param currents decoded currents
+     * @return true if the frame is OK
+     */
+    inline bool Decode_phase_currents(const uint8_t *in, Phase_currents &currents)
+    {
+        if (!Check_reply(in, REPLY_PHASE_CURRENTS))
+        {
+            return false;
+        }
+
+        currents.temperature = int8_t(in[5]);
+        currents.a = Get_le<int16_t>(in + 6);
+        currents.b = Get_le<int16_t>(in + 8);
+        currents.c = Get_le<int16_t>(in + 10);
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,253 @@
+/**
+ * @file seqlock.hpp
+ * @brief single value that is written rarely and read often from other
+ * threads, without locks on the read side
+ *
+ * @note the writer makes the sequence odd, stores the value, then makes it
+ * even again. a reader copies the value out between two loads of the
+ * sequence and retries if they differ or are odd, so it never sees half of
+ * one write and half of another. readers never block the writer.
+ * @note the value is kept in atomic words and copied with relaxed atomics,
+ * so a reader racing with the writer is not a data race.
+ * @note Seqlock_ring keeps the last few values of one writer, so that a
+ * reader of a big value seldom has to retry.
+ */
+#ifndef _SEQLOCK_HPP_
+#define _SEQLOCK_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace Motor
+{
+    /**
+     * @brief value guarded by a sequence lock
+     *
+     * @tparam T value type, must be trivially copyable
+     */
+    template <typename T>
+    class Seqlock
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "value must be trivially copyable");
+
+    public:
+        Seqlock()
+        {
+            sequence.store(0, std::memory_order_relaxed);
+            Store_words(T());
+        }
+
+        Seqlock(const Seqlock &) = delete;
+        Seqlock &operator=(const Seqlock &) = delete;
+
+        /**
+         * @brief replace the value
+         *
+         * @param value new value
+         * @return uint64_t number of writes so far, including this one
+         *
+         * @note several writers are fine, they take turns on the sequence.
+         */
+        uint64_t Write(const T &value)
+        {
+            uint64_t seq = Claim();
+            Store_words(value);
+            return Release(seq);
+        }
+
+        /**
+         * @brief change the value based on what it is now
+         *
+         * @param modify called with the current value to change, should be
+         * short since readers spin meanwhile
+         * @return uint64_t number of writes so far, including this one
+         *
+         * @note no other write could come in between reading and writing.
+         */
+        template <typename F>
+        uint64_t Update(F modify)
+        {
+            uint64_t seq = Claim();
+            T value;
+            Load_words(value);
+            modify(value);
+            Store_words(value);
+            return Release(seq);
+        }
+
+        /**
+         * @brief get a consistent copy of the value
+         *
+         * @param value output value
+         * @return uint64_t number of writes the value reflects, 0 if never
+         * written
+         */
+        uint64_t Read(T &value) const
+        {
+            while (true)
+            {
+                uint64_t seq0 = sequence.load(std::memory_order_acquire);
+                if (seq0 & 1)
+                {
+                    continue;
+                }
+
+                Load_words(value);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == seq0)
+                {
+                    return seq0 / 2;
+                }
+            }
+        }
+
+        /**
+         * @brief number of writes so far, cheaper than Read() to tell
+         * whether anything new has arrived
+         */
+        uint64_t Writes() const
+        {
+            return sequence.load(std::memory_order_acquire) / 2;
+        }
+
+    private:
+        /**
+         * @brief claim the sequence for writing by making it odd
+         *
+         * @return uint64_t the sequence before claiming
+         */
+        uint64_t Claim()
+        {
+            uint64_t seq = sequence.load(std::memory_order_relaxed);
+            while ((seq & 1) || !sequence.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                seq = sequence.load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            return seq;
+        }
+
+        /**
+         * @brief publish the write by making the sequence even again
+         *
+         * @param seq what Claim() returned
+         * @return uint64_t number of writes so far
+         */
+        uint64_t Release(const uint64_t seq)
+        {
+            sequence.store(seq + 2, std::memory_order_release);
+            return (seq + 2) / 2;
+        }
+
+        static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        void Store_words(const T &value)
+        {
+            uint64_t buf[word_count] = {};
+            memcpy(buf, &value, sizeof(T));
+            for (size_t i = 0; i < word_count; i++)
+            {
+                words[i].store(buf[i], std::memory_order_relaxed);
+            }
+        }
+
+        void Load_words(T &value) const
+        {
+            uint64_t buf[word_count];
+            for (size_t i = 0; i < word_count; i++)
+            {
+                buf[i] = words[i].load(std::memory_order_relaxed);
+            }
+            memcpy(&value, buf, sizeof(T));
+        }
+
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> words[word_count];
+    };
+
+    /**
+     * @brief ring of the latest values from one writer, read without locks
+     *
+     * @tparam T value type, must be trivially copyable
+     * @tparam N number of slots
+     *
+     * @note every slot is a Seqlock and the count of pushes is published
+     * after the slot is written. a reader of the latest value copies a slot
+     * the writer is not in unless it falls N pushes behind, then it sees the
+     * slot has moved on from the push it wanted and tries the latest again.
+     */
+    template <typename T, size_t N>
+    class Seqlock_ring
+    {
+        static_assert(N > 1, "ring needs at least 2 slots");
+
+    public:
+        Seqlock_ring()
+        {
+            pushes.store(0, std::memory_order_relaxed);
+        }
+
+        Seqlock_ring(const Seqlock_ring &) = delete;
+        Seqlock_ring &operator=(const Seqlock_ring &) = delete;
+
+        /**
+         * @brief publish a new value
+         *
+         * @param value new value
+         * @return uint64_t number of pushes so far, including this one
+         *
+         * @note only one thread may push.
+         */
+        uint64_t Push(const T &value)
+        {
+            uint64_t n = pushes.load(std::memory_order_relaxed);
+            slots[n % N].Write(value);
+            pushes.store(n + 1, std::memory_order_release);
+            return n + 1;
+        }
+
+        /**
+         * @brief get a consistent copy of the latest value
+         *
+         * @param value output value, T() if nothing is pushed yet
+         * @return uint64_t number of the push read, 1 for the first one and
+         * 0 if nothing is pushed yet
+         */
+        uint64_t Read_latest(T &value) const
+        {
+            while (true)
+            {
+                uint64_t n = pushes.load(std::memory_order_acquire);
+                if (n == 0)
+                {
+                    value = T();
+                    return 0;
+                }
+
+                // push n is the (n - 1) / N + 1 th write of its slot
+                if (slots[(n - 1) % N].Read(value) == (n - 1) / N + 1)
+                {
+                    return n;
+                }
+            }
+        }
+
+        /**
+         * @brief number of pushes so far
+         */
+        uint64_t Pushes() const
+        {
+            return pushes.load(std::memory_order_acquire);
+        }
+
+    private:
+        std::atomic<uint64_t> pushes;
+        Seqlock<T> slots[N];
+    };
+}
+
+#endif
@@ -0,0 +1,336 @@
+/**
+ * @file serial_transport.cpp
+ * @brief byte level serial port backends for the motor link
+ */
+#include "serial_transport.hpp"
+#include "motor.hpp"
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#if MOTOR_USE_PIGPIO
+#include <pigpio.h>
+#endif
+
+#define DEBUG_PRINT_ENABLED 0
+
+namespace Motor
+{
+    namespace
+    {
+        /**
+         * @brief convert baud rate to termios speed constant
+         *
+         * @param baud baud rate
+         * @return speed_t speed constant, B0 if not supported
+         */
+        speed_t Baud_to_speed(const int baud)
+        {
+            switch (baud)
+            {
+            case 9600:
+                return B9600;
+            case 19200:
+                return B19200;
+            case 38400:
+                return B38400;
+            case 57600:
+                return B57600;
+            case 115200:
+                return B115200;
+            case 230400:
+                return B230400;
+            case 460800:
+                return B460800;
+            case 921600:
+                return B921600;
+            case 1000000:
+                return B1000000;
+            case 2000000:
+                return B2000000;
+            default:
+                return B0;
+            }
+        }
+    }
+
+    Termios_transport::~Termios_transport()
+    {
+        Close();
+    }
+
+    /**
+     * @brief open serial port
+     *
+     * @param port path to the port, e.g. "/dev/ttyS0"
+     * @param baud baud rate
+     * @return 0 for OK and 1 for failed
+     */
+    int Termios_transport::Open(const char *port, const int baud)
+    {
+        Close();
+
+        speed_t speed = Baud_to_speed(baud);
+        if (speed == B0)
+        {
+#if DEBUG_PRINT_ENABLED
+            printf("Baud rate %d not supported!\n", baud);
+#endif
+            return 1;
+        }
+
+        fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+#if DEBUG_PRINT_ENABLED
+            printf("Serial %s open failed!\n", port);
+#endif
+            return 1;
+        }
+
+        termios tty;
+        if (tcgetattr(fd, &tty) != 0)
+        {
+            Close();
+            return 1;
+        }
+
+        // raw 8N1, no flow control
+        cfmakeraw(&tty);
+        tty.c_cflag |= (CLOCAL | CREAD);
+        tty.c_cflag &= ~(CSTOPB | CRTSCTS | PARENB);
+        tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+        // read() returns at once with whatever is there, waiting is done by ppoll()
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 0;
+
+        cfsetispeed(&tty, speed);
+        cfsetospeed(&tty, speed);
+
+        if (tcsetattr(fd, TCSANOW, &tty) != 0)
+        {
+            Close();
+            return 1;
+        }
+
+#ifdef ASYNC_LOW_LATENCY
+        // not every driver supports this (e.g. pseudo terminals), failure is fine
+        serial_struct ser;
+        if (ioctl(fd, TIOCGSERIAL, &ser) == 0)
+        {
+            ser.flags |= ASYNC_LOW_LATENCY;
+            ioctl(fd, TIOCSSERIAL, &ser);
+        }
+#endif
+
+        Flush_input();
+
+#if DEBUG_PRINT_ENABLED
+        printf("Serial %s opened at baud rate of %d.\n", port, baud);
+#endif
+        return 0;
+    }
+
+    /**
+     * @brief close serial port
+     */
+    void Termios_transport::Close()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    /**
+     * @brief write all bytes to serial
+     *
+     * @param data bytes to write
+     * @param len number of bytes
+     * @return true if all bytes are written
+     */
+    bool Termios_transport::Write(const uint8_t *data, const size_t len)
+    {
+        size_t written = 0;
+        while (written < len)
+        {
+            ssize_t n = write(fd, data + written, len - written);
+            if (n > 0)
+            {
+                written += size_t(n);
+            }
+            else if (n < 0 && errno == EAGAIN)
+            {
+                // output buffer full, wait for it to drain
+                pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, 10);
+            }
+            else if (n < 0 && errno != EINTR)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief read whatever has arrived, wait until deadline if nothing has
+     *
+     * @param data output buffer
+     * @param len size of output buffer
+     * @param deadline absolute time in us (see Get_time()) to give up
+     * @return int number of bytes read, 0 if timed out, -1 if failed
+     */
+    int Termios_transport::Read(uint8_t *data, const size_t len, const int64_t deadline)
+    {
+        while (true)
+        {
+            ssize_t n = read(fd, data, len);
+            if (n > 0)
+            {
+                return int(n);
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                return -1;
+            }
+
+            int64_t remaining = deadline - Get_time();
+            if (remaining <= 0)
+            {
+                return 0;
+            }
+
+            pollfd pfd = {fd, POLLIN, 0};
+            timespec ts = {time_t(remaining / 1000000), long((remaining % 1000000) * 1000)};
+            if (ppoll(&pfd, 1, &ts, nullptr) < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+        }
+    }
+
+    /**
+     * @brief throw away everything in the input buffer
+     */
+    void Termios_transport::Flush_input()
+    {
+        tcflush(fd, TCIFLUSH);
+    }
+
+#if MOTOR_USE_PIGPIO
+    /**
+     * @brief open serial port
+     *
+     * @param port path to the port, e.g. "/dev/ttyS0"
+     * @param baud baud rate
+     * @return 0 for OK and 1 for failed
+     *
+     * @note also executes gpioInitialise()
+     */
+    int Pigpio_transport::Open(const char *port, const int baud)
+    {
+        // init GPIO
+        if (gpioInitialise() < 0)
+        {
+#if DEBUG_PRINT_ENABLED
+            printf("GPIO init failed!\n");
+#endif
+            return 1;
+        }
+
+#if DEBUG_PRINT_ENABLED
+        printf("GPIO init successful!\n");
+#endif
+
+        // open serial
+        handle = serOpen((char *)port, baud, 0);
+        if (handle >= 0)
+        {
+#if DEBUG_PRINT_ENABLED
+            printf("Serial %s opened at baud rate of %d.\n", port, baud);
+#endif
+            return 0;
+        }
+
+#if DEBUG_PRINT_ENABLED
+        printf("Serial %s open failed!\n", port);
+#endif
+        return 1;
+    }
+
+    /**
+     * @brief close serial port
+     */
+    void Pigpio_transport::Close()
+    {
+        if (handle >= 0)
+        {
+            serClose(handle);
+            handle = -1;
+        }
+    }
+
+    /**
+     * @brief write all bytes to serial
+     *
+     * @param data bytes to write
+     * @param len number of bytes
+     * @return true if all bytes are written
+     */
+    bool Pigpio_transport::Write(const uint8_t *data, const size_t len)
+    {
+        return serWrite(handle, (char *)data, len) == 0;
+    }
+
+    /**
+     * @brief read whatever has arrived, wait until deadline if nothing has
+     *
+     * @param data output buffer
+     * @param len size of output buffer
+     * @param deadline absolute time in us (see Get_time()) to give up
+     * @return int number of bytes read, 0 if timed out, -1 if failed
+     *
+     * @note pigpio has no blocking read, so this spins on serDataAvailable()
+     */
+    int Pigpio_transport::Read(uint8_t *data, const size_t len, const int64_t deadline)
+    {
+        while (true)
+        {
+            int avail = serDataAvailable(handle);
+            if (avail > 0)
+            {
+                int n = serRead(handle, (char *)data, (size_t(avail) < len) ? avail : len);
+                return (n >= 0) ? n : -1;
+            }
+            if (avail < 0)
+            {
+                return -1;
+            }
+            if (Get_time() >= deadline)
+            {
+                return 0;
+            }
+        }
+    }
+
+    /**
+     * @brief throw away everything in the input buffer
+     */
+    void Pigpio_transport::Flush_input()
+    {
+        while (serDataAvailable(handle) > 0)
+        {
+            serReadByte(handle);
+        }
+    }
+#endif
+}
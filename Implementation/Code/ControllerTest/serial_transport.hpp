@@ -0,0 +1,121 @@
+/**
+ * @file serial_transport.hpp
+ * @brief byte level serial port backends for the motor link
+ *
+ * @note two backends are available: a native termios one that works on any
+ * linux tty (including pseudo terminals) and sleeps in the kernel while
+ * waiting, and a pigpio one that busy-polls through pigpio's wrappers.
+ * define MOTOR_USE_PIGPIO to 0 to build without pigpio.
+ */
+#ifndef _SERIAL_TRANSPORT_HPP_
+#define _SERIAL_TRANSPORT_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MOTOR_USE_PIGPIO
+#define MOTOR_USE_PIGPIO 1
+#endif
+
+namespace Motor
+{
+    enum Transport_type
+    {
+        TRANSPORT_TERMIOS = 0,
+        TRANSPORT_PIGPIO
+    };
+
+    /**
+     * @brief interface of a serial backend
+     */
+    class Serial_transport
+    {
+    public:
+        virtual ~Serial_transport() {}
+
+        /**
+         * @brief open serial port
+         *
+         * @param port path to the port, e.g. "/dev/ttyS0"
+         * @param baud baud rate
+         * @return 0 for OK and 1 for failed
+         */
+        virtual int Open(const char *port, const int baud) = 0;
+
+        /**
+         * @brief close serial port
+         */
+        virtual void Close() = 0;
+
+        /**
+         * @brief write all bytes to serial
+         *
+         * @param data bytes to write
+         * @param len number of bytes
+         * @return true if all bytes are written
+         */
+        virtual bool Write(const uint8_t *data, const size_t len) = 0;
+
+        /**
+         * @brief read whatever has arrived, wait until deadline if nothing has
+         *
+         * @param data output buffer
+         * @param len size of output buffer
+         * @param deadline absolute time in us (see Get_time()) to give up
+         * @return int number of bytes read, 0 if timed out, -1 if failed
+         */
+        virtual int Read(uint8_t *data, const size_t len, const int64_t deadline) = 0;
+
+        /**
+         * @brief throw away everything in the input buffer
+         */
+        virtual void Flush_input() = 0;
+    };
+
+    /**
+     * @brief native linux backend based on termios and ppoll()
+     *
+     * @note the port is put in raw mode with VMIN = VTIME = 0, so read()
+     * returns immediately with whatever is in the buffer. VTIME only has
+     * 0.1s resolution which is far too coarse for a 5ms transaction, so the
+     * waiting is done in ppoll() which has us resolution instead.
+     * @note ASYNC_LOW_LATENCY is set where the driver supports it, which
+     * stops the driver from batching bytes before waking us up.
+     */
+    class Termios_transport : public Serial_transport
+    {
+    public:
+        ~Termios_transport();
+
+        int Open(const char *port, const int baud) override;
+        void Close() override;
+        bool Write(const uint8_t *data, const size_t len) override;
+        int Read(uint8_t *data, const size_t len, const int64_t deadline) override;
+        void Flush_input() override;
+
+    private:
+        int fd = -1;
+    };
+
+#if MOTOR_USE_PIGPIO
+    /**
+     * @brief pigpio backend, busy-polls serDataAvailable()
+     *
+     * @note also executes gpioInitialise() when opened
+     */
+    class Pigpio_transport : public Serial_transport
+    {
+    public:
+        int Open(const char *port, const int baud) override;
+        void Close() override;
+        bool Write(const uint8_t *data, const size_t len) override;
+        int Read(uint8_t *data, const size_t len, const int64_t deadline) override;
+        void Flush_input() override;
+
+    private:
+        int handle = -1;
+    };
+#endif
+}
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * @file thermal_model.hpp
+ * @brief estimate the motor temperature minutes ahead from the feedback and
+ * derate the drive speed to stay under a limit
+ *
+ * @note the motor is one thermal mass: it heats up with the square of its
+ * torque current and cools down towards ambient with time constant tau,
+ * dT/dt = (ambient + rise * heat - T) / tau, where heat is the torque current
+ * squared as a fraction of full output. the rise at full output depends on
+ * the motor and its mounting, so it is learned online by matching the model
+ * to the temperature in the feedback. MS series motors report output power
+ * instead of torque current, set full_output to 1000 for them.
+ * @note the temperature in the feedback is in whole degrees, so the model is
+ * run on the current and only nudged by the readings.
+ * @note the prediction assumes the heat keeps going as it did on average
+ * lately. the heat is fitted as proportional to the square of the velocity,
+ * so the highest velocity that stays under the limit at the end of the
+ * horizon follows, and the derate is that over max_speed, low passed so that
+ * the speed limit does not jump around.
+ */
+#ifndef _THERMAL_MODEL_HPP_
+#define _THERMAL_MODEL_HPP_
+
+#include "motor.hpp"
+#include <cmath>
+#include <cstdint>
+
+namespace Motor
+{
+    // heat below this is too little to learn from or fit to the velocity
+    constexpr float thermal_heat_floor = 1.0e-3F;
+
+    struct Thermal_config
+    {
+        // torque current in the feedback at full output, 2048 for MF and MG
+        // series, 1000 for MS series which report power
+        float full_output = 1000.0F;
+        // highest temperature allowed at the end of the horizon in degree C,
+        // under the 80 degree C over-temperature protection of the motor
+        float limit = 70.0F;
+        // thermal time constant of the motor in s
+        float tau = 300.0F;
+        // first guess of the temperature rise at full output in degree C
+        float full_output_rise = 60.0F;
+        // how far ahead to predict in s
+        float horizon = 180.0F;
+        // time constant of the average heat and velocity in s
+        float usage_tau = 30.0F;
+        // time constant of learning the rise at full output in s
+        float learning_tau = 60.0F;
+        // nominal max speed in dps, the derate is relative to it
+        float max_speed = 240.0F;
+        // the derate never goes below this
+        float min_derate = 0.3F;
+        // time constant of the derate in s
+        float derate_tau = 5.0F;
+    };
+
+    // output of Thermal_estimator
+    struct Thermal_estimate
+    {
+        // local time in us of the last feedback, 0 if nothing has arrived yet
+        int64_t timestamp = 0;
+        // temperature of the model now in degree C
+        float temperature = 0.0F;
+        // temperature at the end of the horizon at the average heat
+        float predicted = 0.0F;
+        // ambient, the lowest temperature seen
+        float ambient = 0.0F;
+        // learned temperature rise at full output in degree C
+        float full_output_rise = 0.0F;
+        // highest sustained velocity that stays under the limit in dps,
+        // negative if not known yet
+        float sustained_speed = -1.0F;
+        // scale of the max speed, from min_derate to 1
+        float derate = 1.0F;
+    };
+
+    /**
+     * @brief lumped thermal model of one motor, learned from its feedback
+     */
+    class Thermal_estimator
+    {
+    public:
+        explicit Thermal_estimator(const Thermal_config &config = Thermal_config())
+        {
+            Set_config(config);
+        }
+
+        /**
+         * @brief change the config, keeps what has been learned
+         */
+        void Set_config(const Thermal_config &config)
+        {
+            this->config = config;
+            if (!started)
+            {
+                rise = config.full_output_rise;
+                est.full_output_rise = config.full_output_rise;
+            }
+        }
+
+        /**
+         * @brief feed the latest feedback
+         *
+         * @param state state of the motor, see Get_motor_state()
+         * @return true if the estimate is updated, false if the state is not
+         * newer than the last one
+         */
+        bool Update(const Motor_state &state)
+        {
+            if (state.sequence == 0 || (started && state.timestamp <= est.timestamp))
+            {
+                return false;
+            }
+
+            double measured = double(state.feedback.temperature);
+            double u = double(state.feedback.torque_current) / double(config.full_output);
+            double heat = (u * u > 1.0) ? 1.0 : (u * u);
+            double v = double(state.feedback.velocity);
+
+            if (!started)
+            {
+                // a motor that has just been switched on is at ambient
+                started = true;
+                est.timestamp = state.timestamp;
+                temperature = measured;
+                ambient = measured;
+                rise = config.full_output_rise;
+                sensitivity = 0.0;
+                heat_avg = heat;
+                speed2_avg = v * v;
+                heat_per_speed2 = 0.0;
+                predicted = measured;
+                est.derate = 1.0F;
+                est.sustained_speed = -1.0F;
+                Publish();
+                return true;
+            }
+
+            // the feedback could be 1kHz and tau minutes, so all in double
+            double dt = double(state.timestamp - est.timestamp) * 1.0e-6;
+            est.timestamp = state.timestamp;
+            ambient = (measured < ambient) ? measured : ambient;
+
+            // the model and its derivative by the rise at full output
+            double a = Fraction(dt, config.tau);
+            temperature += a * (ambient + rise * heat - temperature);
+            sensitivity += a * (heat - sensitivity);
+
+            // normalized gradient step on the rise at full output, the
+            // readings are whole degrees so half a degree off is no error
+            double error = measured - temperature;
+            double dead = (error > 0.5) ? (error - 0.5) : ((error < -0.5) ? (error + 0.5) : 0.0);
+            double l = Fraction(dt, config.learning_tau);
+            rise += l * dead * sensitivity / (sensitivity * sensitivity + thermal_heat_floor);
+            rise = (rise < 1.0) ? 1.0 : rise;
+            // and the model is pulled towards the readings
+            temperature += l * dead;
+
+            double b = Fraction(dt, config.usage_tau);
+            heat_avg += b * (heat - heat_avg);
+            speed2_avg += b * (v * v - speed2_avg);
+
+            Predict(dt);
+            Publish();
+            return true;
+        }
+
+        /**
+         * @brief the latest estimate
+         */
+        const Thermal_estimate &Get() const
+        {
+            return est;
+        }
+
+        /**
+         * @brief scale of the max speed, from min_derate to 1
+         */
+        float Derate() const
+        {
+            return est.derate;
+        }
+
+    private:
+        Thermal_config config;
+        Thermal_estimate est;
+        bool started = false;
+
+        // model temperature and ambient in degree C
+        double temperature = 0.0, ambient = 0.0;
+        // temperature rise at full output and the derivative of the model
+        // temperature by it
+        double rise = 0.0, sensitivity = 0.0;
+        // average heat, and average velocity squared in dps^2
+        double heat_avg = 0.0, speed2_avg = 0.0;
+        // heat per velocity squared, 0 if not fitted yet
+        double heat_per_speed2 = 0.0;
+        double predicted = 0.0;
+
+        /**
+         * @brief step of a first order low pass
+         */
+        static double Fraction(const double dt, const double tau)
+        {
+            return (tau > dt) ? (dt / tau) : 1.0;
+        }
+
+        /**
+         * @brief predict the end of the horizon and update the derate
+         */
+        void Predict(const double dt)
+        {
+            double decay = std::exp(-double(config.horizon) / double(config.tau));
+            double steady = ambient + rise * heat_avg;
+            predicted = steady + (temperature - steady) * decay;
+
+            // the heat that would end the horizon right at the limit
+            double heat_max = (config.limit - ambient - (temperature - ambient) * decay) / (rise * (1.0 - decay));
+
+            if (heat_avg > thermal_heat_floor && speed2_avg > 1.0)
+            {
+                heat_per_speed2 = heat_avg / speed2_avg;
+            }
+
+            double target = 1.0;
+            if (heat_max <= 0.0)
+            {
+                // too hot already, whatever the speed
+                est.sustained_speed = 0.0F;
+                target = 0.0;
+            }
+            else if (heat_per_speed2 > 0.0)
+            {
+                est.sustained_speed = float(std::sqrt(heat_max / heat_per_speed2));
+                target = double(est.sustained_speed) / double(config.max_speed);
+            }
+            target = (target > 1.0) ? 1.0 : ((target < config.min_derate) ? config.min_derate : target);
+
+            est.derate += float(Fraction(dt, config.derate_tau) * (target - double(est.derate)));
+        }
+
+        void Publish()
+        {
+            est.temperature = float(temperature);
+            est.predicted = float(predicted);
+            est.ambient = float(ambient);
+            est.full_output_rise = float(rise);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,324 @@
+/**
+ * @file velocity_loop.cpp
+ * @brief velocity loop on the host, driving the motor in power or torque
+ */
+#include "velocity_loop.hpp"
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <mutex>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace Motor
+{
+    namespace
+    {
+        // deadlines do not count until the first fresh feedback arrives or
+        // this long after Start() in us
+        constexpr int64_t startup_grace_us = 100000;
+
+        // loops on the host need the bus to poll at their rate. the first one
+        // to start saves the settings of the bus, the last one to stop or
+        // fall back puts them back
+        std::mutex polling_mutex;
+        int polling_users = 0;
+        bool saved_polling = false;
+        float saved_poll_rate = 0.0F;
+        float polling_rate = 0.0F;
+
+        /**
+         * @brief have the bus poll at least at a rate until Release_polling()
+         */
+        void Claim_polling(const float rate)
+        {
+            std::lock_guard<std::mutex> lock(polling_mutex);
+            if (polling_users++ == 0)
+            {
+                saved_polling = Bus_get_polling();
+                saved_poll_rate = Bus_get_poll_rate();
+                polling_rate = 0.0F;
+            }
+            polling_rate = (rate > polling_rate) ? rate : polling_rate;
+            Bus_set_polling(true);
+            Bus_set_poll_rate(polling_rate);
+        }
+
+        /**
+         * @brief give back a Claim_polling()
+         */
+        void Release_polling()
+        {
+            std::lock_guard<std::mutex> lock(polling_mutex);
+            if (--polling_users == 0)
+            {
+                Bus_set_polling(saved_polling);
+                Bus_set_poll_rate(saved_poll_rate);
+            }
+        }
+
+        /**
+         * @brief sleep until a time from Get_time()
+         */
+        void Sleep_until(const int64_t time)
+        {
+            timespec ts;
+            ts.tv_sec = time_t(time / 1000000);
+            ts.tv_nsec = long(time % 1000000) * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+            {
+            }
+        }
+    }
+
+    /**
+     * @param id motor ID, 1~32
+     */
+    Velocity_loop::Velocity_loop(const uint8_t id) : motor(id), polling(false), running(false), mode(LOOP_STOPPED), rearm(false), target(0.0F),
+                                                     ticks(0), late(0), stale(0), rejected(0), fallbacks(0), max_lateness(0)
+    {
+    }
+
+    /**
+     * @brief stops the loop, see Stop()
+     */
+    Velocity_loop::~Velocity_loop()
+    {
+        Stop();
+    }
+
+    /**
+     * @brief launch the loop thread
+     *
+     * @param config gains, rate and deadlines
+     * @return true if started, false if already running, the bus is not
+     * open or the config is invalid
+     *
+     * @note the target starts at 0 and the loop on the host.
+     * @note the bus polls at the loop rate while the loop is on the host, and
+     * goes back to its settings from before once no loop is.
+     */
+    bool Velocity_loop::Start(const Loop_config &config)
+    {
+        if (running.load(std::memory_order_acquire) || !(config.rate > 0.0F) || config.max_output <= 0 || config.fallback_misses < 1)
+        {
+            return false;
+        }
+
+        // fails if the bus is not open
+        if (!Bus_add_motor(motor.ID()))
+        {
+            return false;
+        }
+        Claim_polling(config.rate);
+        polling = true;
+
+        this->config = config;
+        target = 0.0F;
+        rearm = false;
+        ticks = 0;
+        late = 0;
+        stale = 0;
+        rejected = 0;
+        fallbacks = 0;
+        max_lateness = 0;
+
+        mode.store(LOOP_HOST, std::memory_order_relaxed);
+        running.store(true, std::memory_order_release);
+        thread = std::thread(&Velocity_loop::Run, this);
+        return true;
+    }
+
+    /**
+     * @brief stop the loop thread and wait for it
+     *
+     * @note the last output stays in force, pause or stop the motor
+     * after this.
+     */
+    void Velocity_loop::Stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+
+        thread.join();
+        mode.store(LOOP_STOPPED, std::memory_order_relaxed);
+        if (polling)
+        {
+            Release_polling();
+            polling = false;
+        }
+    }
+
+    /**
+     * @brief set the target velocity
+     *
+     * @param velocity target in dps
+     *
+     * @note never blocks, safe to call from any thread.
+     */
+    void Velocity_loop::Set_velocity(const float velocity)
+    {
+        target.store(velocity, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief take the loop back from the motor after a fallback
+     *
+     * @return true if the loop is running on the host now
+     */
+    bool Velocity_loop::Rearm()
+    {
+        int expected = LOOP_FALLBACK;
+        if (mode.compare_exchange_strong(expected, LOOP_HOST))
+        {
+            rearm.store(true, std::memory_order_release);
+            return true;
+        }
+        return expected == LOOP_HOST;
+    }
+
+    /**
+     * @brief who runs the velocity loop now
+     */
+    Loop_mode Velocity_loop::Mode() const
+    {
+        return Loop_mode(mode.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief counters since Start()
+     */
+    Loop_stats Velocity_loop::Get_stats() const
+    {
+        Loop_stats stats;
+        stats.ticks = ticks.load(std::memory_order_relaxed);
+        stats.late = late.load(std::memory_order_relaxed);
+        stats.stale = stale.load(std::memory_order_relaxed);
+        stats.rejected = rejected.load(std::memory_order_relaxed);
+        stats.fallbacks = fallbacks.load(std::memory_order_relaxed);
+        stats.max_lateness = max_lateness.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief loop thread, one tick per period
+     */
+    void Velocity_loop::Run()
+    {
+        if (config.priority > 0)
+        {
+            // needs root, the loop runs anyway and the deadlines tell
+            sched_param param;
+            param.sched_priority = config.priority;
+            pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        }
+
+        const int64_t period = int64_t(1000000.0F / config.rate);
+        const int64_t lateness_limit = (config.max_lateness > 0) ? config.max_lateness : (period / 2);
+        const int64_t age_limit = (config.max_feedback_age > 0) ? config.max_feedback_age : (3 * period);
+        const float limit = float(config.max_output);
+
+        int64_t start = Get_time();
+        int64_t due = start;
+        int64_t last_tick = start;
+        bool synced = false;
+        float integral = 0.0F;
+        int misses = 0;
+
+        while (running.load(std::memory_order_acquire))
+        {
+            Sleep_until(due);
+            int64_t now = Get_time();
+            int64_t lateness = now - due;
+            float dt = float(now - last_tick) * 1.0e-6F;
+            last_tick = now;
+
+            // periods slept through are skipped, not made up
+            due += (lateness / period + 1) * period;
+
+            ticks.fetch_add(1, std::memory_order_relaxed);
+            if (lateness > max_lateness.load(std::memory_order_relaxed))
+            {
+                max_lateness.store(lateness, std::memory_order_relaxed);
+            }
+
+            float velocity = target.load(std::memory_order_relaxed);
+            if (rearm.exchange(false, std::memory_order_acquire))
+            {
+                integral = 0.0F;
+                misses = 0;
+
+                // feedback was slow during the fallback, give it the grace of
+                // a start to come up to rate
+                Claim_polling(config.rate);
+                polling = true;
+                start = now;
+                synced = false;
+            }
+
+            if (mode.load(std::memory_order_relaxed) == LOOP_FALLBACK)
+            {
+                // the motor runs the loop, only pass the target on. the bus
+                // drops it if unchanged
+                motor.Set_velocity(int32_t(std::lround(velocity * 100.0F)));
+                continue;
+            }
+
+            bool miss = false;
+            if (lateness > lateness_limit)
+            {
+                late.fetch_add(1, std::memory_order_relaxed);
+                miss = true;
+            }
+
+            Motion_sample sample = motor.Get_motion();
+            bool fresh = sample.sequence != 0 && now - sample.timestamp <= age_limit;
+            synced = synced || fresh;
+
+            if (!fresh)
+            {
+                // the output is held, sending it again would not help
+                if (synced || now - start >= startup_grace_us)
+                {
+                    stale.fetch_add(1, std::memory_order_relaxed);
+                    miss = true;
+                }
+            }
+            else
+            {
+                float error = velocity - sample.velocity;
+                float out = config.feedforward * velocity + config.kp * error + integral;
+
+                // stop integrating while saturated, unless it unwinds
+                if ((out < limit || error < 0.0F) && (out > -limit || error > 0.0F))
+                {
+                    integral += config.ki * error * dt;
+                }
+                out = (out > limit) ? limit : ((out < -limit) ? -limit : out);
+
+                int16_t value = int16_t(std::lround(out));
+                bool queued = (config.output == LOOP_TORQUE) ? motor.Set_torque(value) : motor.Set_power(value);
+                if (!queued)
+                {
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                    miss = true;
+                }
+            }
+
+            misses = miss ? (misses + 1) : 0;
+            if (misses >= config.fallback_misses)
+            {
+                // the motor holds the target by itself from here
+                motor.Set_velocity(int32_t(std::lround(velocity * 100.0F)));
+                mode.store(LOOP_FALLBACK, std::memory_order_relaxed);
+                fallbacks.fetch_add(1, std::memory_order_relaxed);
+                misses = 0;
+                Release_polling();
+                polling = false;
+            }
+        }
+    }
+}
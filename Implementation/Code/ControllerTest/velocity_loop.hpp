@@ -0,0 +1,179 @@
+/**
+ * @file velocity_loop.hpp
+ * @brief velocity loop on the host, driving the motor in power or torque
+ *
+ * @note the velocity loop inside the motor (20) only gets a new setpoint as
+ * fast as we send it, and its gains are fixed for a load it does not know.
+ * instead, a thread here samples the estimated velocity of the bus (see
+ * Get_motion()) at 1kHz or more and sends power (18) or torque (19) through
+ * the bus. the replies bring the feedback for the next tick.
+ * @note the loop only works as long as it keeps its deadlines. a tick misses
+ * its deadline if it wakes up late, if the feedback is older than it should
+ * be, or if the bus would not take the output. after fallback_misses misses
+ * in a row, it hands the target over to the velocity loop of the motor and
+ * stays there until Rearm().
+ * @note the bus should be open, the loop enables polling at its own rate so
+ * that the feedback keeps coming when the output does not change. setpoints
+ * are coalesced by the bus, so Bus_set_rate_limit() also caps the loop.
+ * @note the loop never stops the motor by itself, stop the loop before
+ * pausing or stopping the motor, or it would start it again.
+ */
+#ifndef _VELOCITY_LOOP_HPP_
+#define _VELOCITY_LOOP_HPP_
+
+#include "motor.hpp"
+#include "motor_bus.hpp"
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace Motor
+{
+    // what the host loop sends to the motor
+    enum Loop_output
+    {
+        LOOP_POWER = 0, // (18) open loop power, -1000~1000
+        LOOP_TORQUE     // (19) torque current, -2000~2000, MF and MG series only
+    };
+
+    // who runs the velocity loop
+    enum Loop_mode
+    {
+        LOOP_STOPPED = 0, // nobody, the loop thread is not running
+        LOOP_HOST,        // the loop thread, on power or torque
+        LOOP_FALLBACK     // the motor, on velocity control (20)
+    };
+
+    struct Loop_config
+    {
+        // ticks per second
+        float rate = 1000.0F;
+        Loop_output output = LOOP_POWER;
+
+        // output per dps of error, output per dps of integrated error per s,
+        // and output per dps of target
+        float kp = 1.0F;
+        float ki = 10.0F;
+        float feedforward = 0.0F;
+        // output is clamped to +-max_output
+        int16_t max_output = 500;
+
+        // a tick is late if it wakes up this long after it is due in us,
+        // 0 for half a period
+        int64_t max_lateness = 0;
+        // the feedback is stale if older than this in us, 0 for 3 periods
+        int64_t max_feedback_age = 0;
+        // misses in a row before falling back to the motor
+        int fallback_misses = 5;
+
+        // SCHED_FIFO priority of the loop thread, 0 to leave it alone
+        int priority = 0;
+    };
+
+    // counters of the loop, accumulated since Start()
+    struct Loop_stats
+    {
+        uint64_t ticks = 0;
+        // ticks that woke up late
+        uint64_t late = 0;
+        // ticks that found the feedback stale
+        uint64_t stale = 0;
+        // outputs the bus would not take
+        uint64_t rejected = 0;
+        // times the loop fell back to the motor
+        uint64_t fallbacks = 0;
+        // latest wake up after a tick was due in us
+        int64_t max_lateness = 0;
+    };
+
+    /**
+     * @brief velocity loop of one motor, run by a thread of its own
+     */
+    class Velocity_loop
+    {
+    public:
+        /**
+         * @param id motor ID, 1~32
+         */
+        explicit Velocity_loop(const uint8_t id = Motor_ID);
+
+        /**
+         * @brief stops the loop, see Stop()
+         */
+        ~Velocity_loop();
+
+        Velocity_loop(const Velocity_loop &) = delete;
+        Velocity_loop &operator=(const Velocity_loop &) = delete;
+
+        /**
+         * @brief launch the loop thread
+         *
+         * @param config gains, rate and deadlines
+         * @return true if started, false if already running, the bus is not
+         * open or the config is invalid
+         *
+         * @note the target starts at 0 and the loop on the host.
+         * @note the bus polls at the loop rate while the loop is on the host,
+         * and goes back to its settings from before once no loop is.
+         */
+        bool Start(const Loop_config &config = Loop_config());
+
+        /**
+         * @brief stop the loop thread and wait for it
+         *
+         * @note the last output stays in force, pause or stop the motor
+         * after this.
+         */
+        void Stop();
+
+        /**
+         * @brief set the target velocity
+         *
+         * @param velocity target in dps
+         *
+         * @note never blocks, safe to call from any thread.
+         */
+        void Set_velocity(const float velocity);
+
+        /**
+         * @brief take the loop back from the motor after a fallback
+         *
+         * @return true if the loop is running on the host now
+         */
+        bool Rearm();
+
+        /**
+         * @brief who runs the velocity loop now
+         */
+        Loop_mode Mode() const;
+
+        /**
+         * @brief counters since Start()
+         */
+        Loop_stats Get_stats() const;
+
+    private:
+        void Run();
+
+        Motor_handle motor;
+        Loop_config config;
+        std::thread thread;
+        // whether this loop holds a claim on bus polling, only touched by
+        // the loop thread while it runs
+        bool polling;
+
+        std::atomic<bool> running;
+        std::atomic<int> mode;
+        std::atomic<bool> rearm;
+        std::atomic<float> target;
+
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint64_t> late;
+        std::atomic<uint64_t> stale;
+        std::atomic<uint64_t> rejected;
+        std::atomic<uint64_t> fallbacks;
+        std::atomic<int64_t> max_lateness;
+    };
+}
+
+#endif
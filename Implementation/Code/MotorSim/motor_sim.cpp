@@ -0,0 +1,757 @@
+/**
+ * @file motor_sim.cpp
+ * @brief a virtual MS5010 motor that speaks the Km-tech RS485 protocol on a
+ * pseudo terminal, used in place of the real motor for tests and benchmarks.
+ *
+ * @note the serial line is emulated by pacing every byte by 10 bit times of
+ * the given baud rate (pseudo terminals ignore baud rate), plus an optional
+ * extra latency per byte. faults could be injected on the reply.
+ * @note with baud rate 0 the sim follows whatever baud rate the client set
+ * on the pty, so a baud rate sweep needs no restart.
+ */
+#define _USE_MATH_DEFINES
+#include "motor.hpp"
+#include "motor_frame.hpp"
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace Motor;
+
+namespace
+{
+    /********************************* options *********************************/
+
+    struct Options
+    {
+        // symlink to create for the pty slave, empty for none
+        const char *link = nullptr;
+        // ID of the first motor
+        uint8_t id = 0x01;
+        // number of motors, with consecutive IDs
+        int count = 1;
+        // emulated baud rate, 0 to follow the pty
+        int baud = 115200;
+        // additional latency per byte in us
+        int byte_latency_us = 0;
+        // processing time of the driver before replying in us
+        int response_delay_us = 200;
+        // time constant of the velocity loop in ms
+        double tau_ms = 50.0;
+        // output it takes to hold every dps against friction
+        double friction = 0.2;
+        // thermal time constant in s
+        double thermal_tau_s = 300.0;
+        // probability to drop a reply
+        double drop_prob = 0.0;
+        // probability to corrupt one byte of a reply
+        double corrupt_prob = 0.0;
+        // probability to send a garbage byte before a reply
+        double garbage_prob = 0.0;
+        // random seed
+        unsigned seed = 0;
+        // print every frame
+        bool verbose = false;
+    } opt;
+
+    volatile sig_atomic_t quit = 0;
+
+    void On_signal(int)
+    {
+        quit = 1;
+    }
+
+    /********************************** time **********************************/
+
+    int64_t Now_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    }
+
+    /**
+     * @brief sleep until t_ns, spin for the last bit since the scheduler
+     * could not wake us up precisely enough for Mbps byte times.
+     */
+    void Sleep_until(const int64_t t_ns)
+    {
+        constexpr int64_t spin_ns = 60000;
+        int64_t remaining = t_ns - Now_ns();
+        if (remaining > spin_ns)
+        {
+            timespec ts = {time_t((t_ns - spin_ns) / 1000000000LL), long((t_ns - spin_ns) % 1000000000LL)};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+        }
+        while (Now_ns() < t_ns)
+        {
+        }
+    }
+
+    // baud rate in use
+    int baud = 115200;
+
+    // time to transmit one byte (start + 8 data + stop bits) in ns
+    int64_t Byte_time_ns()
+    {
+        return 10LL * 1000000000LL / baud + int64_t(opt.byte_latency_us) * 1000;
+    }
+
+    /**
+     * @brief convert termios speed constant to baud rate
+     *
+     * @param speed speed constant
+     * @return int baud rate, 0 if not supported
+     */
+    int Speed_to_baud(const speed_t speed)
+    {
+        switch (speed)
+        {
+        case B9600:
+            return 9600;
+        case B19200:
+            return 19200;
+        case B38400:
+            return 38400;
+        case B57600:
+            return 57600;
+        case B115200:
+            return 115200;
+        case B230400:
+            return 230400;
+        case B460800:
+            return 460800;
+        case B921600:
+            return 921600;
+        case B1000000:
+            return 1000000;
+        case B2000000:
+            return 2000000;
+        default:
+            return 0;
+        }
+    }
+
+    /**
+     * @brief pick up the baud rate the client set on the pty
+     *
+     * @param fd master side of the pty, shares termios with the slave
+     */
+    void Follow_baud(const int fd)
+    {
+        termios tty;
+        if (tcgetattr(fd, &tty) != 0)
+        {
+            return;
+        }
+
+        int b = Speed_to_baud(cfgetospeed(&tty));
+        if (b > 0 && b != baud)
+        {
+            baud = b;
+            if (opt.verbose)
+            {
+                printf("Baud rate %d\n", baud);
+            }
+        }
+    }
+
+    /********************************* motor **********************************/
+
+    enum Control_mode
+    {
+        MODE_NONE = 0,
+        MODE_POWER,
+        MODE_VELOCITY,
+        MODE_POSITION
+    };
+
+    struct Motor_model
+    {
+        // running or paused/stopped
+        bool running = false;
+        Control_mode mode = MODE_NONE;
+
+        // setpoints
+        double power = 0.0;        // -1000~1000
+        double velocity_set = 0.0; // dps
+        double position_set = 0.0; // deg
+        double max_speed = 0.0;    // dps, 0 for unlimited
+
+        // state
+        double velocity = 0.0; // dps
+        double position = 0.0; // deg, multi-turn
+        double output = 0.0;   // -1000~1000
+        double temperature = 30.0;
+
+        // error flags, latched until cleared
+        uint8_t error = 0;
+        Pid_params pid;
+
+        int64_t last_update_ns = 0;
+    };
+
+    // indexed by motor ID
+    Motor_model motors[max_motor_id + 1];
+
+    // speed reached in power mode at full power, dps
+    constexpr double power_to_speed = 3.0;
+    // proportional gain of the position loop, dps/deg
+    constexpr double position_gain = 20.0;
+    // default max speed of the position loop, dps
+    constexpr double default_max_speed = 720.0;
+    // thermal model: ambient, steady temperature rise at full output, and time constant in s
+    constexpr double ambient_temperature = 30.0;
+    constexpr double full_output_rise = 60.0;
+    // over-temperature protection threshold, degree C
+    constexpr double max_temperature = 80.0;
+    // supply voltage in 0.1V/LSB
+    constexpr uint16_t supply_voltage = 240;
+    // pole pairs, for the phase of phase currents
+    constexpr int pole_pairs = 14;
+    // torque current at full output in A
+    constexpr double full_output_current = 16.5;
+
+    /**
+     * @brief advance the motor model to now
+     */
+    void Update_model(Motor_model &motor, const int64_t now_ns)
+    {
+        if (motor.last_update_ns == 0)
+        {
+            motor.last_update_ns = now_ns;
+            return;
+        }
+
+        // fixed sub steps for stability
+        constexpr double step = 0.0005;
+        double dt_total = double(now_ns - motor.last_update_ns) * 1e-9;
+        motor.last_update_ns = now_ns;
+
+        double tau = opt.tau_ms * 0.001;
+        while (dt_total > 0.0)
+        {
+            double dt = (dt_total < step) ? dt_total : step;
+            dt_total -= dt;
+
+            double target = 0.0;
+            if (motor.running)
+            {
+                switch (motor.mode)
+                {
+                case MODE_POWER:
+                    target = motor.power * power_to_speed;
+                    break;
+                case MODE_VELOCITY:
+                    target = motor.velocity_set;
+                    break;
+                case MODE_POSITION:
+                {
+                    double lim = (motor.max_speed > 0.0) ? motor.max_speed : default_max_speed;
+                    target = position_gain * (motor.position_set - motor.position);
+                    target = (target > lim) ? lim : ((target < -lim) ? -lim : target);
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+
+            // first order velocity dynamics, drag the shaft to stop when not running
+            double acc = (target - motor.velocity) / tau;
+            motor.velocity += acc * dt;
+            motor.position += motor.velocity * dt;
+
+            // output is what it takes to accelerate plus to overcome friction
+            double out = motor.running ? (acc * 0.5 + motor.velocity * opt.friction) : 0.0;
+            motor.output = (out > 1000.0) ? 1000.0 : ((out < -1000.0) ? -1000.0 : out);
+
+            motor.temperature += (ambient_temperature + full_output_rise * (motor.output * motor.output) / 1e6 - motor.temperature) * dt / opt.thermal_tau_s;
+        }
+
+        if (motor.temperature > max_temperature)
+        {
+            motor.error |= ERROR_OVER_TEMPERATURE;
+            motor.running = false;
+        }
+    }
+
+    /**
+     * @brief encoder reading of the current position, wraps at encoder_resolution
+     */
+    uint16_t Encoder_value(const Motor_model &motor)
+    {
+        double turns = motor.position / 360.0;
+        double frac = turns - std::floor(turns);
+        uint32_t enc = uint32_t(frac * double(encoder_resolution));
+        return uint16_t(enc % encoder_resolution);
+    }
+
+    /********************************* serial *********************************/
+
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    struct Sim_stats
+    {
+        uint64_t frames = 0;
+        uint64_t ignored = 0;
+        uint64_t dropped = 0;
+        uint64_t corrupted = 0;
+        uint64_t garbage = 0;
+    } stats;
+
+    /**
+     * @brief write bytes to the master side of pty, paced by byte time
+     */
+    void Paced_write(const int fd, const uint8_t *data, const size_t len, int64_t t_ns)
+    {
+        int64_t byte_ns = Byte_time_ns();
+        for (size_t i = 0; i < len; i++)
+        {
+            t_ns += byte_ns;
+            Sleep_until(t_ns);
+            while (write(fd, data + i, 1) != 1 && (errno == EAGAIN || errno == EINTR))
+            {
+            }
+        }
+    }
+
+    /**
+     * @brief send reply with faults injected
+     *
+     * @param t_ns time when the request was fully received
+     */
+    void Send_reply(const int fd, uint8_t *reply, const size_t len, const int64_t t_ns)
+    {
+        if (uniform(rng) < opt.drop_prob)
+        {
+            stats.dropped++;
+            return;
+        }
+
+        int64_t start = t_ns + int64_t(opt.response_delay_us) * 1000;
+
+        if (uniform(rng) < opt.garbage_prob)
+        {
+            stats.garbage++;
+            uint8_t g = uint8_t(rng());
+            Paced_write(fd, &g, 1, start);
+            start += Byte_time_ns();
+        }
+
+        if (uniform(rng) < opt.corrupt_prob)
+        {
+            stats.corrupted++;
+            reply[rng() % len] ^= uint8_t(1 << (rng() % 8));
+        }
+
+        Paced_write(fd, reply, len, start);
+
+        if (opt.verbose)
+        {
+            printf("  reply :");
+            for (size_t i = 0; i < len; i++)
+            {
+                printf(" %02X", reply[i]);
+            }
+            printf("\n");
+        }
+    }
+
+    /**
+     * @brief build the regular 13 bytes feedback frame
+     */
+    Frame<7> Feedback_frame(const Motor_model &motor, const uint8_t cmd, const uint8_t id)
+    {
+        auto frame = Make_frame<7>(cmd, id);
+        uint8_t *data = frame.data() + header_len;
+        data[0] = uint8_t(int8_t(std::lround(motor.temperature)));
+        Put_le(data + 1, int16_t(std::lround(motor.output)));
+        Put_le(data + 3, int16_t(std::lround(motor.velocity)));
+        Put_le(data + 5, Encoder_value(motor));
+        Seal_frame(frame);
+        return frame;
+    }
+
+    /**
+     * @brief temperature, voltage and error flags frame
+     */
+    Frame<7> Error_state_frame(const Motor_model &motor, const uint8_t cmd, const uint8_t id)
+    {
+        auto frame = Make_frame<7>(cmd, id);
+        uint8_t *data = frame.data() + header_len;
+        data[0] = uint8_t(int8_t(std::lround(motor.temperature)));
+        Put_le(data + 2, supply_voltage);
+        data[6] = motor.error;
+        Seal_frame(frame);
+        return frame;
+    }
+
+    /**
+     * @brief temperature and phase currents frame
+     */
+    Frame<7> Phase_currents_frame(const Motor_model &motor, const uint8_t cmd, const uint8_t id)
+    {
+        // current vector follows the electrical angle of the rotor
+        double theta = motor.position * M_PI / 180.0 * pole_pairs;
+        double amp = motor.output / 1000.0 * full_output_current * 64.0;
+
+        auto frame = Make_frame<7>(cmd, id);
+        uint8_t *data = frame.data() + header_len;
+        data[0] = uint8_t(int8_t(std::lround(motor.temperature)));
+        Put_le(data + 1, int16_t(std::lround(amp * std::cos(theta))));
+        Put_le(data + 3, int16_t(std::lround(amp * std::cos(theta - 2.0 * M_PI / 3.0))));
+        Put_le(data + 5, int16_t(std::lround(amp * std::cos(theta + 2.0 * M_PI / 3.0))));
+        Seal_frame(frame);
+        return frame;
+    }
+
+    /**
+     * @brief act on a request and reply to it
+     *
+     * @param t_ns time when the request was fully received
+     */
+    void Handle_frame(const int fd, const uint8_t *in, const size_t len, const int64_t t_ns)
+    {
+        stats.frames++;
+
+        if (opt.verbose)
+        {
+            printf("request :");
+            for (size_t i = 0; i < len; i++)
+            {
+                printf(" %02X", in[i]);
+            }
+            printf("\n");
+        }
+
+        // somebody else on the bus
+        const uint8_t id = in[2];
+        if (id < opt.id || id >= opt.id + opt.count)
+        {
+            stats.ignored++;
+            return;
+        }
+
+        // unknown command or wrong length, a real driver stays silent
+        const uint8_t cmd = in[1];
+        const uint8_t *data = in + header_len;
+        const Command_descriptor info = Command_info(cmd);
+        if (info.reply == REPLY_NONE || in[3] != info.request_len)
+        {
+            stats.ignored++;
+            return;
+        }
+
+        Motor_model &motor = motors[id];
+        Update_model(motor, t_ns);
+
+        switch (cmd)
+        {
+        case CMD_READ_PID:
+        {
+            auto reply = Make_frame<6>(cmd, id);
+            Put_all(reply.data() + header_len, motor.pid.angle_kp, motor.pid.angle_ki, motor.pid.speed_kp, motor.pid.speed_ki, motor.pid.iq_kp, motor.pid.iq_ki);
+            Seal_frame(reply);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+            return;
+        }
+        case CMD_WRITE_PID_RAM:
+        case CMD_WRITE_PID_ROM:
+            motor.pid.angle_kp = data[0];
+            motor.pid.angle_ki = data[1];
+            motor.pid.speed_kp = data[2];
+            motor.pid.speed_ki = data[3];
+            motor.pid.iq_kp = data[4];
+            motor.pid.iq_ki = data[5];
+            break;
+        case CMD_STOP:
+            motor.running = false;
+            motor.mode = MODE_NONE;
+            break;
+        case CMD_PAUSE:
+            motor.running = false;
+            break;
+        case CMD_RESUME:
+            motor.running = (motor.error == 0);
+            break;
+        case CMD_READ_MULTI_TURN_ANGLE:
+        {
+            auto reply = Make_frame<8>(cmd, id);
+            Put_le(reply.data() + header_len, int64_t(std::llround(motor.position * 100.0)));
+            Seal_frame(reply);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+            return;
+        }
+        case CMD_CLEAR_LOOPS:
+            motor.position -= 360.0 * std::floor(motor.position / 360.0);
+            break;
+        case CMD_READ_SINGLE_TURN_ANGLE:
+        {
+            auto reply = Make_frame<4>(cmd, id);
+            Put_le(reply.data() + header_len, uint32_t(Encoder_value(motor)) * 36000U / encoder_resolution);
+            Seal_frame(reply);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+            return;
+        }
+        case CMD_CLEAR_ERRORS:
+            // flags stay while the cause is still there
+            if (motor.temperature <= max_temperature)
+            {
+                motor.error &= uint8_t(~ERROR_OVER_TEMPERATURE);
+            }
+            // fall through
+        case CMD_READ_ERROR_STATE:
+        {
+            auto reply = Error_state_frame(motor, cmd, id);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+            return;
+        }
+        case CMD_READ_PHASE_CURRENTS:
+        {
+            auto reply = Phase_currents_frame(motor, cmd, id);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+            return;
+        }
+        case CMD_READ_MOTOR_STATE:
+            break;
+        case CMD_POWER:
+        case CMD_TORQUE:
+            // torque current is treated as power, -2000~2000 for full scale
+            motor.mode = MODE_POWER;
+            motor.power = (cmd == CMD_POWER) ? Get_le<int16_t>(data) : Get_le<int16_t>(data) * 0.5;
+            motor.running = (motor.error == 0);
+            break;
+        case CMD_VELOCITY:
+            motor.mode = MODE_VELOCITY;
+            motor.velocity_set = Get_le<int32_t>(data) * 0.01;
+            motor.running = (motor.error == 0);
+            break;
+        case CMD_MULTI_LOOP_POSITION_1:
+        case CMD_MULTI_LOOP_POSITION_2:
+            motor.mode = MODE_POSITION;
+            motor.position_set = Get_le<int64_t>(data) * 0.01;
+            motor.max_speed = (cmd == CMD_MULTI_LOOP_POSITION_2) ? Get_le<uint32_t>(data + 8) * 0.01 : 0.0;
+            motor.running = (motor.error == 0);
+            break;
+        default:
+            stats.ignored++;
+            return;
+        }
+
+        if (info.reply == REPLY_FEEDBACK)
+        {
+            auto reply = Feedback_frame(motor, cmd, id);
+            Send_reply(fd, reply.data(), reply.size(), t_ns);
+        }
+        else
+        {
+            // echo the request
+            uint8_t reply[max_frame_len];
+            memcpy(reply, in, len);
+            Send_reply(fd, reply, len, t_ns);
+        }
+    }
+
+    void Print_usage(const char *name)
+    {
+        printf("Usage:\n\n\t%s [options]\n\n", name);
+        printf("\t-l path   create a symlink to the pty at path, e.g. /tmp/ttyMOTOR\n");
+        printf("\t-i id     motor ID, or ID of the first motor (default 1)\n");
+        printf("\t-n count  number of motors with consecutive IDs (default 1)\n");
+        printf("\t-b baud   emulated baud rate, 0 to follow the pty (default 115200)\n");
+        printf("\t-L us     extra latency per byte (default 0)\n");
+        printf("\t-r us     driver processing time before reply (default 200)\n");
+        printf("\t-t ms     time constant of the velocity loop (default 50)\n");
+        printf("\t-F out    output per dps held against friction (default 0.2)\n");
+        printf("\t-T s      thermal time constant (default 300)\n");
+        printf("\t-d p      probability to drop a reply\n");
+        printf("\t-c p      probability to corrupt one byte of a reply\n");
+        printf("\t-g p      probability to send a garbage byte before a reply\n");
+        printf("\t-s seed   random seed for fault injection\n");
+        printf("\t-v        print every frame\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "l:i:n:b:L:r:t:F:T:d:c:g:s:vh")) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            opt.link = optarg;
+            break;
+        case 'i':
+            opt.id = uint8_t(atoi(optarg));
+            break;
+        case 'n':
+            opt.count = atoi(optarg);
+            break;
+        case 'b':
+            opt.baud = atoi(optarg);
+            break;
+        case 'L':
+            opt.byte_latency_us = atoi(optarg);
+            break;
+        case 'r':
+            opt.response_delay_us = atoi(optarg);
+            break;
+        case 't':
+            opt.tau_ms = atof(optarg);
+            break;
+        case 'F':
+            opt.friction = atof(optarg);
+            break;
+        case 'T':
+            opt.thermal_tau_s = atof(optarg);
+            break;
+        case 'd':
+            opt.drop_prob = atof(optarg);
+            break;
+        case 'c':
+            opt.corrupt_prob = atof(optarg);
+            break;
+        case 'g':
+            opt.garbage_prob = atof(optarg);
+            break;
+        case 's':
+            opt.seed = unsigned(atoi(optarg));
+            break;
+        case 'v':
+            opt.verbose = true;
+            break;
+        default:
+            Print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.baud < 0 || opt.tau_ms <= 0.0 || opt.friction < 0.0 || opt.thermal_tau_s <= 0.0 || opt.id == 0 || opt.count < 1 || opt.id + opt.count - 1 > max_motor_id)
+    {
+        Print_usage(argv[0]);
+        return 1;
+    }
+
+    rng.seed(opt.seed);
+    baud = opt.baud;
+
+    // open pty
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+    {
+        printf("Pty creation failed!\n");
+        return 1;
+    }
+    const char *slave_name = ptsname(fd);
+
+    // hold the slave open so that clients could come and go, and make it raw
+    // so that the line discipline does not echo or translate anything
+    int slave_fd = open(slave_name, O_RDWR | O_NOCTTY);
+    termios tty;
+    if (slave_fd < 0 || tcgetattr(slave_fd, &tty) != 0)
+    {
+        printf("Pty setup failed!\n");
+        return 1;
+    }
+    cfmakeraw(&tty);
+    if (opt.baud == 0)
+    {
+        baud = 115200;
+        cfsetispeed(&tty, B115200);
+        cfsetospeed(&tty, B115200);
+    }
+    tcsetattr(slave_fd, TCSANOW, &tty);
+
+    if (opt.link)
+    {
+        unlink(opt.link);
+        if (symlink(slave_name, opt.link) != 0)
+        {
+            printf("Symlink %s failed!\n", opt.link);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, On_signal);
+    signal(SIGTERM, On_signal);
+
+    printf("MotorSim ID %d~%d on %s%s%s, baud rate ", opt.id, opt.id + opt.count - 1, slave_name, opt.link ? " -> " : "", opt.link ? opt.link : "");
+    if (opt.baud == 0)
+    {
+        printf("follows the pty\n");
+    }
+    else
+    {
+        printf("%d\n", opt.baud);
+    }
+    fflush(stdout);
+
+    Frame_parser parser;
+    parser.Expect_any();
+
+    while (!quit)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            continue;
+        }
+
+        uint8_t buf[256];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            continue;
+        }
+
+        if (opt.baud == 0)
+        {
+            Follow_baud(fd);
+        }
+
+        // bytes arrive in a burst on a pty, the last one would have taken
+        // this long on a real line
+        int64_t t_ns = Now_ns();
+        int64_t byte_ns = Byte_time_ns();
+        size_t pos = 0, used = 0;
+        while (pos < size_t(n))
+        {
+            if (parser.Push(buf + pos, size_t(n) - pos, used) == PARSE_OK)
+            {
+                Handle_frame(fd, parser.Data(), parser.Length(), t_ns + int64_t(parser.Length()) * byte_ns);
+            }
+            pos += used;
+        }
+
+        if (opt.verbose)
+        {
+            fflush(stdout);
+        }
+    }
+
+    printf("\nMotorSim: %lu frames, %lu ignored, %lu dropped, %lu corrupted, %lu garbage\n",
+           (unsigned long)stats.frames, (unsigned long)stats.ignored, (unsigned long)stats.dropped,
+           (unsigned long)stats.corrupted, (unsigned long)stats.garbage);
+
+    if (opt.link)
+    {
+        unlink(opt.link);
+    }
+    close(slave_fd);
+    close(fd);
+
+    return 0;
+}